@@ -10,8 +10,38 @@
 
 *******************************************************************************/
 
+#define _GNU_SOURCE
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <sys/random.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <link.h>
+#include <dlfcn.h>
+#include <math.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -19,9 +49,75 @@
 #include <termio.h>
 #include <dirent.h>
 #include <time.h>
+#include <stdint.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <arpa/inet.h>
 
 #define MAX_LOGIN 1
 #define BUF_SIZE 1024
+#define WL_NAME_LEN 48
+#define WL_HIT_SLOTS 1024	// 규칙 수 상한 (hit 카운터 테이블)
+#define WL_HIT_SHARDS 8		// CPU 별로 나눠 쓰는 카운터 조각 수
+#define EV_RING 256		// 비동기 이벤트 큐 슬롯 수 (2의 거듭제곱)
+#define EV_LEN 512
+#define EV_EXIT_WAIT_MS 200	// 종료할 때 남은 이벤트를 기다리는 최대 시간
+#define ADMIT_RATE 20		// 호스트 전체 초당 신규 로그인 수
+#define ADMIT_BURST 40		// 한꺼번에 허용하는 로그인 수
+#define ADMIT_MAX_DELAY_MS 1500	// 이보다 오래 기다려야 하면 바로 거절
+#define KDF_ITERATIONS 100000	// PBKDF2-HMAC-SHA256 반복 횟수
+#define KDF_SALT_LEN 16
+#define CRED_SLOTS 4096		// cred_store 레코드 수 (계정 수 상한)
+#define CRED_USER_LEN 32
+#define JUMP_SLOTS 1024		// j 명령이 기억하는 디렉터리 수
+#define JUMP_PATH_LEN 256
+#define JUMP_HALF_LIFE (7 * 86400.0)	// 점수가 반으로 줄어드는 시간 (초)
+#define CACHE_PATH_LEN 256
+#define PROF_HZ 997		// 프로파일러 샘플링 주기 (CPU 시간 기준)
+#define PROF_SAMPLES 8192	// 한 번 켰을 때 모으는 최대 샘플 수
+#define PROF_DEPTH 48
+#define BENCH_SIZE_BUDGET (512 * 1024)	// --bench-startup: lsh 실행 파일 크기 상한 (바이트)
+#define BENCH_MINFLT_BUDGET 250	// --bench-startup: warm 시작의 minor fault 상한
+#define BENCH_LOGIN_TIMEOUT_MS 10000	// --bench-login: 한 단계 (프롬프트, 로그인) 를 기다리는 최대 시간
+#define BENCH_LOGIN_MAX_RUNS 100
+#define ZYGOTE_POOL 4		// --zygote: 미리 띄워 두는 lsh 수
+#define ZYGOTE_ENV_MAX 32768	// 넘겨받는 환경변수 크기 상한
+#define SESSION_SLOTS 256	// sessions: 함께 기록하는 세션 수 상한
+#define AUDIT_BATCH (64 * 1024)	// --audit: fanotify 이벤트를 한 번에 읽는 크기
+#define AUDIT_PID_CACHE 4096	// --audit: pid 가 어느 세션 것인지 기억하는 칸 수
+#define AUDIT_SEEN 4096		// --audit: 한 묶음 안의 중복을 거르는 표 크기 (2의 거듭제곱)
+#define AUDIT_MAX_DEPTH 64	// --audit: 세션을 찾아 부모를 따라 올라가는 최대 단계
+#define RELAY_CHUNK (1024 * 1024)	// relay: 방향마다 파이프 크기
+#define MEMO_BUDGET (64LL * 1024 * 1024)	// memo: 저장한 출력 전체 크기 상한 (바이트)
+#define MEMO_TTL 300		// memo: --ttl 을 안 주면 결과를 쓰는 시간 (초), 0 이면 무기한
+#define MEMO_MAX_ITEMS 32	// memo: --input, --env 각각의 최대 개수
+#define WATCH_INTERVAL 2		// watch: -n 를 안 주면 다시 실행하는 간격 (초)
+#define WATCH_SETTLE_MS 50	// watch: 파일 변경이 이어질 때 한 번으로 묶는 시간
+#define WATCH_SETTLE_MAX_MS 200	// watch: 변경이 멈추지 않아도 이만큼 묶은 뒤에는 실행
+#define WATCH_OUTPUT_MAX (256 * 1024)	// watch: 화면에 쓰려고 모으는 출력 크기 상한
+#define WATCH_MAX_PATHS 64
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define VIEW_STRIDE 64		// view: 줄 색인에 시작 위치를 적어 두는 줄 간격
+#define VIEW_CHUNK_MIN (4 * 1024 * 1024)	// view: 색인을 나눠 만드는 조각의 최소 크기
+#define VIEW_SEARCH_STEP (8 * 1024 * 1024)	// view: 검색을 취소할 수 있는 간격 (바이트)
+#define VIEW_PATTERN_MAX 256
+#define JL_MAX_TERMS 16		// jl: -w 조건, -p 경로 각각의 최대 개수
+#define JL_MAX_DEPTH 16		// jl: 경로 한 개의 최대 단계 수
+#define JL_WAVE 4		// jl: 한 번에 CPU 하나당 맡기는 조각 수 (조각들의 출력을 차례대로 쓰고 다음으로)
+#define JL_CHUNK_MIN (1024 * 1024)
+#define JL_CHUNK_MAX (16 * 1024 * 1024)
+#define HASHSUM_READ (1024 * 1024)	// hashsum: 파일 하나에서 한 번에 읽는 크기
+#define HASHSUM_ALIGN 4096	// hashsum: 읽기 버퍼 정렬
+#define HASHSUM_LANES 8		// hashsum: 스레드 하나가 함께 해시하는 파일 수 (sha256_x8 의 칸 수)
+#define HASHSUM_X8_MIN 2	// hashsum: 이만큼 칸이 차 있어야 sha256_x8 을 쓴다 (8 칸 한 번 ≈ 블록 두 개)
+#define PCOPY_THREADS 16	// pcopy: 기본 스레드 수 (CPU 보다 디스크/네트워크를 기다리는 일이라 CPU 수와 상관없이)
+#define PCOPY_SPLIT (64 * 1024 * 1024)	// pcopy: 이보다 큰 파일은 조각으로 나눠 여러 스레드가 복사
+#define PCOPY_CHUNK (16 * 1024 * 1024)	// pcopy: copy_file_range 한 번 / 조각 하나의 크기
+#define PCOPY_BUF (1024 * 1024)	// pcopy: copy_file_range 를 못 쓸 때 read/write 버퍼
+#define LSH_SUGGEST_MAX 3	// 없는 명령어일 때 보여줄 후보 수
+#define LSH_SUGGEST_MAXLEN 64
+#define LSH_PROMPT_DEFAULT "%u:%w%b [%?] jobs:%j"	// LSH_PROMPT 환경변수로 바꿀 수 있음
 
 /*
   Function Declarations for builtin shell commands:
@@ -29,6 +125,46 @@
 int lsh_cd(char **args);
 int lsh_help(char **args);
 int lsh_exit(char **args);
+int lsh_passwd(char **args);
+int lsh_execute(char **args);
+char **lsh_split_line(char *line);
+int lsh_jump(char **args);
+int lsh_export(char **args);
+int lsh_unset(char **args);
+int lsh_run(char **args);
+void lsh_suggest(const char *name);
+void lsh_state_init(void);
+void lsh_jump_visit(void);
+int lsh_mem(char **args);
+int lsh_relay(char **args);
+int lsh_memo(char **args);
+int lsh_watch(char **args);
+int lsh_view(char **args);
+int lsh_jl(char **args);
+int lsh_hashsum(char **args);
+int lsh_pcopy(char **args);
+void lsh_mem_init(void);
+
+/*
+  Subsystems that heap allocations are accounted to (see lsh_malloc()).
+ */
+enum lsh_mem_tag {
+  MEM_READER,
+  MEM_TOKENIZER,
+  MEM_HISTORY,
+  MEM_ENV,
+  MEM_CACHES,
+  MEM_AUTH,
+  MEM_BUILTINS,               // working memory of hashsum, pcopy, jl, view, watch, relay
+  MEM_TAGS
+};
+
+void *lsh_malloc(enum lsh_mem_tag tag, size_t size);
+void *lsh_calloc(enum lsh_mem_tag tag, size_t n, size_t size);
+void *lsh_realloc(enum lsh_mem_tag tag, void *ptr, size_t size);
+char *lsh_strdup(enum lsh_mem_tag tag, const char *s);
+void lsh_free(void *ptr);
+void lsh_mem_mapped(enum lsh_mem_tag tag, ssize_t delta);
 
 /*
   추가함수선언
@@ -37,9 +173,223 @@ int get_pid(char *s);
 int check_logon(char* ip_addr);
 void login(char* ip_addr);
 int white_list(char* ip_addr);
+int admit_rate(char* ip_addr);
 void store_login_log(char* log);
 void store_failed_log(char* log);
 
+char lsh_user[BUF_SIZE];	// 로그인한 계정
+int lsh_last_status;		// 마지막 명령의 종료 상태
+
+/*
+  계정 저장소 (cred_store) 와 KDF
+*/
+struct sha256_ctx
+{
+	uint32_t h[8];
+	uint64_t len;
+	uint8_t buf[64];
+	size_t n;
+};
+
+#define CRED_USED 0x1
+#define CRED_NEEDS_RESET 0x2	// 다음 로그인 때 비밀번호를 바꿔야 함
+#define CRED_LOCKED 0x4		// 비밀번호 없음, 로그인 불가
+
+struct cred_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t record_size;
+	uint8_t pad[112];
+};
+
+struct cred_record
+{
+	uint32_t seq;		// seqlock, 홀수면 쓰는 중
+	uint32_t crc;		// crc32 of user .. end
+	char user[CRED_USER_LEN];
+	uint8_t salt[KDF_SALT_LEN];
+	uint32_t iterations;
+	uint32_t flags;		// 0 = empty slot
+	uint8_t hash[32];
+	uint8_t pad[32];
+};
+
+struct cred_store
+{
+	int fd;
+	struct cred_header *hdr;
+	struct cred_record *rec;
+};
+
+void sha256_block(uint32_t h[8], const uint8_t *p);
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t out[32]);
+int sha256_x8_fast(void);
+void sha256_x8(uint32_t st[8][8], const uint8_t *p[8], size_t nblocks);
+void kdf_derive(const char *pw, const uint8_t *salt, size_t salt_len, uint32_t iterations, uint8_t out[32]);
+struct cred_store *cred_open(int create);
+void cred_close(struct cred_store *store);
+int cred_verify(const char *user, const char *pw, uint32_t *flags);
+void cred_fill(struct cred_record *rec, const char *user, const char *pw, uint32_t flags);
+int cred_update(const char *user, const char *pw, uint32_t flags);
+void legacy_encode(const char *pw, char *out, size_t size);
+int legacy_verify(const char *user, const char *pw);
+int legacy_decode(const char *enc, char *out, size_t size);
+void read_password(char *buf, int size);
+
+/*
+  화이트리스트 컴파일러
+*/
+struct wl_rule
+{
+	uint32_t addr;		// prefix network address, host byte order
+	uint32_t plen;		// prefix length 0..32
+};
+
+struct wl_line
+{
+	uint32_t start, end;	// IPv4 range, host byte order
+	uint32_t plen;
+	int line;		// line number in list
+	int kind;		// 4 = IPv4 prefix, 0 = exact name
+	char text[WL_NAME_LEN];	// normalised form, hit 카운터의 키
+};
+
+struct whitelist
+{
+	int nrules;
+	struct wl_rule *rules;	// sorted, disjoint, minimal IPv4 prefixes
+	int nnames;
+	char (*names)[WL_NAME_LEN];	// sorted exact-match entries (IPv6, hostnames)
+	int nlines;
+	struct wl_line *lines;	// usable lines of list, in file order
+	uint32_t *rule_lines;	// IPv4 lines by rule, longest prefix first
+	uint32_t *rule_first;	// rule r: rule_lines[rule_first[r] .. rule_first[r + 1])
+};
+
+int wl_compile(FILE *fp, struct whitelist *wl, FILE *report);
+int wl_match(const struct whitelist *wl, const char *ip_addr);
+void wl_write(const struct whitelist *wl, FILE *out);
+void wl_free(struct whitelist *wl);
+
+/*
+  공유 상태 파일 (lsh 를 시작한 디렉터리 기준)
+*/
+char lsh_state_dir[PATH_MAX / 2] = ".";
+int lsh_state_path(char *buf, size_t size, const char *name);
+int lsh_user_state_path(char *buf, size_t size, const char *name);
+void *lsh_map_shared(const char *name, size_t size);
+int lsh_nproc(void);
+void lsh_parallel(int n, void (*fn)(int i, void *arg), void *arg);
+uint64_t lsh_simd_eq64(const char *p, unsigned char c);
+uint64_t lsh_simd_eq_tail(const char *p, size_t n, unsigned char c);
+void lsh_simd_json64(const char *p, uint64_t *quote, uint64_t *backslash, uint64_t *structural);
+
+/*
+  화이트리스트 규칙별 hit 카운터 (wl_hits 파일을 모든 세션이 공유)
+*/
+struct wl_hit_slot
+{
+	uint64_t key;		// hash of the list line text, 0 = empty, WL_HIT_DEAD = removed
+	char text[WL_NAME_LEN];
+};
+
+struct wl_hit_count
+{
+	uint64_t count;
+	int64_t last_hit;
+};
+
+struct wl_hits
+{
+	uint32_t magic;
+	uint32_t version;
+	int64_t created;
+	struct wl_hit_slot slot[WL_HIT_SLOTS];
+	// shard 마다 따로 두어 다른 CPU 끼리 같은 캐시라인을 건드리지 않게 한다
+	struct wl_hit_count shard[WL_HIT_SHARDS][WL_HIT_SLOTS] __attribute__((aligned(64)));
+};
+
+struct wl_hits *wl_hits_open(void);
+void wl_hit(struct wl_hits *hits, const struct whitelist *wl, int matched, const char *ip_addr);
+void wl_hits_prune(struct wl_hits *hits, const struct whitelist *wl);
+
+/*
+  세션 공유 캐시
+*/
+struct lsh_cache;
+struct lsh_cache *lsh_cache_open(void);
+void lsh_cache_refresh(void);
+const char *lsh_cache_command(const char *name);
+void lsh_cache_each_command(void (*fn)(const char *name, void *arg), void *arg);
+int lsh_cache_command_table_matches(void);
+
+/*
+  비동기 이벤트 경로
+  이벤트는 잠금 없는 큐에 넣고 별도 스레드가 event_log 에 JSON 한 줄씩 기록한다.
+  큐가 가득 차면 기다리지 않고 버린다.
+*/
+struct lsh_event
+{
+	void (*fn)(struct lsh_event *ev, FILE *out);	// NULL 이면 data 를 그대로 기록
+	char data[EV_LEN];
+};
+
+void lsh_event(const char *fmt, ...);
+void lsh_event_call(void (*fn)(struct lsh_event *, FILE *), const char *fmt, ...);
+void lsh_event_write(FILE *out, const char *fmt, ...);
+void lsh_json_str(char *out, size_t size, const char *in);
+void lsh_event_stop(void);
+void wl_shadow_eval(struct lsh_event *ev, FILE *out);
+
+/*
+  샘플링 프로파일러 (SIGUSR2 로 켜고 끔)
+*/
+void prof_init(void);
+void prof_poll(void);
+void prof_thread_init(void);
+
+/*
+  관리자 명령 (lsh --<command> ...), sshd 를 거치지 않고 직접 실행
+*/
+int admin_compile_list(int argc, char **argv);
+int admin_list_unused(int argc, char **argv);
+int admin_provision(int argc, char **argv);
+int admin_bench_startup(int argc, char **argv);
+int admin_bench_login(int argc, char **argv);
+int admin_zygote(int argc, char **argv);
+int admin_audit(int argc, char **argv);
+void zygote_handoff(void);
+void session_register(const char *ip_addr);
+int lsh_session(void);
+
+char *admin_str[] = {
+  "--compile-list",
+  "--list-unused",
+  "--provision",
+  "--bench-startup",
+  "--bench-login",
+  "--zygote",
+  "--audit",
+};
+
+int (*admin_func[]) (int, char **) = {
+  &admin_compile_list,
+  &admin_list_unused,
+  &admin_provision,
+  &admin_bench_startup,
+  &admin_bench_login,
+  &admin_zygote,
+  &admin_audit,
+};
+
+int lsh_num_admin() {
+  return sizeof(admin_str) / sizeof(char *);
+}
+
 /*
   List of builtin commands, followed by their corresponding functions.
  */
@@ -47,12 +397,36 @@ char *builtin_str[] = {
   "cd",
   "help",
   "exit",
+  "passwd",
+  "j",
+  "export",
+  "unset",
+  "mem",
+  "relay",
+  "memo",
+  "watch",
+  "view",
+  "jl",
+  "hashsum",
+  "pcopy",
 };
 
 int (*builtin_func[]) (char **) = {
   &lsh_cd,
   &lsh_help,
   &lsh_exit,
+  &lsh_passwd,
+  &lsh_jump,
+  &lsh_export,
+  &lsh_unset,
+  &lsh_mem,
+  &lsh_relay,
+  &lsh_memo,
+  &lsh_watch,
+  &lsh_view,
+  &lsh_jl,
+  &lsh_hashsum,
+  &lsh_pcopy,
 };
 
 int lsh_num_builtins() {
@@ -75,6 +449,8 @@ int lsh_cd(char **args)
   } else {
     if (chdir(args[1]) != 0) {
       perror("lsh");
+    } else {
+      lsh_jump_visit();
     }
   }
   return 1;
@@ -111,416 +487,10484 @@ int lsh_exit(char **args)
 }
 
 /**
-  @brief Launch a program and wait for it to terminate.
-  @param args Null terminated list of arguments (including program).
-  @return Always returns 1, to continue execution.
+   @brief Builtin command: change the password of the logged in account.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
  */
-int lsh_launch(char **args)
+int lsh_passwd(char **args)
 {
-  pid_t pid;
-  int status;
+  char cur[BUF_SIZE], pw[BUF_SIZE], again[BUF_SIZE], user_json[BUF_SIZE * 2];
+  int ok;
 
-  pid = fork();
-  if (pid == 0) {
-    // Child process
-    if (execvp(args[0], args) == -1) {
-      perror("lsh");
-    }
-    exit(EXIT_FAILURE);
-  } else if (pid < 0) {
-    // Error forking
-    perror("lsh");
-  } else {
-    // Parent process
-    do {
-      waitpid(pid, &status, WUNTRACED);
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+  printf("Current PW : ");
+  fflush(stdout);
+  read_password(cur, sizeof(cur));
+  ok = cred_verify(lsh_user, cur, NULL);
+  if (ok < 0) {
+    ok = legacy_verify(lsh_user, cur);
+  }
+  explicit_bzero(cur, sizeof(cur));
+  if (ok != 1) {
+    fprintf(stderr, "\npasswd: authentication failure\n");
+    return 1;
   }
 
+  printf("\nNew PW : ");
+  fflush(stdout);
+  read_password(pw, sizeof(pw));
+  printf("\nRetype new PW : ");
+  fflush(stdout);
+  read_password(again, sizeof(again));
+  printf("\n");
+
+  if (strcmp(pw, again) != 0) {
+    fprintf(stderr, "passwd: passwords do not match\n");
+  } else if (pw[0] == '\0') {
+    fprintf(stderr, "passwd: empty password\n");
+  } else if (cred_update(lsh_user, pw, 0) != 0) {
+    fprintf(stderr, "passwd: failed to update cred_store\n");
+  } else {
+    printf("passwd: password updated\n");
+    lsh_json_str(user_json, sizeof(user_json), lsh_user);
+    lsh_event("\"event\":\"passwd\",\"user\":\"%s\"", user_json);
+  }
+  explicit_bzero(pw, sizeof(pw));
+  explicit_bzero(again, sizeof(again));
   return 1;
 }
 
-/**
-   @brief Execute shell built-in or launch program.
-   @param args Null terminated list of arguments.
-   @return 1 if the shell should continue running, 0 if it should terminate
+/*
+  Allocation accounting.
+
+  Heap memory the shell owns is allocated through lsh_malloc() and friends,
+  tagged with the subsystem it belongs to.  Each block carries a small
+  header with its size and tag, so lsh_free() needs no tag and the counters
+  stay exact.  File mappings (the jump index, the shared cache, the
+  credential store) are counted separately as mapped bytes.
  */
-int lsh_execute(char **args)
-{
-  int i;
+struct lsh_mem_stat {
+  size_t cur;                 // live heap bytes
+  size_t peak;                // high-water mark of cur
+  size_t mapped;              // bytes of file mappings
+  uint64_t allocs;
+  uint64_t frees;
+};
 
-  if (args[0] == NULL) {
-    // An empty command was entered.
-    return 1;
-  }
+union lsh_mem_head {
+  struct {
+    size_t size;
+    enum lsh_mem_tag tag;
+  } h;
+  max_align_t align;          // keep the caller's block aligned
+};
 
-  for (i = 0; i < lsh_num_builtins(); i++) {
-    if (strcmp(args[0], builtin_str[i]) == 0) {
-      return (*builtin_func[i])(args);
-    }
-  }
+static const char *lsh_mem_names[MEM_TAGS] = {
+  "reader", "tokenizer", "history", "env", "caches", "auth", "builtins",
+};
 
-  return lsh_launch(args);
+static struct lsh_mem_stat lsh_mem_stats[MEM_TAGS];
+static struct timespec lsh_mem_start;
+
+static void lsh_mem_add(enum lsh_mem_tag tag, size_t size)
+{
+  struct lsh_mem_stat *st = &lsh_mem_stats[tag];
+  size_t cur = __atomic_add_fetch(&st->cur, size, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&st->peak, __ATOMIC_RELAXED);
+
+  while (cur > peak && !__atomic_compare_exchange_n(&st->peak, &peak, cur, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
 }
 
 /**
-   @brief Read a line of input from stdin.
-   @return The line from stdin.
+   @brief Allocate size bytes on behalf of a subsystem.
+   @return The block, or NULL if malloc failed.
  */
-char *lsh_read_line(void)
+void *lsh_malloc(enum lsh_mem_tag tag, size_t size)
 {
-#ifdef LSH_USE_STD_GETLINE
-  char *line = NULL;
-  ssize_t bufsize = 0; // have getline allocate a buffer for us
-  if (getline(&line, &bufsize, stdin) == -1) {
-    if (feof(stdin)) {
-      exit(EXIT_SUCCESS);  // We recieved an EOF
-    } else  {
-      perror("lsh: getline\n");
-      exit(EXIT_FAILURE);
-    }
-  }
-  return line;
-#else
-#define LSH_RL_BUFSIZE 1024
-  int bufsize = LSH_RL_BUFSIZE;
-  int position = 0;
-  char *buffer = malloc(sizeof(char) * bufsize);
-  int c;
+  union lsh_mem_head *head = malloc(sizeof(*head) + size);
 
-  if (!buffer) {
-    fprintf(stderr, "lsh: allocation error\n");
-    exit(EXIT_FAILURE);
+  if (head == NULL) {
+    return NULL;
   }
+  head->h.size = size;
+  head->h.tag = tag;
+  lsh_mem_add(tag, size);
+  __atomic_add_fetch(&lsh_mem_stats[tag].allocs, 1, __ATOMIC_RELAXED);
+  return head + 1;
+}
 
-  while (1) {
-    // Read a character
-    c = getchar();
-
-    if (c == EOF) {
-      exit(EXIT_SUCCESS);
-    } else if (c == '\n') {
-      buffer[position] = '\0';
-      return buffer;
-    } else {
-      buffer[position] = c;
-    }
-    position++;
+void *lsh_calloc(enum lsh_mem_tag tag, size_t n, size_t size)
+{
+  void *ptr;
 
-    // If we have exceeded the buffer, reallocate.
-    if (position >= bufsize) {
-      bufsize += LSH_RL_BUFSIZE;
-      buffer = realloc(buffer, bufsize);
-      if (!buffer) {
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
-      }
-    }
+  if (__builtin_mul_overflow(n, size, &size) || (ptr = lsh_malloc(tag, size)) == NULL) {
+    return NULL;
   }
-#endif
+  return memset(ptr, 0, size);
 }
 
-#define LSH_TOK_BUFSIZE 64
-#define LSH_TOK_DELIM " \t\r\n\a"
 /**
-   @brief Split a line into tokens (very naively).
-   @param line The line.
-   @return Null-terminated array of tokens.
+   @brief Resize a block.  A block keeps the tag it was allocated with; tag
+   is only used when ptr is NULL.
+   @return The block, or NULL (with ptr untouched) if realloc failed.
  */
-char **lsh_split_line(char *line)
+void *lsh_realloc(enum lsh_mem_tag tag, void *ptr, size_t size)
 {
-  int bufsize = LSH_TOK_BUFSIZE, position = 0;
-  char **tokens = malloc(bufsize * sizeof(char*));
-  char *token, **tokens_backup;
+  union lsh_mem_head *head;
+  size_t old;
 
-  if (!tokens) {
-    fprintf(stderr, "lsh: allocation error\n");
-    exit(EXIT_FAILURE);
+  if (ptr == NULL) {
+    return lsh_malloc(tag, size);
+  }
+  head = (union lsh_mem_head *)ptr - 1;
+  old = head->h.size;
+  head = realloc(head, sizeof(*head) + size);
+  if (head == NULL) {
+    return NULL;
   }
+  head->h.size = size;
+  __atomic_sub_fetch(&lsh_mem_stats[head->h.tag].cur, old, __ATOMIC_RELAXED);
+  lsh_mem_add(head->h.tag, size);
+  return head + 1;
+}
 
-  token = strtok(line, LSH_TOK_DELIM);
-  while (token != NULL) {
-    tokens[position] = token;
-    position++;
+char *lsh_strdup(enum lsh_mem_tag tag, const char *s)
+{
+  size_t len = strlen(s) + 1;
+  char *copy = lsh_malloc(tag, len);
 
-    if (position >= bufsize) {
-      bufsize += LSH_TOK_BUFSIZE;
-      tokens_backup = tokens;
-      tokens = realloc(tokens, bufsize * sizeof(char*));
-      if (!tokens) {
-		free(tokens_backup);
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
-      }
-    }
+  return copy ? memcpy(copy, s, len) : NULL;
+}
+
+void lsh_free(void *ptr)
+{
+  union lsh_mem_head *head;
 
-    token = strtok(NULL, LSH_TOK_DELIM);
+  if (ptr == NULL) {
+    return;
   }
-  tokens[position] = NULL;
-  return tokens;
+  head = (union lsh_mem_head *)ptr - 1;
+  __atomic_sub_fetch(&lsh_mem_stats[head->h.tag].cur, head->h.size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&lsh_mem_stats[head->h.tag].frees, 1, __ATOMIC_RELAXED);
+  free(head);
 }
 
 /**
-   @brief Loop getting input and executing it.
+   @brief Record a file mapping of delta bytes (negative when unmapped).
  */
-void lsh_loop(void)
+void lsh_mem_mapped(enum lsh_mem_tag tag, ssize_t delta)
 {
-  char *line;
-  char **args;
-  int status;
+  __atomic_add_fetch(&lsh_mem_stats[tag].mapped, (size_t)delta, __ATOMIC_RELAXED);
+}
 
-  do {
-    printf("> ");
-    line = lsh_read_line();
-    args = lsh_split_line(line);
-    status = lsh_execute(args);
+static double lsh_mem_uptime(void)
+{
+  struct timespec now;
+  double secs;
 
-    free(line);
-    free(args);
-  } while (status);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  secs = (now.tv_sec - lsh_mem_start.tv_sec) + (now.tv_nsec - lsh_mem_start.tv_nsec) / 1e9;
+  return secs > 1e-3 ? secs : 1e-3;
 }
 
-int get_pid(char *s)
+/**
+   @brief Builtin command: print memory use per subsystem.
+   @param args List of args.  Not examined.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_mem(char **args)
 {
-	int len, i;
-	
-	len = strlen(s);
-	for(i=0;i<len;i++)
-	{
-	  if((s[i] < '0' || s[i] > '9'))
-		{
-			return -1;
-		}
-	}
-	return atoi(s);
+  struct lsh_mem_stat st, total = { 0 };
+  double secs = lsh_mem_uptime();
+  int i;
+
+  printf("%-10s %10s %10s %10s %10s %9s %10s\n",
+         "subsystem", "current", "peak", "allocs", "frees", "allocs/s", "mapped");
+  for (i = 0; i < MEM_TAGS; i++) {
+    st = lsh_mem_stats[i];
+    printf("%-10s %10zu %10zu %10llu %10llu %9.1f %10zu\n", lsh_mem_names[i],
+           st.cur, st.peak, (unsigned long long)st.allocs, (unsigned long long)st.frees,
+           st.allocs / secs, st.mapped);
+    total.cur += st.cur;
+    total.peak += st.peak;
+    total.allocs += st.allocs;
+    total.frees += st.frees;
+    total.mapped += st.mapped;
+  }
+  printf("%-10s %10zu %10zu %10llu %10llu %9.1f %10zu\n", "total",
+         total.cur, total.peak, (unsigned long long)total.allocs, (unsigned long long)total.frees,
+         total.allocs / secs, total.mapped);
+  return 1;
 }
 
-int getch(void)
+static pid_t lsh_mem_owner;
+
+/**
+   @brief At logout, write the per-subsystem figures to the event log as
+   "mem":{"<subsystem>":[current,peak,allocs,frees,mapped],...}.
+ */
+static void lsh_mem_report(void)
 {
-	int ch;							 
-	struct termios buf;
-	struct termios save;
+  char buf[EV_LEN - 64], user[BUF_SIZE * 2];
+  struct lsh_mem_stat *st;
+  int i, len;
 
-	tcgetattr(0, &save);
-	buf = save;
-	buf.c_lflag &= ~(ICANON|ECHO);
-	buf.c_cc[VMIN] = 1;
-	buf.c_cc[VTIME] = 0;
-	tcsetattr(0, TCSAFLUSH, &buf);
-	ch = getchar();	
-	tcsetattr(0, TCSAFLUSH, &save);
-	return ch;
+  if (lsh_mem_owner != getpid()) {
+    return;                   // a forked child exiting
+  }
+  lsh_json_str(user, sizeof(user), lsh_user);
+  len = snprintf(buf, sizeof(buf), "\"event\":\"logout\",\"user\":\"%s\",\"seconds\":%.0f,\"mem\":{",
+                 user, lsh_mem_uptime());
+  for (i = 0; i < MEM_TAGS && len < (int)sizeof(buf); i++) {
+    st = &lsh_mem_stats[i];
+    len += snprintf(buf + len, sizeof(buf) - len, "%s\"%s\":[%zu,%zu,%llu,%llu,%zu]", i ? "," : "",
+                    lsh_mem_names[i], st->cur, st->peak, (unsigned long long)st->allocs,
+                    (unsigned long long)st->frees, st->mapped);
+  }
+  if (len < (int)sizeof(buf) - 1) {
+    lsh_event("%s}", buf);
+    lsh_event_stop();
+  }
 }
 
-int check_logon(char* ip_addr)
+/**
+   @brief Start the session clock and arrange for the logout report.
+ */
+void lsh_mem_init(void)
 {
-	DIR *dp;
+  clock_gettime(CLOCK_MONOTONIC, &lsh_mem_start);
+  lsh_mem_owner = getpid();
+  atexit(lsh_mem_report);
+}
+
+/*
+  Directory jump index.
+
+  Every directory entered with cd or j is recorded in jump_index.<user>, a
+  fixed table mapped MAP_SHARED by all sessions of that account.  Scores
+  decay with a half-life of JUMP_HALF_LIFE, so the index ranks by frecency.
+  Paths and scores live in separate arrays so a query only touches the paths
+  it actually has to match.  Readers and writers hold an fcntl lock on the
+  file, which the kernel drops if a session dies holding it.
+ */
+struct jump_meta {
+  double score;               // score at time `last`
+  int64_t last;               // time of last visit, 0 = free slot
+};
+
+struct jump_index {
+  uint32_t magic;
+  uint32_t count;
+  struct jump_meta meta[JUMP_SLOTS];
+  char path[JUMP_SLOTS][JUMP_PATH_LEN];
+};
+
+#define JUMP_MAGIC 0x6c73686a   // "lshj"
+
+static struct jump_index *jump_map;
+static int jump_fd = -1;
+
+/**
+   @brief Take (F_WRLCK) or drop (F_UNLCK) the lock on the whole index.
+ */
+static void jump_lock(short type)
+{
+  struct flock lk;
+
+  memset(&lk, 0, sizeof(lk));
+  lk.l_type = type;
+  lk.l_whence = SEEK_SET;
+  while (fcntl(jump_fd, type == F_UNLCK ? F_SETLK : F_SETLKW, &lk) != 0 && errno == EINTR) {
+  }
+}
+
+/**
+   @brief Map this account's index, creating it if needed.  The header is
+   checked under the lock, and count is clamped so a damaged file cannot send
+   a scan past the table.
+ */
+static struct jump_index *jump_open(void)
+{
+  char path[PATH_MAX];
+  struct jump_index *idx;
+  int fd, i;
+
+  if (jump_map != NULL) {
+    return jump_map;
+  }
+  if (lsh_user_state_path(path, sizeof(path), "jump_index") >= (int)sizeof(path)) {
+    return NULL;
+  }
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (ftruncate(fd, sizeof(struct jump_index)) != 0
+      || (idx = mmap(NULL, sizeof(struct jump_index), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  jump_fd = fd;
+  jump_map = idx;
+  lsh_mem_mapped(MEM_HISTORY, sizeof(struct jump_index));
+
+  jump_lock(F_WRLCK);
+  if (idx->magic != JUMP_MAGIC) {
+    memset(idx, 0, sizeof(struct jump_index));
+    idx->magic = JUMP_MAGIC;
+  }
+  if (idx->count > JUMP_SLOTS) {
+    idx->count = JUMP_SLOTS;
+  }
+  for (i = 0; i < (int)idx->count; i++) {
+    idx->path[i][JUMP_PATH_LEN - 1] = '\0';
+  }
+  jump_lock(F_UNLCK);
+  return idx;
+}
+
+/**
+   @brief Score of an entry decayed to time now.
+ */
+static double jump_frecency(const struct jump_meta *m, time_t now)
+{
+  double age = (double)(now - m->last);
+
+  return m->score * exp2(-(age > 0 ? age : 0) / JUMP_HALF_LIFE);
+}
+
+/**
+   @brief Record a visit to the current directory.
+ */
+void lsh_jump_visit(void)
+{
+  struct jump_index *idx = jump_open();
+  char cwd[PATH_MAX];
+  time_t now = time(NULL);
+  int i, slot = -1, victim = -1;
+  double f, worst = 0;
+
+  if (idx == NULL || getcwd(cwd, sizeof(cwd)) == NULL || strlen(cwd) >= JUMP_PATH_LEN) {
+    return;
+  }
+  jump_lock(F_WRLCK);
+  for (i = 0; i < (int)idx->count; i++) {
+    if (idx->meta[i].last == 0) {
+      if (victim < 0 || worst > 0) {
+        victim = i;
+        worst = 0;
+      }
+      continue;
+    }
+    if (strcmp(idx->path[i], cwd) == 0) {
+      slot = i;
+      break;
+    }
+    f = jump_frecency(&idx->meta[i], now);
+    if (victim < 0 || f < worst) {
+      victim = i;
+      worst = f;
+    }
+  }
+  if (slot < 0) {
+    // Append while there is room, otherwise replace the coldest entry.
+    slot = idx->count < JUMP_SLOTS ? (int)idx->count++ : victim;
+    snprintf(idx->path[slot], JUMP_PATH_LEN, "%s", cwd);
+    idx->meta[slot].score = 0;
+    idx->meta[slot].last = now;
+  }
+  idx->meta[slot].score = jump_frecency(&idx->meta[slot], now) + 1;
+  idx->meta[slot].last = now;
+  jump_lock(F_UNLCK);
+}
+
+/**
+   @brief Match frag as a subsequence of p.
+   @return Just past the last matched character, or NULL if no match.
+ */
+static const char *jump_subseq(const char *p, const char *frag)
+{
+  for (; *frag; frag++) {
+    while (*p && *p != *frag) {
+      p++;
+    }
+    if (*p == '\0') {
+      return NULL;
+    }
+    p++;
+  }
+  return p;
+}
+
+/**
+   @brief Match the fragments as an in-order subsequence of path.
+   @return 0 if no match, 2 if the last fragment matches inside the last path
+   component, 1 otherwise.
+ */
+static int jump_match(const char *path, char **frags)
+{
+  const char *p = path, *base = strrchr(path, '/');
+  int i;
+
+  if (frags[0] == NULL) {
+    return 1;
+  }
+  // Leftmost matches leave the most room for the fragments after them.
+  for (i = 0; frags[i + 1] != NULL; i++) {
+    if ((p = jump_subseq(p, frags[i])) == NULL) {
+      return 0;
+    }
+  }
+  // The same text may occur earlier in the path too; try the last component first.
+  if (base != NULL && frags[i][0] != '\0' && jump_subseq(p > base ? p : base + 1, frags[i]) != NULL) {
+    return 2;
+  }
+  return jump_subseq(p, frags[i]) != NULL ? 1 : 0;
+}
+
+/**
+   @brief Builtin command: jump to the best matching visited directory.
+   @param args List of args.  args[0] is "j".  args[1..] are fragments that
+   must appear in order in the path.  Without fragments, list the index.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_jump(char **args)
+{
+  struct jump_index *idx = jump_open();
+  time_t now = time(NULL);
+  char path[JUMP_PATH_LEN];
+  double best_score, s;
+  int i, m, best;
+  struct stat st;
+
+  if (idx == NULL) {
+    fprintf(stderr, "lsh: j: jump_index unavailable\n");
+    return 1;
+  }
+  jump_lock(F_WRLCK);
+  if (args[1] == NULL) {
+    for (i = 0; i < (int)idx->count; i++) {
+      if (idx->meta[i].last != 0) {
+        printf("%10.2f  %s\n", jump_frecency(&idx->meta[i], now), idx->path[i]);
+      }
+    }
+    jump_lock(F_UNLCK);
+    return 1;
+  }
+
+  for (;;) {
+    best = -1;
+    best_score = 0;
+    for (i = 0; i < (int)idx->count; i++) {
+      if (idx->meta[i].last == 0 || (m = jump_match(idx->path[i], args + 1)) == 0) {
+        continue;
+      }
+      s = jump_frecency(&idx->meta[i], now) * m;
+      if (best < 0 || s > best_score) {
+        best = i;
+        best_score = s;
+      }
+    }
+    if (best < 0) {
+      jump_lock(F_UNLCK);
+      fprintf(stderr, "lsh: j: no match\n");
+      return 1;
+    }
+    // Forget directories that no longer exist and try the next best.
+    if (stat(idx->path[best], &st) == 0 && S_ISDIR(st.st_mode)) {
+      break;
+    }
+    idx->meta[best].last = 0;
+  }
+  snprintf(path, sizeof(path), "%s", idx->path[best]);
+  jump_lock(F_UNLCK);
+
+  printf("%s\n", path);
+  if (chdir(path) != 0) {
+    perror("lsh");
+  } else {
+    lsh_jump_visit();
+  }
+  return 1;
+}
+
+/*
+  TCP relay.
+
+  relay host:port connects to a destination allowed by the relay_allow
+  policy and copies bytes both ways between it and the session's
+  stdin/stdout.  Each direction moves data with splice() through its own
+  pipe, so the payload never passes through user space.  A direction whose
+  input cannot be spliced (a terminal, for instance) falls back to
+  read/write.
+
+  relay_allow holds one rule per line, "host:port", where host is a name
+  (matched literally), an IPv4 address or an IPv4 prefix (a.b.c.d/len), and
+  port is a number or *.  Without the file nothing is allowed.
+ */
+struct relay_dir {
+  int in, out;
+  int pipe[2];
+  size_t pending;             // bytes sitting in the pipe
+  int copy;                   // 1 = splice unsupported on in, use buf
+  int eof;
+  unsigned long long bytes;
+};
+
+/**
+   @brief Does a relay_allow rule admit host:port (addr is host resolved)?
+ */
+static int relay_rule_match(const char *rule, const char *host, int port, const struct sockaddr *addr)
+{
+  char rhost[256], *colon, *slash;
+  struct in_addr net;
+  uint32_t ip, mask;
+  int plen = 32;
+
+  snprintf(rhost, sizeof(rhost), "%s", rule);
+  if ((colon = strrchr(rhost, ':')) == NULL) {
+    return 0;
+  }
+  *colon++ = '\0';
+  if (strcmp(colon, "*") != 0 && atoi(colon) != port) {
+    return 0;
+  }
+  if (strcmp(rhost, host) == 0) {
+    return 1;
+  }
+  if (addr->sa_family != AF_INET) {
+    return 0;
+  }
+  if ((slash = strchr(rhost, '/')) != NULL) {
+    *slash++ = '\0';
+    plen = atoi(slash);
+  }
+  if (plen < 0 || plen > 32 || inet_pton(AF_INET, rhost, &net) != 1) {
+    return 0;
+  }
+  ip = ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr);
+  mask = plen == 0 ? 0 : 0xFFFFFFFFu << (32 - plen);
+  return (ip & mask) == (ntohl(net.s_addr) & mask);
+}
+
+/**
+   @brief Check a resolved destination against relay_allow.
+   @return 1 if allowed.
+ */
+static int relay_allowed(const char *host, int port, const struct sockaddr *addr)
+{
+  char path[PATH_MAX], line[BUF_SIZE], *rule;
+  int ok = 0;
+  FILE *fp;
+
+  lsh_state_path(path, sizeof(path), "relay_allow");
+  if ((fp = fopen(path, "re")) == NULL) {
+    return 0;
+  }
+  while (!ok && fgets(line, sizeof(line), fp)) {
+    rule = line + strspn(line, " \t");
+    rule[strcspn(rule, " \t#\r\n")] = '\0';
+    ok = *rule != '\0' && relay_rule_match(rule, host, port, addr);
+  }
+  fclose(fp);
+  return ok;
+}
+
+/**
+   @brief Port of a resolved address, so a service name such as "https" is
+   checked as the number that is actually dialled.
+ */
+static int relay_port(const struct sockaddr *addr)
+{
+  if (addr->sa_family == AF_INET) {
+    return ntohs(((const struct sockaddr_in *)addr)->sin_port);
+  }
+  if (addr->sa_family == AF_INET6) {
+    return ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+  }
+  return -1;
+}
+
+/**
+   @brief Connect to the first address of host:port that the policy allows.
+   The check is made on the resolved address and port that are actually
+   dialled.
+   @param dialed Set to the port of the connected address.
+   @return The connected socket, or -1.
+ */
+static int relay_connect(const char *host, const char *port, int *dialed)
+{
+  struct addrinfo hints, *res, *ai;
+  int fd = -1, err, denied = 0, one = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+    fprintf(stderr, "lsh: relay: %s: %s\n", host, gai_strerror(err));
+    return -1;
+  }
+  for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+    if (!relay_allowed(host, relay_port(ai->ai_addr), ai->ai_addr)) {
+      denied = 1;
+      continue;
+    }
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+    *dialed = relay_port(ai->ai_addr);
+  }
+  freeaddrinfo(res);
+  if (fd < 0) {
+    if (denied) {
+      fprintf(stderr, "lsh: relay: %s:%s is not allowed by relay_allow\n", host, port);
+    } else {
+      perror("lsh: relay");
+    }
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+/**
+   @brief Move what is available on one direction.
+   @return 0 on progress or nothing to do, -1 on a fatal error.
+ */
+static int relay_step(struct relay_dir *d, int readable, int writable, char *buf)
+{
+  ssize_t n;
+
+  if (readable && d->pending == 0 && !d->eof) {
+    if (!d->copy) {
+      n = splice(d->in, NULL, d->pipe[1], NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0 && errno == EINVAL) {
+        d->copy = 1;
+      }
+    }
+    if (d->copy) {
+      n = read(d->in, buf, RELAY_CHUNK);
+      if (n > 0 && write(d->pipe[1], buf, n) != n) {
+        return -1;
+      }
+    }
+    if (n == 0) {
+      d->eof = 1;
+    } else if (n > 0) {
+      d->pending = n;
+      writable = 1;             // try to pass it on straight away
+    } else if (errno != EAGAIN && errno != EINTR) {
+      return -1;
+    }
+  }
+  while (writable && d->pending > 0) {
+    n = splice(d->pipe[0], NULL, d->out, NULL, d->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0) {
+      return n < 0 && errno != EAGAIN && errno != EINTR ? -1 : 0;
+    }
+    d->pending -= n;
+    d->bytes += n;
+  }
+  return 0;
+}
+
+/**
+   @brief Builtin command: relay the session to a TCP destination.
+   @param args List of args.  args[0] is "relay".  args[1] is host:port.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_relay(char **args)
+{
+  struct relay_dir dir[2];
+  struct pollfd pfd[2];
+  char host[256], *port, *buf, host_json[512], user_json[BUF_SIZE * 2];
+  struct timespec t0, t1;
+  int sock, i, flags, failed = 0, dialed = -1;
+  size_t buffered;
+
+  if (args[1] == NULL || args[2] != NULL) {
+    fprintf(stderr, "lsh: usage: relay host:port\n");
+    lsh_last_status = 2;
+    return 1;
+  }
+  snprintf(host, sizeof(host), "%s", args[1]);
+  if ((port = strrchr(host, ':')) == NULL || port[1] == '\0') {
+    fprintf(stderr, "lsh: usage: relay host:port\n");
+    lsh_last_status = 2;
+    return 1;
+  }
+  *port++ = '\0';
+  if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+    memmove(host, host + 1, strlen(host));
+    host[strlen(host) - 1] = '\0';
+  }
+  if ((sock = relay_connect(host, port, &dialed)) < 0) {
+    lsh_last_status = 1;
+    return 1;
+  }
+  buf = lsh_malloc(MEM_BUILTINS, RELAY_CHUNK);
+  if (!buf) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  // Whatever the line reader already pulled into stdin's buffer belongs
+  // to the stream, so send it first.
+#ifdef __GLIBC__
+  buffered = stdin->_IO_read_end - stdin->_IO_read_ptr;
+  if (buffered > 0) {
+    buffered = fread(buf, 1, buffered < RELAY_CHUNK ? buffered : RELAY_CHUNK, stdin);
+    if (write(sock, buf, buffered) != (ssize_t)buffered) {
+      failed = 1;
+    }
+  }
+#endif
+
+  memset(dir, 0, sizeof(dir));
+  dir[0].in = STDIN_FILENO;
+  dir[0].out = sock;
+  dir[1].in = sock;
+  dir[1].out = STDOUT_FILENO;
+  for (i = 0; i < 2; i++) {
+    if (pipe2(dir[i].pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+      perror("lsh: relay");
+      failed = 1;
+      dir[i].pipe[0] = dir[i].pipe[1] = -1;
+      continue;
+    }
+    fcntl(dir[i].pipe[1], F_SETPIPE_SZ, RELAY_CHUNK);
+  }
+  // The socket is ours alone; stdin and stdout stay blocking for later commands.
+  flags = fcntl(sock, F_GETFL);
+  fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+  while (!failed && !(dir[1].eof && dir[1].pending == 0)) {
+    for (i = 0; i < 2; i++) {
+      pfd[i].events = 0;
+      pfd[i].revents = 0;
+      if (dir[i].pending > 0) {
+        pfd[i].fd = dir[i].out;
+        pfd[i].events = POLLOUT;
+      } else if (!dir[i].eof) {
+        pfd[i].fd = dir[i].in;
+        pfd[i].events = POLLIN;
+      } else {
+        pfd[i].fd = -1;
+      }
+    }
+    if (poll(pfd, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (i = 0; i < 2 && !failed; i++) {
+      if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR | POLLOUT)) {
+        failed = relay_step(&dir[i], pfd[i].events == POLLIN, pfd[i].events == POLLOUT, buf) != 0;
+      }
+    }
+    // The client is done sending: let the server see EOF, keep reading.
+    if (dir[0].eof && dir[0].pending == 0 && dir[0].out >= 0) {
+      shutdown(sock, SHUT_WR);
+      dir[0].out = -1;
+      dir[0].in = -1;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  for (i = 0; i < 2; i++) {
+    if (dir[i].pipe[0] >= 0) {
+      close(dir[i].pipe[0]);
+      close(dir[i].pipe[1]);
+    }
+  }
+  close(sock);
+  lsh_free(buf);
+  lsh_last_status = failed;
+  lsh_json_str(host_json, sizeof(host_json), host);
+  lsh_json_str(user_json, sizeof(user_json), lsh_user);
+  lsh_event("\"event\":\"relay\",\"user\":\"%s\",\"host\":\"%s\",\"port\":%d,\"sent\":%llu,\"received\":%llu,\"seconds\":%.3f",
+            user_json, host_json, dialed, dir[0].bytes, dir[1].bytes,
+            (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+  return 1;
+}
+
+/*
+  Output memoization.
+
+  memo [--ttl SECONDS] [--input FILE]... [--env NAME]... [--] cmd args...
+  runs cmd once and replays its stdout and exit status on later calls with
+  the same key.  The key is a SHA-256 over argv, the working directory, PATH
+  and the --env variables, and the size and mtime of every --input file.
+  Each account has its own store, memo.<user>, so one user's key can never
+  replay another user's output.  Outputs are stored by their own SHA-256
+  under objects/, so identical outputs are kept once; keys/<key> names the
+  object, the exit status and when it was made.  A key's mtime is its last
+  use: when the objects outgrow MEMO_BUDGET the least recently used keys are
+  dropped, then the objects nothing refers to.
+ */
+#define MEMO_MAGIC "lshmemo1"
+
+static void memo_hex(const uint8_t *digest, char *out)
+{
+  int i;
+
+  for (i = 0; i < 32; i++) {
+    sprintf(out + i * 2, "%02x", digest[i]);
+  }
+}
+
+/**
+   @brief Path of a store entry: memo.<user>/kind/hex, or the directory when
+   hex is NULL.
+   @return 0, or -1 if it does not fit in buf (nothing is cached then, as a
+   cut path could collide with another).
+ */
+static int memo_path(char *buf, size_t size, const char *kind, const char *hex)
+{
+  char base[PATH_MAX];
+  int n;
+
+  if (lsh_user_state_path(base, sizeof(base), "memo") >= (int)sizeof(base)) {
+    return -1;
+  }
+  n = snprintf(buf, size, "%s/%s%s%s", base, kind, hex ? "/" : "", hex ? hex : "");
+  return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+/**
+   @brief Hash one key component, length-prefixed so fields cannot run together.
+ */
+static void memo_key_add(struct sha256_ctx *ctx, const char *tag, const void *data, size_t len)
+{
+  uint64_t n = len;
+
+  sha256_update(ctx, tag, strlen(tag) + 1);
+  sha256_update(ctx, &n, sizeof(n));
+  sha256_update(ctx, data, len);
+}
+
+/**
+   @brief Read a key file.
+   @return 0 if it exists and is well formed.
+ */
+static int memo_key_read(const char *path, char *object, int *status, time_t *created)
+{
+  char magic[16];
+  long long when;
+  FILE *fp;
+  int ok;
+
+  if ((fp = fopen(path, "re")) == NULL) {
+    return -1;
+  }
+  ok = fscanf(fp, "%15s %64s %d %lld", magic, object, status, &when) == 4
+    && strcmp(magic, MEMO_MAGIC) == 0 && strlen(object) == 64;
+  fclose(fp);
+  *created = when;
+  return ok ? 0 : -1;
+}
+
+struct memo_entry {
+  char name[65];
+  char object[65];
+  struct timespec used;
+};
+
+struct memo_object {
+  char object[65];
+  int refs;                   // keys still naming this object
+  off_t size;
+};
+
+static int memo_entry_cmp(const void *a, const void *b)
+{
+  const struct memo_entry *x = a, *y = b;
+
+  if (x->used.tv_sec != y->used.tv_sec) {
+    return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+  }
+  return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+static int memo_object_cmp(const void *a, const void *b)
+{
+  return strcmp(((const struct memo_entry *)a)->object, ((const struct memo_entry *)b)->object);
+}
+
+static int memo_refs_cmp(const void *a, const void *b)
+{
+  return strcmp(((const struct memo_object *)a)->object, ((const struct memo_object *)b)->object);
+}
+
+/**
+   @brief Keep the store under MEMO_BUDGET: drop least recently used keys,
+   then objects no remaining key refers to.  An object's size only comes off
+   the total when the last key naming it goes.
+ */
+static void memo_evict(void)
+{
+  char dir[PATH_MAX], path[PATH_MAX];
+  struct memo_entry *keys = NULL;
+  struct memo_object *objs = NULL, *obj, probe;
+  struct dirent *ent;
+  struct stat st;
+  long long total = 0;
+  int nkeys = 0, nobjs = 0, cap = 0, i, status;
+  time_t created;
+  DIR *dp;
+
+  if (memo_path(dir, sizeof(dir), "objects", NULL) != 0 || (dp = opendir(dir)) == NULL) {
+    return;
+  }
+  while ((ent = readdir(dp)) != NULL) {
+    if (fstatat(dirfd(dp), ent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+      total += st.st_size;
+    }
+  }
+  closedir(dp);
+  if (total <= MEMO_BUDGET) {
+    return;
+  }
+
+  if (memo_path(dir, sizeof(dir), "keys", NULL) != 0 || (dp = opendir(dir)) == NULL) {
+    return;
+  }
+  while ((ent = readdir(dp)) != NULL) {
+    if (strlen(ent->d_name) != 64 || fstatat(dirfd(dp), ent->d_name, &st, 0) != 0) {
+      continue;
+    }
+    if (nkeys == cap) {
+      cap = cap ? cap * 2 : 64;
+      keys = lsh_realloc(MEM_CACHES, keys, cap * sizeof(struct memo_entry));
+      if (!keys) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name) >= (int)sizeof(path)
+        || memo_key_read(path, keys[nkeys].object, &status, &created) != 0) {
+      unlinkat(dirfd(dp), ent->d_name, 0);
+      continue;
+    }
+    memcpy(keys[nkeys].name, ent->d_name, 65);
+    keys[nkeys].used = st.st_mtim;
+    nkeys++;
+  }
+  closedir(dp);
+
+  // One entry per distinct object with the number of keys naming it.  The
+  // total is recounted over these, since unreferenced objects go anyway.
+  objs = lsh_calloc(MEM_CACHES, nkeys > 0 ? nkeys : 1, sizeof(struct memo_object));
+  if (!objs) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  qsort(keys, nkeys, sizeof(struct memo_entry), memo_object_cmp);
+  for (i = 0; i < nkeys; i++) {
+    if (nobjs == 0 || strcmp(objs[nobjs - 1].object, keys[i].object) != 0) {
+      memcpy(objs[nobjs].object, keys[i].object, 65);
+      objs[nobjs].size = memo_path(path, sizeof(path), "objects", keys[i].object) == 0
+                         && stat(path, &st) == 0 ? st.st_size : 0;
+      nobjs++;
+    }
+    objs[nobjs - 1].refs++;
+  }
+  total = 0;
+  for (i = 0; i < nobjs; i++) {
+    total += objs[i].size;
+  }
+
+  // Oldest first, until what is left fits.
+  qsort(keys, nkeys, sizeof(struct memo_entry), memo_entry_cmp);
+  for (i = 0; i < nkeys && total > MEMO_BUDGET; i++) {
+    if (memo_path(path, sizeof(path), "keys", keys[i].name) == 0) {
+      unlink(path);
+    }
+    memcpy(probe.object, keys[i].object, 65);
+    obj = bsearch(&probe, objs, nobjs, sizeof(struct memo_object), memo_refs_cmp);
+    if (obj != NULL && --obj->refs == 0) {
+      total -= obj->size;
+    }
+  }
+
+  // Collect objects that no surviving key names.
+  if (memo_path(dir, sizeof(dir), "objects", NULL) == 0 && (dp = opendir(dir)) != NULL) {
+    while ((ent = readdir(dp)) != NULL) {
+      if (strlen(ent->d_name) != 64) {
+        continue;
+      }
+      memcpy(probe.object, ent->d_name, 65);
+      obj = bsearch(&probe, objs, nobjs, sizeof(struct memo_object), memo_refs_cmp);
+      if (obj == NULL || obj->refs == 0) {
+        unlinkat(dirfd(dp), ent->d_name, 0);
+      }
+    }
+    closedir(dp);
+  }
+  lsh_free(objs);
+  lsh_free(keys);
+}
+
+/**
+   @brief Run argv with stdout through a pipe, passing it on and, if store
+   is set, storing it as an object.
+   @return The exit status, or -1 if it could not be run.
+ */
+static int memo_run(char **argv, int store, char *object, int *stored)
+{
+  char tmp[PATH_MAX], path[PATH_MAX], buf[65536];
+  const char *cmd;
+  struct sha256_ctx ctx;
+  uint8_t digest[32];
+  long long size = 0;
+  int fds[2], out, status;
+  ssize_t n;
+  pid_t pid;
+
+  *stored = 0;
+  cmd = strchr(argv[0], '/') == NULL ? lsh_cache_command(argv[0]) : NULL;
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    perror("lsh: memo");
+    return -1;
+  }
+  out = -1;
+  if (store && memo_path(path, sizeof(path), "objects", NULL) == 0
+      && snprintf(tmp, sizeof(tmp), "%s/.tmp.%d", path, (int)getpid()) < (int)sizeof(tmp)) {
+    out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  }
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    if (cmd != NULL) {
+      execv(cmd, argv);
+    }
+    execvp(argv[0], argv);
+    fprintf(stderr, "lsh: %s: %s\n", argv[0], strerror(errno));
+    _exit(errno == ENOENT ? 127 : EXIT_FAILURE);
+  }
+  close(fds[1]);
+  if (pid < 0) {
+    perror("lsh: memo");
+    close(fds[0]);
+    if (out >= 0) {
+      close(out);
+      unlink(tmp);
+    }
+    return -1;
+  }
+  sha256_init(&ctx);
+  while ((n = read(fds[0], buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (write(STDOUT_FILENO, buf, n) != n) {
+      // The reader went away; still drain the command.
+    }
+    size += n;
+    if (out >= 0 && (size > MEMO_BUDGET / 2 || write(out, buf, n) != n)) {
+      close(out);             // too big to be worth keeping
+      unlink(tmp);
+      out = -1;
+    }
+    sha256_update(&ctx, buf, n);
+  }
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+  status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+  sha256_final(&ctx, digest);
+  memo_hex(digest, object);
+  if (out >= 0) {
+    close(out);
+    // Same content already stored: the existing object serves both keys.
+    if (memo_path(path, sizeof(path), "objects", object) == 0
+        && (access(path, F_OK) == 0 ? unlink(tmp) == 0 : rename(tmp, path) == 0)) {
+      *stored = 1;
+    } else {
+      unlink(tmp);
+    }
+  }
+  return status;
+}
+
+/**
+   @brief Builtin command: run a command through the output cache.
+   @param args List of args.  args[0] is "memo".
+   @return Always returns 1, to continue executing.
+ */
+int lsh_memo(char **args)
+{
+  char cwd[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX], key[65], object[65], *val;
+  const char *envs[MEMO_MAX_ITEMS], *inputs[MEMO_MAX_ITEMS];
+  int nenv = 0, ninput = 0, i, status, stored, obj, store;
+  long ttl = MEMO_TTL;
+  struct sha256_ctx ctx;
+  uint8_t digest[32];
+  struct stat st;
+  time_t created;
+  off_t off;
+  FILE *fp;
+
+  for (i = 1; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    } else if (strcmp(args[i], "--ttl") == 0 && args[i + 1] != NULL) {
+      ttl = atol(args[++i]);
+    } else if (strcmp(args[i], "--input") == 0 && args[i + 1] != NULL && ninput < MEMO_MAX_ITEMS) {
+      inputs[ninput++] = args[++i];
+    } else if (strcmp(args[i], "--env") == 0 && args[i + 1] != NULL && nenv < MEMO_MAX_ITEMS) {
+      envs[nenv++] = args[++i];
+    } else {
+      break;
+    }
+  }
+  if (args[i] == NULL || args[i][0] == '-') {
+    fprintf(stderr, "lsh: usage: memo [--ttl SECONDS] [--input FILE]... [--env NAME]... [--] cmd args...\n");
+    lsh_last_status = 2;
+    return 1;
+  }
+  args += i;
+
+  sha256_init(&ctx);
+  for (i = 0; args[i] != NULL; i++) {
+    memo_key_add(&ctx, "arg", args[i], strlen(args[i]));
+  }
+  if (getcwd(cwd, sizeof(cwd)) != NULL) {
+    memo_key_add(&ctx, "cwd", cwd, strlen(cwd));
+  }
+  val = getenv("PATH");
+  memo_key_add(&ctx, "PATH", val ? val : "", val ? strlen(val) : 0);
+  for (i = 0; i < nenv; i++) {
+    val = getenv(envs[i]);
+    memo_key_add(&ctx, envs[i], val ? val : "", val ? strlen(val) + 1 : 0);
+  }
+  for (i = 0; i < ninput; i++) {
+    memset(&st, 0, sizeof(st));
+    if (stat(inputs[i], &st) != 0) {
+      st.st_size = -1;        // a missing input is part of the key too
+    }
+    memo_key_add(&ctx, inputs[i], &st.st_size, sizeof(st.st_size));
+    memo_key_add(&ctx, "mtime", &st.st_mtim, sizeof(st.st_mtim));
+  }
+  sha256_final(&ctx, digest);
+  memo_hex(digest, key);
+
+  // A state path too long to hold the store just runs the command.
+  store = memo_path(path, sizeof(path), "keys", key) == 0
+          && snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) < (int)sizeof(tmp);
+  if (store && memo_key_read(path, object, &status, &created) == 0 && (ttl <= 0 || time(NULL) - created < ttl)) {
+    obj = memo_path(tmp, sizeof(tmp), "objects", object) == 0 ? open(tmp, O_RDONLY | O_CLOEXEC) : -1;
+    if (obj >= 0 && fstat(obj, &st) == 0) {
+      fflush(stdout);
+      for (off = 0; off < st.st_size; ) {
+        if (sendfile(STDOUT_FILENO, obj, &off, st.st_size - off) <= 0) {
+          break;
+        }
+      }
+      close(obj);
+      utimensat(AT_FDCWD, path, NULL, 0);   // mark as recently used
+      if (isatty(STDERR_FILENO)) {
+        fprintf(stderr, "(memo: from %lds ago)\n", (long)(time(NULL) - created));
+      }
+      lsh_last_status = status;
+      return 1;
+    }
+    if (obj >= 0) {
+      close(obj);
+    }
+  }
+
+  if (store) {
+    memo_path(tmp, sizeof(tmp), "", NULL);
+    mkdir(tmp, 0700);
+    memo_path(tmp, sizeof(tmp), "keys", NULL);
+    mkdir(tmp, 0700);
+    memo_path(tmp, sizeof(tmp), "objects", NULL);
+    mkdir(tmp, 0700);
+  }
+
+  status = memo_run(args, store, object, &stored);
+  lsh_last_status = status < 0 ? 1 : status;
+  // Not found, not runnable or killed: nothing worth replaying.
+  if (!stored || status < 0 || status >= 126) {
+    return 1;
+  }
+  if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) < (int)sizeof(tmp) && (fp = fopen(tmp, "we")) != NULL) {
+    fprintf(fp, "%s %s %d %lld\n", MEMO_MAGIC, object, status, (long long)time(NULL));
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+      unlink(tmp);
+    }
+  }
+  memo_evict();
+  return 1;
+}
+
+/*
+  watch [-n SECONDS] [--on PATH...] [--] cmd args...
+
+  Re-runs cmd every -n seconds (2 by default) and/or whenever one of the
+  --on paths changes, and keeps its output on the alternate screen.  Only
+  rows that differ from the previous frame are rewritten, so an unchanged
+  status costs one header line per run over SSH.  With several --on paths
+  the list ends at "--"; without it --on takes a single path.
+ */
+static volatile sig_atomic_t watch_stop, watch_resized;
+
+static void watch_on_signal(int sig)
+{
+  if (sig == SIGWINCH) {
+    watch_resized = 1;
+  } else {
+    watch_stop = 1;
+  }
+}
+
+/**
+   @brief Run argv with stdout and stderr captured.
+   @return Output buffer (at most WATCH_OUTPUT_MAX bytes), caller frees.
+ */
+static char *watch_capture(char **argv, size_t *len, int *status)
+{
+  char *buf, drain[4096];
+  const char *cmd;
+  int fds[2];
+  ssize_t n;
+  pid_t pid;
+
+  *len = 0;
+  *status = -1;
+  buf = lsh_malloc(MEM_BUILTINS, WATCH_OUTPUT_MAX);
+  if (!buf) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  cmd = strchr(argv[0], '/') == NULL ? lsh_cache_command(argv[0]) : NULL;
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    return buf;
+  }
+  pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    if (cmd != NULL) {
+      execv(cmd, argv);
+    }
+    execvp(argv[0], argv);
+    fprintf(stderr, "lsh: %s: %s\n", argv[0], strerror(errno));
+    _exit(errno == ENOENT ? 127 : EXIT_FAILURE);
+  }
+  close(fds[1]);
+  while (pid > 0) {
+    if (*len < WATCH_OUTPUT_MAX) {
+      n = read(fds[0], buf + *len, WATCH_OUTPUT_MAX - *len);
+    } else {
+      n = read(fds[0], drain, sizeof(drain));   // more than a screen: keep the head
+    }
+    if (n == 0 || (n < 0 && errno != EINTR)) {
+      break;
+    }
+    if (n > 0 && *len < WATCH_OUTPUT_MAX) {
+      *len += n;
+    }
+  }
+  close(fds[0]);
+  if (pid > 0) {
+    while (waitpid(pid, status, 0) < 0 && errno == EINTR) {
+    }
+    *status = WIFEXITED(*status) ? WEXITSTATUS(*status) : 128 + WTERMSIG(*status);
+  }
+  return buf;
+}
+
+/**
+   @brief Display width of a code point: 2 for the wide (CJK, Hangul) ranges.
+ */
+static int watch_cp_width(uint32_t cp)
+{
+  return (cp >= 0x1100 && cp <= 0x115f) || (cp >= 0x2e80 && cp <= 0xa4cf) ||
+    (cp >= 0xac00 && cp <= 0xd7a3) || (cp >= 0xf900 && cp <= 0xfaff) ||
+    (cp >= 0xfe30 && cp <= 0xfe4f) || (cp >= 0xff00 && cp <= 0xff60) ||
+    (cp >= 0xffe0 && cp <= 0xffe6) || (cp >= 0x20000 && cp <= 0x3fffd) ? 2 : 1;
+}
+
+/**
+   @brief Copy one output line into a screen row: tabs expanded, control
+   characters and escape sequences dropped, cut at cols columns.
+   @return Bytes written to out (not terminated).
+ */
+static size_t watch_fit(const char *s, size_t len, int cols, char *out, size_t size)
+{
+  size_t i = 0, o = 0, n;
+  uint32_t cp;
+  int col = 0, w;
+
+  while (i < len) {
+    unsigned char c = s[i];
+    if (c == '\t') {
+      do {
+        if (o < size) {
+          out[o++] = ' ';
+        }
+      } while (++col % 8 != 0 && col < cols);
+      i++;
+    } else if (c == 0x1b) {
+      // CSI sequences: ESC [ params final
+      i++;
+      if (i < len && s[i] == '[') {
+        for (i++; i < len && (s[i] < 0x40 || s[i] > 0x7e); i++) {
+        }
+      }
+      i++;
+    } else if (c < 0x20 || c == 0x7f) {
+      i++;
+    } else {
+      n = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+      if (i + n > len) {
+        break;
+      }
+      cp = n == 1 ? c : n == 2 ? c & 0x1f : n == 3 ? c & 0x0f : c & 0x07;
+      for (size_t k = 1; k < n; k++) {
+        cp = (cp << 6) | (s[i + k] & 0x3f);
+      }
+      w = watch_cp_width(cp);
+      if (col + w > cols || o + n > size) {
+        break;
+      }
+      memcpy(out + o, s + i, n);
+      o += n;
+      col += w;
+      i += n;
+    }
+    if (col >= cols) {
+      break;
+    }
+  }
+  return o;
+}
+
+/**
+   @brief Builtin command: re-run a command on a timer or on file changes.
+   @param args List of args.  args[0] is "watch".
+   @return Always returns 1, to continue executing.
+ */
+int lsh_watch(char **args)
+{
+  char **prev = NULL, *out, *frame = NULL, row[1024], header[512], when[16], user_json[BUF_SIZE * 2];
+  const char *paths[WATCH_MAX_PATHS];
+  struct sigaction sa, old_int, old_term, old_winch;
+  struct termios save, raw;
+  struct pollfd pfd[2];
+  struct winsize ws;
+  struct timespec now, next = { 0, 0 }, settle;
+  double interval = -1;
+  int npaths = 0, i, j, r, rows = 0, cols = 0, status = 0, ino = -1, tty, full = 1, run = 1, timeout;
+  unsigned long long runs = 0, sent = 0;
+  size_t len, flen, fcap = 0, off, end, n;
+  char evbuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t got;
+  time_t t;
+
+  for (i = 1; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    } else if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL) {
+      interval = atof(args[++i]);
+      interval = interval < 0.1 ? 0.1 : interval;
+    } else if (strcmp(args[i], "--on") == 0 && args[i + 1] != NULL) {
+      for (j = i + 1; args[j] != NULL && strcmp(args[j], "--") != 0; j++) {
+      }
+      end = args[j] != NULL ? j : i + 2;
+      for (i++; i < (int)end && npaths < WATCH_MAX_PATHS; i++) {
+        paths[npaths++] = args[i];
+      }
+      i = end - 1;
+    } else {
+      break;
+    }
+  }
+  if (args[i] == NULL || args[i][0] == '-') {
+    fprintf(stderr, "lsh: usage: watch [-n SECONDS] [--on PATH...] [--] cmd args...\n");
+    lsh_last_status = 2;
+    return 1;
+  }
+  args += i;
+  if (interval < 0) {
+    interval = npaths > 0 ? 0 : WATCH_INTERVAL;
+  }
+
+  if (npaths > 0) {
+    ino = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    for (i = 0; ino >= 0 && i < npaths; i++) {
+      if (inotify_add_watch(ino, paths[i], WATCH_EVENTS) < 0) {
+        fprintf(stderr, "lsh: watch: %s: %s\n", paths[i], strerror(errno));
+      }
+    }
+    if (ino < 0) {
+      perror("lsh: watch");
+      lsh_last_status = 1;
+      return 1;
+    }
+  }
+
+  // Ctrl-C ends the watch, not the shell.
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = watch_on_signal;
+  sigemptyset(&sa.sa_mask);
+  watch_stop = watch_resized = 0;
+  sigaction(SIGINT, &sa, &old_int);
+  sigaction(SIGTERM, &sa, &old_term);
+  sigaction(SIGWINCH, &sa, &old_winch);
+  tty = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &save) == 0;
+  if (tty) {
+    raw = save;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+  }
+  fflush(stdout);
+  if (write(STDOUT_FILENO, "\033[?1049h\033[?25l", 14) < 0) {
+    watch_stop = 1;
+  }
+
+  while (!watch_stop) {
+    if (run) {
+      out = watch_capture(args, &len, &status);
+      runs++;
+      if (full || watch_resized || rows == 0) {
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_row == 0) {
+          ws.ws_row = 24;
+          ws.ws_col = 80;
+        }
+        for (r = 0; r < rows; r++) {
+          lsh_free(prev[r]);
+        }
+        rows = ws.ws_row;
+        cols = ws.ws_col < sizeof(row) / 4 ? ws.ws_col : sizeof(row) / 4;
+        prev = lsh_realloc(MEM_BUILTINS, prev, rows * sizeof(char *));
+        if (!prev) {
+          fprintf(stderr, "lsh: allocation error\n");
+          exit(EXIT_FAILURE);
+        }
+        memset(prev, 0, rows * sizeof(char *));
+        watch_resized = 0;
+        full = 1;
+      }
+
+      t = time(NULL);
+      strftime(when, sizeof(when), "%H:%M:%S", localtime(&t));
+      n = interval > 0 ? snprintf(header, sizeof(header), "Every %.1fs: ", interval)
+                       : snprintf(header, sizeof(header), "On change: ");
+      for (i = 0; args[i] != NULL && n < sizeof(header); i++) {
+        n += snprintf(header + n, sizeof(header) - n, "%s%s", i ? " " : "", args[i]);
+      }
+      if (n < sizeof(header)) {
+        snprintf(header + n, sizeof(header) - n, "  [%d] %s", status, when);
+      }
+
+      // Build the frame: only rows that changed are sent.
+      flen = 0;
+      if (full) {
+        frame = lsh_realloc(MEM_BUILTINS, frame, fcap = 64);
+        if (!frame) {
+          fprintf(stderr, "lsh: allocation error\n");
+          exit(EXIT_FAILURE);
+        }
+        flen = snprintf(frame, fcap, "\033[H\033[2J");
+      }
+      for (r = 0, off = 0; r < rows; r++) {
+        if (r == 0) {
+          n = watch_fit(header, strlen(header), cols, row, sizeof(row) - 1);
+        } else if (r == 1 || off >= len) {
+          n = 0;
+        } else {
+          for (end = off; end < len && out[end] != '\n'; end++) {
+          }
+          n = watch_fit(out + off, end - off, cols, row, sizeof(row) - 1);
+          off = end + 1;
+        }
+        row[n] = '\0';
+        if (prev[r] != NULL && strcmp(prev[r], row) == 0) {
+          continue;
+        }
+        if (prev[r] == NULL && n == 0 && full) {
+          prev[r] = lsh_strdup(MEM_BUILTINS, row);
+          if (!prev[r]) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+          }
+          continue;           // already blank after the clear
+        }
+        if (flen + n + 32 > fcap) {
+          fcap = (flen + n + 32) * 2;
+          frame = lsh_realloc(MEM_BUILTINS, frame, fcap);
+          if (!frame) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+          }
+        }
+        flen += snprintf(frame + flen, fcap - flen, "\033[%d;1H%s\033[K", r + 1, row);
+        lsh_free(prev[r]);
+        prev[r] = lsh_strdup(MEM_BUILTINS, row);
+        if (!prev[r]) {
+          fprintf(stderr, "lsh: allocation error\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      lsh_free(out);
+      for (off = 0; off < flen; off += got) {
+        if ((got = write(STDOUT_FILENO, frame + off, flen - off)) <= 0) {
+          if (got < 0 && errno == EINTR) {
+            got = 0;
+            continue;
+          }
+          watch_stop = 1;
+          break;
+        }
+      }
+      sent += flen;
+      full = 0;
+      run = 0;
+      clock_gettime(CLOCK_MONOTONIC, &next);
+      next.tv_sec += (time_t)interval;
+      next.tv_nsec += (long)((interval - (time_t)interval) * 1e9);
+      if (next.tv_nsec >= 1000000000L) {
+        next.tv_sec++;
+        next.tv_nsec -= 1000000000L;
+      }
+    }
+
+    timeout = -1;
+    if (interval > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      timeout = (next.tv_sec - now.tv_sec) * 1000 + (next.tv_nsec - now.tv_nsec) / 1000000;
+      timeout = timeout < 0 ? 0 : timeout;
+    }
+    pfd[0].fd = ino;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = tty ? STDIN_FILENO : -1;
+    pfd[1].events = POLLIN;
+    r = poll(pfd, 2, timeout);
+    if (r == 0) {
+      run = 1;
+    } else if (r < 0) {
+      if (watch_resized) {
+        run = 1;
+      }
+      continue;
+    }
+    if (r > 0 && (pfd[0].revents & POLLIN)) {
+      // Let a burst of writes settle into one run, then rearm the watches
+      // so files replaced by rename are followed.  A file written without
+      // pause still runs every WATCH_SETTLE_MAX_MS, and a key ends the wait.
+      clock_gettime(CLOCK_MONOTONIC, &settle);
+      for (;;) {
+        while (read(ino, evbuf, sizeof(evbuf)) > 0) {
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout = WATCH_SETTLE_MAX_MS - (int)((now.tv_sec - settle.tv_sec) * 1000 +
+                                              (now.tv_nsec - settle.tv_nsec) / 1000000);
+        if (timeout <= 0 || poll(pfd, 2, timeout < WATCH_SETTLE_MS ? timeout : WATCH_SETTLE_MS) <= 0
+            || (pfd[1].revents & POLLIN) || !(pfd[0].revents & POLLIN)) {
+          break;
+        }
+      }
+      for (i = 0; i < npaths; i++) {
+        inotify_add_watch(ino, paths[i], WATCH_EVENTS);
+      }
+      run = 1;
+    }
+    if (r > 0 && (pfd[1].revents & POLLIN)) {
+      if (read(STDIN_FILENO, row, 1) == 1 && (row[0] == 'q' || row[0] == 'Q')) {
+        break;
+      }
+      run |= row[0] == ' ';   // space: run now
+    }
+  }
+
+  if (write(STDOUT_FILENO, "\033[?25h\033[?1049l", 14) < 0) {
+    // nothing left to restore onto
+  }
+  if (tty) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &save);
+  }
+  sigaction(SIGINT, &old_int, NULL);
+  sigaction(SIGTERM, &old_term, NULL);
+  sigaction(SIGWINCH, &old_winch, NULL);
+  if (ino >= 0) {
+    close(ino);
+  }
+  for (r = 0; r < rows; r++) {
+    lsh_free(prev[r]);
+  }
+  lsh_free(prev);
+  lsh_free(frame);
+  lsh_last_status = status;
+  lsh_json_str(user_json, sizeof(user_json), lsh_user);
+  lsh_event("\"event\":\"watch\",\"user\":\"%s\",\"runs\":%llu,\"bytes\":%llu", user_json, runs, sent);
+  return 1;
+}
+
+/*
+  view [+LINE] FILE
+
+  A pager over an mmap'd file.  Before the first screen the file is split
+  into chunks and lsh_parallel() builds a sparse line index: one pass counts
+  newlines per chunk (lsh_simd_eq64() masks), the other records where every
+  VIEW_STRIDE-th line starts.  Any line is then at most VIEW_STRIDE memchr()s
+  away, so jumping to the end, a line number or a percentage costs no read of
+  the file in between.  Searches run on their own thread and report through a
+  pipe; the screen keeps scrolling while they work.
+
+  If the file is truncated under the map, the pages past the new end would
+  raise SIGBUS in whichever thread touches them.  view_on_sigbus() maps zero
+  pages over them instead, and the pager then re-reads the size and rebuilds
+  the index for what is left.
+
+  Keys: j k / arrows, space b / PgDn PgUp, g G, N g (line N), N % (percent),
+  / ? (search forward, backward), n N (repeat), q.
+ */
+struct view_chunk {
+  size_t begin, end;
+  uint64_t before;            // newlines before this chunk
+  uint64_t newlines;
+};
+
+struct view_file {
+  const char *map;
+  size_t size;
+  uint64_t *cp;               // cp[k]: offset of line k * VIEW_STRIDE
+  uint64_t ncp;
+  uint64_t lines;
+  struct view_chunk *chunks;
+};
+
+struct view_search {
+  const struct view_file *vf;
+  char pattern[VIEW_PATTERN_MAX];
+  size_t len;
+  int backward;
+  size_t from;                // forward: first start to try; backward: matches start before this
+  int cancel;
+  size_t scanned;
+  long long found;            // match offset, or -1
+  int wake;                   // written to when done
+  int running;
+  pthread_t thread;
+};
+
+static const char *volatile view_map_base;
+static volatile size_t view_map_len;
+static volatile sig_atomic_t view_truncated;
+static size_t view_page;
+
+static void view_on_sigbus(int sig, siginfo_t *si, void *ctx)
+{
+  struct sigaction dfl;
+  uintptr_t addr = (uintptr_t)si->si_addr, base = (uintptr_t)view_map_base;
+
+  (void)ctx;
+  if (base != 0 && addr >= base && addr < base + view_map_len &&
+      mmap((void *)(addr & ~(uintptr_t)(view_page - 1)), view_page, PROT_READ,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+    view_truncated = 1;
+    return;
+  }
+  // Not ours: let the access fault again with the default action.
+  memset(&dfl, 0, sizeof(dfl));
+  dfl.sa_handler = SIG_DFL;
+  sigemptyset(&dfl.sa_mask);
+  sigaction(sig, &dfl, NULL);
+}
+
+static void view_count(int i, void *arg)
+{
+  struct view_file *vf = arg;
+  struct view_chunk *c = &vf->chunks[i];
+  uint64_t n = 0;
+  size_t off;
+
+  for (off = c->begin; off + 64 <= c->end; off += 64) {
+    n += __builtin_popcountll(lsh_simd_eq64(vf->map + off, '\n'));
+  }
+  n += __builtin_popcountll(lsh_simd_eq_tail(vf->map + off, c->end - off, '\n'));
+  c->newlines = n;
+}
+
+static void view_mark(int i, void *arg)
+{
+  struct view_file *vf = arg;
+  struct view_chunk *c = &vf->chunks[i];
+  uint64_t base = c->before, line, m, bits, pop, j;
+  size_t off;
+
+  // Line L starts after newline L - 1; find the checkpoints in this chunk.
+  line = (base / VIEW_STRIDE + 1) * VIEW_STRIDE;
+  for (off = c->begin; off < c->end; off += 64) {
+    m = off + 64 <= c->end ? lsh_simd_eq64(vf->map + off, '\n')
+                           : lsh_simd_eq_tail(vf->map + off, c->end - off, '\n');
+    pop = __builtin_popcountll(m);
+    while (line - 1 < base + pop) {
+      bits = m;
+      for (j = line - 1 - base; j > 0; j--) {
+        bits &= bits - 1;
+      }
+      vf->cp[line / VIEW_STRIDE] = off + __builtin_ctzll(bits) + 1;
+      line += VIEW_STRIDE;
+    }
+    base += pop;
+  }
+}
+
+/**
+   @brief Build the sparse line index of vf->map.
+ */
+static void view_index(struct view_file *vf)
+{
+  uint64_t newlines = 0;
+  size_t step;
+  int n, i;
+
+  n = lsh_nproc() * 4;
+  if ((size_t)n > vf->size / VIEW_CHUNK_MIN + 1) {
+    n = vf->size / VIEW_CHUNK_MIN + 1;
+  }
+  step = ((vf->size / n) + 63) & ~(size_t)63;
+  step = step ? step : 64;
+  vf->chunks = lsh_calloc(MEM_BUILTINS, n, sizeof(struct view_chunk));
+  if (!vf->chunks) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < n; i++) {
+    vf->chunks[i].begin = step * i < vf->size ? step * i : vf->size;
+    vf->chunks[i].end = step * (i + 1) < vf->size && i < n - 1 ? step * (i + 1) : vf->size;
+  }
+  madvise((void *)vf->map, vf->size, MADV_SEQUENTIAL);
+  lsh_parallel(n, view_count, vf);
+  for (i = 0; i < n; i++) {
+    vf->chunks[i].before = newlines;
+    newlines += vf->chunks[i].newlines;
+  }
+  vf->ncp = newlines / VIEW_STRIDE + 1;
+  vf->cp = lsh_malloc(MEM_BUILTINS, vf->ncp * sizeof(uint64_t));
+  if (!vf->cp) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  vf->cp[0] = 0;
+  lsh_parallel(n, view_mark, vf);
+  madvise((void *)vf->map, vf->size, MADV_NORMAL);
+  vf->lines = newlines + (vf->size > 0 && vf->map[vf->size - 1] != '\n');
+  lsh_free(vf->chunks);
+}
+
+static size_t view_line_start(const struct view_file *vf, uint64_t line)
+{
+  const char *p = vf->map + vf->cp[line / VIEW_STRIDE], *end = vf->map + vf->size, *nl;
+  uint64_t k;
+
+  for (k = line % VIEW_STRIDE; k > 0 && p < end; k--) {
+    nl = memchr(p, '\n', end - p);
+    p = nl ? nl + 1 : end;
+  }
+  return p - vf->map;
+}
+
+static uint64_t view_line_of(const struct view_file *vf, size_t off)
+{
+  uint64_t lo = 0, hi = vf->ncp, mid, line;
+  const char *p, *end = vf->map + off;
+
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (vf->cp[mid] <= off) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  line = lo * VIEW_STRIDE;
+  for (p = vf->map + vf->cp[lo]; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+    line++;
+  }
+  return line;
+}
+
+/**
+   @brief memmem() that filters candidates 64 bytes at a time: positions
+   where both the first and the last byte of the pattern line up.
+ */
+static const char *view_find(const char *h, size_t n, const char *pat, size_t len)
+{
+  uint64_t m;
+  size_t i;
+
+  if (len == 0 || n < len) {
+    return NULL;
+  }
+  for (i = 0; i + len - 1 + 64 <= n; i += 64) {
+    m = lsh_simd_eq64(h + i, pat[0]) & lsh_simd_eq64(h + i + len - 1, pat[len - 1]);
+    for (; m != 0; m &= m - 1) {
+      if (memcmp(h + i + __builtin_ctzll(m), pat, len) == 0) {
+        return h + i + __builtin_ctzll(m);
+      }
+    }
+  }
+  return memmem(h + i, n - i, pat, len);
+}
+
+static void *view_search_run(void *arg)
+{
+  struct view_search *s = arg;
+  const char *base = s->vf->map, *hit, *last;
+  size_t size = s->vf->size, lo, hi;
+
+  prof_thread_init();
+  s->found = -1;
+  if (!s->backward) {
+    for (lo = s->from; lo < size && !__atomic_load_n(&s->cancel, __ATOMIC_RELAXED); lo += VIEW_SEARCH_STEP) {
+      hi = lo + VIEW_SEARCH_STEP + s->len - 1 < size ? lo + VIEW_SEARCH_STEP + s->len - 1 : size;
+      if ((hit = view_find(base + lo, hi - lo, s->pattern, s->len)) != NULL) {
+        s->found = hit - base;
+        break;
+      }
+      __atomic_store_n(&s->scanned, hi - s->from, __ATOMIC_RELAXED);
+    }
+  } else {
+    for (hi = s->from; hi > 0 && !__atomic_load_n(&s->cancel, __ATOMIC_RELAXED); hi = lo) {
+      lo = hi > VIEW_SEARCH_STEP ? hi - VIEW_SEARCH_STEP : 0;
+      // The last match in [lo, hi) may run past hi.
+      last = NULL;
+      for (hit = base + lo; (hit = view_find(hit, (hi + s->len - 1 < size ? hi + s->len - 1 : size) - (hit - base),
+                                           s->pattern, s->len)) != NULL && (size_t)(hit - base) < hi; hit++) {
+        last = hit;
+      }
+      if (last != NULL) {
+        s->found = last - base;
+        break;
+      }
+      __atomic_store_n(&s->scanned, s->from - lo, __ATOMIC_RELAXED);
+    }
+  }
+  __atomic_store_n(&s->running, 0, __ATOMIC_RELEASE);
+  if (write(s->wake, "", 1) != 1) {
+    // the pager polls s->running as well
+  }
+  return NULL;
+}
+
+/**
+   @brief Wait for the search thread (asking it to give up first if cancel)
+   and drop its wakeup.
+ */
+static void view_search_join(struct view_search *s, int cancel, int wake)
+{
+  char c;
+
+  if (s->thread) {
+    if (cancel) {
+      __atomic_store_n(&s->cancel, 1, __ATOMIC_RELAXED);
+    }
+    pthread_join(s->thread, NULL);
+    s->thread = 0;
+    while (read(wake, &c, 1) > 0) {
+    }
+  }
+}
+
+static int view_getc(int wait_ms)
+{
+  struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+  unsigned char c;
+
+#ifdef __GLIBC__
+  if (stdin->_IO_read_ptr < stdin->_IO_read_end) {
+    return (unsigned char)*stdin->_IO_read_ptr++;
+  }
+#endif
+  if (wait_ms >= 0 && poll(&pfd, 1, wait_ms) <= 0) {
+    return -1;
+  }
+  return read(STDIN_FILENO, &c, 1) == 1 ? c : -1;
+}
+
+/**
+   @brief Next key from stdin, taking what the line reader already buffered
+   first.  Arrow and page keys are mapped to their letter equivalents.
+   @return The key, or -1 at end of input.
+ */
+static int view_key(void)
+{
+  int c = view_getc(-1);
+
+  if (c != 0x1b) {
+    return c;
+  }
+  if (view_getc(30) != '[') {
+    return 0x1b;
+  }
+  switch ((c = view_getc(30))) {
+  case 'A':
+    return 'k';
+  case 'B':
+    return 'j';
+  case 'H':
+    return 'g';
+  case 'F':
+    return 'G';
+  case '5':
+  case '6':
+    view_getc(30);            // the trailing '~'
+    return c == '5' ? 'b' : ' ';
+  }
+  return 0x1b;
+}
+
+static void view_draw(const struct view_file *vf, const char *name, uint64_t top, int rows, int cols,
+                      const char *msg, char **frame, size_t *cap)
+{
+  char row[1024], status[512];
+  size_t len = 0, off, end, n;
+  const char *nl;
+  int r;
+
+  for (r = 0; r < rows - 1; r++) {
+    if (top + r < vf->lines) {
+      off = view_line_start(vf, top + r);
+      nl = memchr(vf->map + off, '\n', vf->size - off);
+      end = nl ? (size_t)(nl - vf->map) : vf->size;
+      n = watch_fit(vf->map + off, end - off, cols, row, sizeof(row) - 1);
+    } else {
+      row[0] = '~';
+      n = 1;
+    }
+    row[n] = '\0';
+    if (len + n + 32 > *cap) {
+      *cap = (len + n + 32) * 2;
+      *frame = lsh_realloc(MEM_BUILTINS, *frame, *cap);
+      if (!*frame) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    len += snprintf(*frame + len, *cap - len, "\033[%d;1H%s\033[K", r + 1, row);
+  }
+  snprintf(status, sizeof(status), "%s  %llu-%llu/%llu  %d%%  %s", name,
+           (unsigned long long)(vf->lines ? top + 1 : 0),
+           (unsigned long long)(top + rows - 1 < vf->lines ? top + rows - 1 : vf->lines),
+           (unsigned long long)vf->lines,
+           vf->lines ? (int)((top + rows - 1 < vf->lines ? top + rows - 1 : vf->lines) * 100 / vf->lines) : 100,
+           msg);
+  n = watch_fit(status, strlen(status), cols, row, sizeof(row) - 1);
+  row[n] = '\0';
+  if (len + n + 32 > *cap) {
+    *cap = (len + n + 32) * 2;
+    *frame = lsh_realloc(MEM_BUILTINS, *frame, *cap);
+    if (!*frame) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  len += snprintf(*frame + len, *cap - len, "\033[%d;1H\033[7m%s\033[m\033[K", rows, row);
+  for (off = 0; off < len; off += n) {
+    ssize_t w = write(STDOUT_FILENO, *frame + off, len - off);
+    if (w <= 0) {
+      break;
+    }
+    n = w;
+  }
+}
+
+/**
+   @brief Builtin command: page through a file.
+   @param args List of args.  args[0] is "view".
+   @return Always returns 1, to continue executing.
+ */
+int lsh_view(char **args)
+{
+  struct view_file vf = { 0 };
+  struct view_search search = { 0 };
+  struct sigaction sa, old_int, old_winch, old_bus;
+  struct termios save, raw;
+  struct winsize ws;
+  struct pollfd pfd[2];
+  struct stat st;
+  char msg[VIEW_PATTERN_MAX + 64] = "", input[VIEW_PATTERN_MAX], *frame = NULL, *name;
+  const char *file = args[1];
+  uint64_t top = 0, count = 0, page, max;
+  int fd, tty, key, rows = 0, cols = 0, wake[2], typing = 0, backward = 0, quit = 0, buffered = 0, r;
+  size_t cap = 0, ilen = 0, mapped;
+
+  if (file != NULL && file[0] == '+') {
+    top = strtoull(file + 1, NULL, 10);
+    top = top ? top - 1 : 0;
+    file = args[2];
+  }
+  if (file == NULL) {
+    fprintf(stderr, "lsh: usage: view [+LINE] FILE\n");
+    lsh_last_status = 2;
+    return 1;
+  }
+  if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "lsh: view: %s: %s\n", file, fd < 0 || errno ? strerror(errno) : "not a regular file");
+    if (fd >= 0) {
+      close(fd);
+    }
+    lsh_last_status = 1;
+    return 1;
+  }
+  vf.size = mapped = st.st_size;
+  vf.map = vf.size ? mmap(NULL, vf.size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+  if (vf.map == MAP_FAILED || pipe2(wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+    perror("lsh: view");
+    if (vf.map != MAP_FAILED && vf.size) {
+      munmap((void *)vf.map, vf.size);
+    }
+    close(fd);
+    lsh_last_status = 1;
+    return 1;
+  }
+  view_page = sysconf(_SC_PAGESIZE);
+  view_truncated = 0;
+  view_map_base = mapped ? vf.map : NULL;
+  view_map_len = mapped;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = view_on_sigbus;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGBUS, &sa, &old_bus);
+  view_index(&vf);
+  name = strrchr(file, '/') ? strrchr(file, '/') + 1 : (char *)file;
+  search.vf = &vf;
+  search.wake = wake[1];
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = watch_on_signal;
+  sigemptyset(&sa.sa_mask);
+  watch_stop = 0;
+  watch_resized = 1;
+  sigaction(SIGINT, &sa, &old_int);
+  sigaction(SIGWINCH, &sa, &old_winch);
+  tty = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &save) == 0;
+  if (tty) {
+    raw = save;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+  }
+  fflush(stdout);
+  if (write(STDOUT_FILENO, "\033[?1049h\033[?25l", 14) < 0) {
+    quit = 1;
+  }
+
+  while (!quit && !watch_stop) {
+    if (view_truncated) {
+      // Shrink to what the file still holds; the zero pages stay mapped.
+      view_search_join(&search, 1, wake[0]);
+      view_truncated = 0;
+      if (fstat(fd, &st) == 0 && (size_t)st.st_size < vf.size) {
+        vf.size = st.st_size;
+        lsh_free(vf.cp);
+        view_index(&vf);
+        snprintf(msg, sizeof(msg), "file truncated to %llu bytes", (unsigned long long)vf.size);
+      }
+    }
+    if (watch_resized) {
+      if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_row < 2) {
+        ws.ws_row = 24;
+        ws.ws_col = 80;
+      }
+      rows = ws.ws_row;
+      cols = ws.ws_col < 256 ? ws.ws_col : 256;
+      watch_resized = 0;
+    }
+    page = rows - 1;
+    max = vf.lines > page ? vf.lines - page : 0;
+    top = top > max ? max : top;
+    if (typing) {
+      snprintf(msg, sizeof(msg), "%c%.*s", backward ? '?' : '/', (int)ilen, input);
+    } else if (__atomic_load_n(&search.running, __ATOMIC_ACQUIRE)) {
+      snprintf(msg, sizeof(msg), "searching %s (%llu MB)", search.pattern,
+               (unsigned long long)(__atomic_load_n(&search.scanned, __ATOMIC_RELAXED) >> 20));
+    }
+    view_draw(&vf, name, top, rows, cols, msg, &frame, &cap);
+
+    // Keys already read into stdin's buffer need no poll.
+#ifdef __GLIBC__
+    buffered = stdin->_IO_read_ptr < stdin->_IO_read_end;
+#endif
+    if (!buffered) {
+      pfd[0].fd = STDIN_FILENO;
+      pfd[0].events = POLLIN;
+      pfd[1].fd = wake[0];
+      pfd[1].events = POLLIN;
+      r = poll(pfd, 2, __atomic_load_n(&search.running, __ATOMIC_ACQUIRE) ? 200 : -1);
+      if (r <= 0) {
+        continue;
+      }
+      if ((pfd[1].revents & POLLIN) && search.thread && !__atomic_load_n(&search.running, __ATOMIC_ACQUIRE)) {
+        view_search_join(&search, 0, wake[0]);
+        if (search.found >= 0) {
+          top = view_line_of(&vf, search.found);
+          msg[0] = '\0';
+        } else {
+          snprintf(msg, sizeof(msg), "Pattern not found: %s", search.pattern);
+        }
+        continue;
+      }
+      if (!(pfd[0].revents & (POLLIN | POLLHUP))) {
+        continue;
+      }
+    }
+    if ((key = view_key()) < 0) {
+      break;
+    }
+
+    if (typing) {
+      if (key == '\r' || key == '\n') {
+        typing = 0;
+        msg[0] = '\0';
+        if (ilen > 0) {
+          view_search_join(&search, 1, wake[0]);
+          memcpy(search.pattern, input, ilen);
+          search.pattern[ilen] = '\0';
+          search.len = ilen;
+          key = 'n';
+        } else {
+          continue;
+        }
+      } else if (key == 0x7f || key == '\b') {
+        // Backspace on an empty pattern leaves the prompt.
+        typing = ilen > 0;
+        ilen = ilen ? ilen - 1 : 0;
+        msg[0] = '\0';
+        continue;
+      } else if (key == 0x1b) {
+        typing = 0;
+        msg[0] = '\0';
+        continue;
+      } else {
+        if (ilen < sizeof(input) - 1 && key >= 0x20) {
+          input[ilen++] = key;
+        }
+        continue;
+      }
+    }
+
+    if (key >= '0' && key <= '9') {
+      count = count * 10 + (key - '0');
+      continue;
+    }
+    switch (key) {
+    case 'q': case 'Q':
+      quit = 1;
+      break;
+    case 'j': case '\r': case '\n':
+      top += count ? count : 1;
+      break;
+    case 'k':
+      top -= top < (count ? count : 1) ? top : (count ? count : 1);
+      break;
+    case ' ': case 'f':
+      top += page;
+      break;
+    case 'b':
+      top -= top < page ? top : page;
+      break;
+    case 'g':
+      top = count ? count - 1 : 0;
+      break;
+    case 'G':
+      top = count ? count - 1 : max;
+      break;
+    case '%':
+      top = vf.lines * (count > 100 ? 100 : count) / 100;
+      break;
+    case '/': case '?':
+      typing = 1;
+      backward = key == '?';
+      ilen = 0;
+      break;
+    case 'n': case 'N':
+      if (search.len == 0) {
+        break;
+      }
+      view_search_join(&search, 1, wake[0]);
+      search.backward = backward ^ (key == 'N');
+      // Forward from the line after the top one, backward from the top line.
+      if (search.backward) {
+        search.from = top < vf.lines ? view_line_start(&vf, top) : vf.size;
+      } else {
+        search.from = top + 1 < vf.lines ? view_line_start(&vf, top + 1) : vf.size;
+      }
+      search.cancel = 0;
+      search.scanned = 0;
+      search.running = 1;
+      if (pthread_create(&search.thread, NULL, view_search_run, &search) != 0) {
+        search.thread = 0;
+        search.running = 0;
+        snprintf(msg, sizeof(msg), "search failed: %s", strerror(errno));
+      }
+      break;
+    }
+    count = 0;
+  }
+
+  view_search_join(&search, 1, wake[0]);
+  if (write(STDOUT_FILENO, "\033[?25h\033[?1049l", 14) < 0) {
+    // nothing left to restore onto
+  }
+  if (tty) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &save);
+  }
+  sigaction(SIGINT, &old_int, NULL);
+  sigaction(SIGWINCH, &old_winch, NULL);
+  close(wake[0]);
+  close(wake[1]);
+  close(fd);
+  lsh_free(frame);
+  lsh_free(vf.cp);
+  if (mapped) {
+    munmap((void *)vf.map, mapped);
+  }
+  view_map_base = NULL;
+  sigaction(SIGBUS, &old_bus, NULL);
+  lsh_last_status = 0;
+  return 1;
+}
+
+/*
+  jl [-w COND]... [-p PATH[,PATH...]] [-c] FILE...
+
+  Filters and projects JSON Lines such as event_log.  COND is PATH alone
+  (present and not false/null) or PATH OP VALUE with OP one of == != < <= >
+  >= and ~ (contains); VALUE compares as a number when both sides are
+  numbers and as text otherwise.  PATH is . or steps like .mem.env[0].
+  With one -p path its raw value is printed, with several an object keyed by
+  each path's last step; -c prints only the number of matching lines.
+
+  Files are mmap'd and cut at line boundaries into chunks that
+  lsh_parallel() works through, JL_WAVE chunks per CPU at a time, writing
+  each wave's output in order.  Every line is first indexed the way
+  simdjson's stage 1 does it: lsh_simd_json64() masks for quotes,
+  backslashes and structural characters, escaped quotes removed, a prefix
+  XOR over the quotes marking what is inside strings.  Paths are then
+  followed over that token list, skipping whole strings and nested values
+  without looking at their bytes.
+ */
+enum jl_op { JL_TRUTHY, JL_EQ, JL_NE, JL_LT, JL_LE, JL_GT, JL_GE, JL_HAS };
+
+struct jl_step {
+  const char *name;           // NULL for an array index
+  size_t len;
+  long index;
+};
+
+struct jl_path {
+  struct jl_step step[JL_MAX_DEPTH];
+  int n;
+  const char *text;
+};
+
+struct jl_cond {
+  struct jl_path path;
+  enum jl_op op;
+  const char *lit;            // without surrounding quotes
+  size_t litlen;
+  int numeric;
+  double num;
+};
+
+struct jl_query {
+  struct jl_cond cond[JL_MAX_TERMS];
+  int ncond;
+  struct jl_path proj[JL_MAX_TERMS];
+  int nproj;
+  int count_only;
+  const struct jl_cond *needle;   // text every matching line must contain
+};
+
+struct jl_chunk {
+  const char *begin, *end;
+  char *out;
+  size_t len, cap;
+  uint64_t matches;
+};
+
+struct jl_job {
+  const struct jl_query *q;
+  const char *map_end;
+  struct jl_chunk *chunk;
+};
+
+/* One line's token list: offsets of unescaped quotes and of { } [ ] : ,
+   outside strings. */
+struct jl_line {
+  const char *p;
+  size_t len;
+  uint32_t *tok;
+  size_t ntok;
+};
+
+/**
+   @brief Parse ".a.b[2]" into steps.
+   @return 0 on success, -1 if malformed.
+ */
+static int jl_parse_path(const char *s, size_t len, struct jl_path *path)
+{
+  size_t i = 0, j;
+
+  path->n = 0;
+  path->text = s;
+  if (len == 0 || s[0] != '.') {
+    return -1;
+  }
+  if (len == 1) {
+    return 0;
+  }
+  while (i < len) {
+    if (path->n == JL_MAX_DEPTH) {
+      return -1;
+    }
+    if (s[i] == '.') {
+      for (j = ++i; j < len && s[j] != '.' && s[j] != '['; j++) {
+      }
+      if (j == i) {
+        return -1;
+      }
+      path->step[path->n].name = s + i;
+      path->step[path->n].len = j - i;
+    } else if (s[i] == '[') {
+      path->step[path->n].name = NULL;
+      path->step[path->n].index = strtol(s + i + 1, NULL, 10);
+      for (j = i; j < len && s[j] != ']'; j++) {
+      }
+      if (j == len) {
+        return -1;
+      }
+      j++;
+    } else {
+      return -1;
+    }
+    path->n++;
+    i = j;
+  }
+  return 0;
+}
+
+static int jl_parse_cond(const char *s, struct jl_cond *c)
+{
+  static const struct { const char *text; enum jl_op op; } ops[] = {
+    { "==", JL_EQ }, { "!=", JL_NE }, { "<=", JL_LE }, { ">=", JL_GE },
+    { "<", JL_LT }, { ">", JL_GT }, { "~", JL_HAS },
+  };
+  size_t at = strcspn(s, "=!<>~"), i;
+  char *end;
+
+  c->op = JL_TRUTHY;
+  c->lit = "";
+  c->litlen = 0;
+  for (i = 0; s[at] != '\0' && i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (strncmp(s + at, ops[i].text, strlen(ops[i].text)) == 0) {
+      c->op = ops[i].op;
+      c->lit = s + at + strlen(ops[i].text);
+      break;
+    }
+  }
+  if (s[at] != '\0' && c->op == JL_TRUTHY) {
+    return -1;
+  }
+  c->litlen = strlen(c->lit);
+  if (c->litlen >= 2 && c->lit[0] == '"' && c->lit[c->litlen - 1] == '"') {
+    c->lit++;
+    c->litlen -= 2;
+  } else if (c->litlen > 0) {
+    c->num = strtod(c->lit, &end);
+    c->numeric = *end == '\0';
+  }
+  return jl_parse_path(s, at, &c->path);
+}
+
+/**
+   @brief Mask of characters preceded by an odd run of backslashes
+   (simdjson's branchless escape scan).  *carry says whether the previous
+   block ended in the middle of such a run.
+ */
+static uint64_t jl_escaped(uint64_t backslash, uint64_t *carry)
+{
+  const uint64_t even = 0x5555555555555555ULL;
+  uint64_t follows, odd_starts, sum, invert;
+
+  backslash &= ~*carry;
+  follows = backslash << 1 | *carry;
+  odd_starts = backslash & ~even & ~follows;
+  *carry = __builtin_add_overflow(odd_starts, backslash, &sum);
+  invert = sum << 1;
+  return (even ^ invert) & follows;
+}
+
+static uint64_t jl_prefix_xor(uint64_t x)
+{
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+static void jl_index(struct jl_line *ln, const char *map_end)
+{
+  uint64_t quote, backslash, structural, mask, carry = 0, inside = 0, in;
+  const char *src;
+  char pad[64];
+  size_t off;
+
+  ln->ntok = 0;
+  for (off = 0; off < ln->len; off += 64) {
+    src = ln->p + off;
+    if (src + 64 > map_end) {
+      memset(pad, ' ', sizeof(pad));
+      memcpy(pad, src, map_end - src);
+      src = pad;
+    }
+    lsh_simd_json64(src, &quote, &backslash, &structural);
+    mask = ln->len - off >= 64 ? ~0ULL : (1ULL << (ln->len - off)) - 1;
+    quote &= mask & ~jl_escaped(backslash & mask, &carry);
+    in = jl_prefix_xor(quote) ^ inside;
+    inside = (uint64_t)((int64_t)in >> 63);
+    for (structural = ((structural & mask) & ~in) | quote; structural != 0; structural &= structural - 1) {
+      ln->tok[ln->ntok++] = off + __builtin_ctzll(structural);
+    }
+  }
+}
+
+static size_t jl_skip_ws(const struct jl_line *ln, size_t pos)
+{
+  while (pos < ln->len && (ln->p[pos] == ' ' || ln->p[pos] == '\t' || ln->p[pos] == '\r')) {
+    pos++;
+  }
+  return pos;
+}
+
+/**
+   @brief Find the value that starts after the separator at token sep.
+   @param[out] vs, ve Its byte span.  [out] next Token index after it.
+   @return 0, or -1 if the line is malformed.
+ */
+static int jl_value(const struct jl_line *ln, size_t sep, size_t *vs, size_t *ve, size_t *next)
+{
+  size_t t = sep + 1, depth = 0;
+  char c;
+
+  *vs = jl_skip_ws(ln, ln->tok[sep] + 1);
+  if (*vs >= ln->len) {
+    return -1;
+  }
+  c = ln->p[*vs];
+  if (c == '"') {
+    if (t + 1 >= ln->ntok) {
+      return -1;
+    }
+    *ve = ln->tok[t + 1] + 1;
+    *next = t + 2;
+  } else if (c == '{' || c == '[') {
+    for (; t < ln->ntok; t++) {
+      c = ln->p[ln->tok[t]];
+      if (c == '"') {
+        t++;                  // closing quote
+      } else if (c == '{' || c == '[') {
+        depth++;
+      } else if ((c == '}' || c == ']') && --depth == 0) {
+        break;
+      }
+    }
+    if (t >= ln->ntok) {
+      return -1;
+    }
+    *ve = ln->tok[t] + 1;
+    *next = t + 1;
+  } else {
+    // number, true, false, null: runs up to the next , } or ]
+    if (t >= ln->ntok) {
+      return -1;
+    }
+    for (*ve = ln->tok[t]; *ve > *vs && (ln->p[*ve - 1] == ' ' || ln->p[*ve - 1] == '\t'); (*ve)--) {
+    }
+    *next = t;
+  }
+  return *next <= ln->ntok ? 0 : -1;
+}
+
+/**
+   @brief Follow path from the top-level value.
+   @return 1 with the value's span in *vs, *ve if present, else 0.
+ */
+static int jl_lookup(const struct jl_line *ln, const struct jl_path *path, size_t *vs, size_t *ve)
+{
+  size_t open, t, s, e, next, k;
+  int i;
+  char c;
+
+  *vs = jl_skip_ws(ln, 0);
+  *ve = ln->len;
+  while (*ve > *vs && (ln->p[*ve - 1] == ' ' || ln->p[*ve - 1] == '\r')) {
+    (*ve)--;
+  }
+  if (ln->ntok == 0 || ln->tok[0] != *vs) {
+    return path->n == 0 && *ve > *vs;
+  }
+
+  for (open = 0, i = 0; i < path->n; i++) {
+    c = ln->p[ln->tok[open]];
+    if (open + 1 >= ln->ntok || (path->step[i].name != NULL ? c != '{' : c != '[')) {
+      return 0;
+    }
+    c = ln->p[ln->tok[open + 1]];
+    if (c == '}' || (c == ']' && jl_skip_ws(ln, ln->tok[open] + 1) == ln->tok[open + 1])) {
+      return 0;               // empty
+    }
+    for (t = open, k = 0; ; k++) {
+      if (path->step[i].name != NULL) {
+        // "key" : value
+        if (t + 3 >= ln->ntok || ln->p[ln->tok[t + 1]] != '"' || ln->p[ln->tok[t + 3]] != ':') {
+          return 0;
+        }
+        s = ln->tok[t + 1] + 1;
+        e = ln->tok[t + 2];
+        if (jl_value(ln, t + 3, vs, ve, &next) != 0) {
+          return 0;
+        }
+        if (e - s == path->step[i].len && memcmp(ln->p + s, path->step[i].name, e - s) == 0) {
+          break;
+        }
+      } else {
+        if (jl_value(ln, t, vs, ve, &next) != 0) {
+          return 0;
+        }
+        if ((long)k == path->step[i].index) {
+          break;
+        }
+      }
+      if (next >= ln->ntok || ln->p[ln->tok[next]] != ',') {
+        return 0;
+      }
+      t = next;
+    }
+    // The next step starts from this value's opening token, if it has one.
+    for (open = t + 1; open < ln->ntok && ln->tok[open] < *vs; open++) {
+    }
+    if (i + 1 < path->n && (open >= ln->ntok || ln->tok[open] != *vs)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int jl_test(const struct jl_line *ln, const struct jl_cond *c)
+{
+  char num[64], *end;
+  size_t vs, ve, n;
+  const char *v;
+  int cmp, numeric = 0;
+  double d = 0;
+
+  if (!jl_lookup(ln, &c->path, &vs, &ve)) {
+    return c->op == JL_NE;
+  }
+  v = ln->p + vs;
+  n = ve - vs;
+  if (c->op == JL_TRUTHY) {
+    return !(n == 4 && memcmp(v, "null", 4) == 0) && !(n == 5 && memcmp(v, "false", 5) == 0);
+  }
+  if (n >= 2 && v[0] == '"') {
+    v++;
+    n -= 2;
+  } else if (c->numeric && n < sizeof(num)) {
+    memcpy(num, v, n);
+    num[n] = '\0';
+    d = strtod(num, &end);
+    numeric = *end == '\0';
+  }
+  if (c->op == JL_HAS) {
+    return memmem(v, n, c->lit, c->litlen) != NULL;
+  }
+  if (numeric) {
+    cmp = (d > c->num) - (d < c->num);
+  } else {
+    cmp = memcmp(v, c->lit, n < c->litlen ? n : c->litlen);
+    cmp = cmp ? cmp : (n > c->litlen) - (n < c->litlen);
+  }
+  switch (c->op) {
+  case JL_EQ:
+    return cmp == 0;
+  case JL_NE:
+    return cmp != 0;
+  case JL_LT:
+    return cmp < 0;
+  case JL_LE:
+    return cmp <= 0;
+  case JL_GT:
+    return cmp > 0;
+  case JL_GE:
+    return cmp >= 0;
+  default:
+    return 0;
+  }
+}
+
+static void jl_emit(struct jl_chunk *c, const char *s, size_t n)
+{
+  if (c->len + n > c->cap) {
+    c->cap = (c->len + n) * 2 + 4096;
+    c->out = lsh_realloc(MEM_BUILTINS, c->out, c->cap);
+    if (!c->out) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(c->out + c->len, s, n);
+  c->len += n;
+}
+
+static void jl_run(int i, void *arg)
+{
+  struct jl_job *job = arg;
+  const struct jl_query *q = job->q;
+  struct jl_chunk *c = &job->chunk[i];
+  struct jl_line ln = { 0 };
+  const struct jl_path *pp;
+  const char *p, *nl, *hit;
+  size_t cap = 0, vs, ve;
+  int k, ok;
+
+  for (p = c->begin; p < c->end; p = nl + 1) {
+    // Only lines holding the needle can match: jump to the next one.
+    if (q->needle != NULL) {
+      hit = view_find(p, c->end - p, q->needle->lit, q->needle->litlen);
+      if (hit == NULL) {
+        break;
+      }
+      nl = memrchr(p, '\n', hit - p);
+      p = nl ? nl + 1 : p;
+    }
+    nl = memchr(p, '\n', c->end - p);
+    nl = nl ? nl : c->end;
+    ln.p = p;
+    ln.len = nl - p;
+    if (ln.len == 0) {
+      continue;
+    }
+    if (q->ncond == 0 && q->nproj == 0) {
+      c->matches++;
+      if (!q->count_only) {
+        jl_emit(c, p, ln.len);
+        jl_emit(c, "\n", 1);
+      }
+      continue;
+    }
+    if (ln.len + 1 > cap) {
+      cap = (ln.len + 1) * 2;
+      lsh_free(ln.tok);
+      ln.tok = lsh_malloc(MEM_BUILTINS, cap * sizeof(uint32_t));
+      if (!ln.tok) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    jl_index(&ln, job->map_end);
+    for (ok = 1, k = 0; ok && k < q->ncond; k++) {
+      ok = jl_test(&ln, &q->cond[k]);
+    }
+    if (!ok) {
+      continue;
+    }
+    c->matches++;
+    if (q->count_only) {
+      continue;
+    }
+    if (q->nproj == 0) {
+      jl_emit(c, p, ln.len);
+    } else if (q->nproj == 1) {
+      if (jl_lookup(&ln, &q->proj[0], &vs, &ve)) {
+        jl_emit(c, p + vs, ve - vs);
+      } else {
+        jl_emit(c, "null", 4);
+      }
+    } else {
+      for (k = 0; k < q->nproj; k++) {
+        pp = &q->proj[k];
+        jl_emit(c, k ? ",\"" : "{\"", 2);
+        if (pp->n > 0 && pp->step[pp->n - 1].name != NULL) {
+          jl_emit(c, pp->step[pp->n - 1].name, pp->step[pp->n - 1].len);
+        } else {
+          jl_emit(c, pp->text + 1, strcspn(pp->text, ",") - 1);
+        }
+        jl_emit(c, "\":", 2);
+        if (jl_lookup(&ln, pp, &vs, &ve)) {
+          jl_emit(c, p + vs, ve - vs);
+        } else {
+          jl_emit(c, "null", 4);
+        }
+      }
+      jl_emit(c, "}", 1);
+    }
+    jl_emit(c, "\n", 1);
+  }
+  lsh_free(ln.tok);
+}
+
+/**
+   @brief Run the query over one file.
+   @return Number of matching lines, or -1 if the file could not be read.
+ */
+static long long jl_file(const struct jl_query *q, const char *file)
+{
+  struct jl_chunk *chunk;
+  struct jl_job job;
+  struct stat st;
+  const char *map, *p, *end;
+  long long matches = 0;
+  size_t step, off, n;
+  ssize_t w;
+  int fd, wave, i, nchunks;
+
+  if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "lsh: jl: %s: %s\n", file, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "lsh: jl: %s: %s\n", file, strerror(errno));
+    return -1;
+  }
+  madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+  end = map + st.st_size;
+
+  wave = lsh_nproc() * JL_WAVE;
+  chunk = lsh_calloc(MEM_BUILTINS, wave, sizeof(struct jl_chunk));
+  if (!chunk) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  job.q = q;
+  job.map_end = end;
+  job.chunk = chunk;
+  fflush(stdout);
+  for (p = map; p < end; ) {
+    // Cut the next wave into chunks that end on a newline.
+    step = (size_t)(end - p) / wave + 1;
+    step = step < JL_CHUNK_MIN ? JL_CHUNK_MIN : step > JL_CHUNK_MAX ? JL_CHUNK_MAX : step;
+    for (nchunks = 0; nchunks < wave && p < end; nchunks++) {
+      chunk[nchunks].begin = p;
+      p = (size_t)(end - p) > step ? p + step : end;
+      if (p < end && (p = memchr(p, '\n', end - p)) == NULL) {
+        p = end;
+      } else if (p < end) {
+        p++;
+      }
+      chunk[nchunks].end = p;
+      chunk[nchunks].len = 0;
+    }
+    lsh_parallel(nchunks, jl_run, &job);
+    for (i = 0; i < nchunks; i++) {
+      matches += chunk[i].matches;
+      chunk[i].matches = 0;
+      for (off = 0, n = chunk[i].len; off < n; off += w) {
+        if ((w = write(STDOUT_FILENO, chunk[i].out + off, n - off)) <= 0) {
+          break;
+        }
+      }
+    }
+  }
+  for (i = 0; i < wave; i++) {
+    lsh_free(chunk[i].out);
+  }
+  lsh_free(chunk);
+  munmap((void *)map, st.st_size);
+  return matches;
+}
+
+/**
+   @brief Builtin command: filter and project JSON Lines.
+   @param args List of args.  args[0] is "jl".
+   @return Always returns 1, to continue executing.
+ */
+int lsh_jl(char **args)
+{
+  struct jl_query q;
+  long long total = 0, n;
+  const char *s;
+  int i, failed = 0, files = 0;
+  size_t len;
+
+  memset(&q, 0, sizeof(q));
+  for (i = 1; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "-w") == 0 && args[i + 1] != NULL && q.ncond < JL_MAX_TERMS) {
+      if (jl_parse_cond(args[++i], &q.cond[q.ncond++]) != 0) {
+        fprintf(stderr, "lsh: jl: bad condition: %s\n", args[i]);
+        lsh_last_status = 2;
+        return 1;
+      }
+    } else if (strcmp(args[i], "-p") == 0 && args[i + 1] != NULL) {
+      for (s = args[++i]; *s != '\0' && q.nproj < JL_MAX_TERMS; s += len + (s[len] == ',')) {
+        len = strcspn(s, ",");
+        if (jl_parse_path(s, len, &q.proj[q.nproj++]) != 0) {
+          fprintf(stderr, "lsh: jl: bad path: %.*s\n", (int)len, s);
+          lsh_last_status = 2;
+          return 1;
+        }
+      }
+    } else if (strcmp(args[i], "-c") == 0) {
+      q.count_only = 1;
+    } else {
+      break;
+    }
+  }
+  // An == or ~ on a text literal needs that text, unchanged, in the line.
+  for (n = 0; n < q.ncond; n++) {
+    if ((q.cond[n].op == JL_EQ || q.cond[n].op == JL_HAS) && !q.cond[n].numeric && q.cond[n].litlen > 0
+        && (q.needle == NULL || q.cond[n].litlen > q.needle->litlen)) {
+      q.needle = &q.cond[n];
+    }
+  }
+  if (args[i] == NULL) {
+    fprintf(stderr, "lsh: usage: jl [-w COND]... [-p PATH[,PATH...]] [-c] FILE...\n");
+    lsh_last_status = 2;
+    return 1;
+  }
+  for (; args[i] != NULL; i++, files++) {
+    n = jl_file(&q, args[i]);
+    if (n < 0) {
+      failed = 1;
+    } else {
+      total += n;
+    }
+  }
+  if (q.count_only) {
+    printf("%lld\n", total);
+  }
+  // Like grep: 1 when nothing matched, 2 when a file could not be read.
+  lsh_last_status = failed ? 2 : total == 0;
+  return 1;
+}
+
+/*
+  hashsum [-c] FILE...
+
+  Prints SHA-256 digests in sha256sum's format, "HEX  NAME" (with a leading
+  backslash and \\ / \n escapes when NAME holds a backslash or newline), so
+  the output can be checked with sha256sum -c.  With -c the arguments are
+  such lists and every file named in them is checked, printing NAME: OK or
+  NAME: FAILED.
+
+  Files are handed out to lsh_parallel() workers.  Each worker keeps up to
+  HASHSUM_LANES files open, reads them HASHSUM_READ bytes at a time into
+  page-aligned buffers and pushes them through sha256_x8(), which hashes
+  eight streams at once in AVX2 registers, for as many blocks as every busy
+  lane has buffered.  A lane that runs dry is refilled from the queue; when
+  fewer than HASHSUM_X8_MIN lanes are busy (the tail of a large file), the
+  rest is hashed a block at a time with sha256_block().
+ */
+struct hashsum_file {
+  char *name;
+  uint8_t digest[32];
+  uint8_t expect[32];         // -c: digest from the list
+  int err;                    // errno from open/read, 0 once hashed
+};
+
+struct hashsum_job {
+  struct hashsum_file *file;
+  int nfiles;
+  int next;                   // next file to hand out
+  int lanes;                  // lanes each worker fills
+};
+
+struct hashsum_lane {
+  struct hashsum_file *file;  // NULL when idle
+  int fd;
+  void *raw;
+  uint8_t *buf;               // aligned; with 64 bytes of room in front for a partial block
+  const uint8_t *cur, *end;   // not yet hashed
+  uint64_t done;              // bytes hashed so far
+  int eof;
+};
+
+/**
+   @brief Put the next file from the queue into a lane.
+   @return 0 when the queue is empty.
+ */
+static int hashsum_open(struct hashsum_job *job, struct hashsum_lane *l, uint32_t st[8][8], int lane)
+{
+  struct sha256_ctx ctx;
+  int i, j;
+
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nfiles) {
+    if ((l->fd = open(job->file[i].name, O_RDONLY | O_CLOEXEC)) < 0) {
+      job->file[i].err = errno;
+      continue;
+    }
+    posix_fadvise(l->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    sha256_init(&ctx);
+    for (j = 0; j < 8; j++) {
+      st[j][lane] = ctx.h[j];
+    }
+    l->file = &job->file[i];
+    l->cur = l->end = l->buf;
+    l->done = 0;
+    l->eof = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+   @brief Read the next piece of a lane's file.  The partial block left over
+   moves in front of buf so the read itself stays aligned.
+ */
+static void hashsum_fill(struct hashsum_lane *l)
+{
+  size_t rest = l->end - l->cur;
+  ssize_t n;
+
+  memmove(l->buf - rest, l->cur, rest);
+  l->cur = l->buf - rest;
+  do {
+    n = read(l->fd, l->buf, HASHSUM_READ);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    l->file->err = errno;
+    close(l->fd);
+    l->file = NULL;
+    return;
+  }
+  l->end = l->buf + n;
+  l->eof = n == 0;
+}
+
+/**
+   @brief Hash what is left of a lane's file with the padding and store the
+   digest; the lane is then idle.
+ */
+static void hashsum_finish(struct hashsum_lane *l, uint32_t st[8][8], int lane)
+{
+  struct sha256_ctx ctx;
+  int j;
+
+  for (j = 0; j < 8; j++) {
+    ctx.h[j] = st[j][lane];
+  }
+  ctx.len = l->done;
+  ctx.n = 0;
+  sha256_update(&ctx, l->cur, l->end - l->cur);
+  sha256_final(&ctx, l->file->digest);
+  close(l->fd);
+  l->file = NULL;
+}
+
+/**
+   @brief lsh_parallel() worker: hash files from the queue until it is empty.
+ */
+static void hashsum_run(int w, void *arg)
+{
+  struct hashsum_job *job = arg;
+  struct hashsum_lane lane[HASHSUM_LANES], *l;
+  uint32_t st[8][8], h[8];
+  const uint8_t *p[8];
+  size_t blocks, n;
+  int i, j, busy, more = 1;
+
+  memset(lane, 0, sizeof(lane));
+  for (i = 0; i < job->lanes; i++) {
+    lane[i].raw = lsh_malloc(MEM_BUILTINS, HASHSUM_READ + 2 * HASHSUM_ALIGN);
+    if (!lane[i].raw) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    lane[i].buf = (uint8_t *)(((uintptr_t)lane[i].raw + 2 * HASHSUM_ALIGN - 1) & ~(uintptr_t)(HASHSUM_ALIGN - 1));
+  }
+  for (;;) {
+    busy = 0;
+    for (i = 0; i < job->lanes; i++) {
+      l = &lane[i];
+      // Until the lane has a whole block to hash, or nothing more to do.
+      while (l->file == NULL || l->end - l->cur < 64) {
+        if (l->file == NULL) {
+          if (!more || !(more = hashsum_open(job, l, st, i))) {
+            break;
+          }
+        } else if (!l->eof) {
+          hashsum_fill(l);
+        } else {
+          hashsum_finish(l, st, i);
+        }
+      }
+      busy += l->file != NULL;
+    }
+    if (busy == 0) {
+      break;
+    }
+    if (busy >= HASHSUM_X8_MIN && sha256_x8_fast()) {
+      blocks = SIZE_MAX;
+      for (i = 0; i < job->lanes; i++) {
+        if (lane[i].file != NULL && (n = (lane[i].end - lane[i].cur) / 64) < blocks) {
+          blocks = n;
+        }
+      }
+      // Idle lanes hash a busy lane's blocks again; their state is dropped.
+      for (i = 0, j = -1; i < 8; i++) {
+        if (i < job->lanes && lane[i].file != NULL) {
+          p[i] = lane[i].cur;
+          j = j < 0 ? i : j;
+        }
+      }
+      for (i = 0; i < 8; i++) {
+        if (i >= job->lanes || lane[i].file == NULL) {
+          p[i] = lane[j].cur;
+        }
+      }
+      sha256_x8(st, p, blocks);
+      for (i = 0; i < job->lanes; i++) {
+        if (lane[i].file != NULL) {
+          lane[i].cur += blocks * 64;
+          lane[i].done += blocks * 64;
+        }
+      }
+    } else {
+      for (i = 0; i < job->lanes; i++) {
+        if ((l = &lane[i])->file == NULL) {
+          continue;
+        }
+        for (j = 0; j < 8; j++) {
+          h[j] = st[j][i];
+        }
+        for (; l->end - l->cur >= 64; l->cur += 64, l->done += 64) {
+          sha256_block(h, l->cur);
+        }
+        for (j = 0; j < 8; j++) {
+          st[j][i] = h[j];
+        }
+      }
+    }
+  }
+  for (i = 0; i < job->lanes; i++) {
+    lsh_free(lane[i].raw);
+  }
+}
+
+/**
+   @brief Print one line of sha256sum output.
+ */
+static void hashsum_print(const struct hashsum_file *f)
+{
+  const char *s;
+  int i;
+
+  if (strpbrk(f->name, "\\\n") != NULL) {
+    putchar('\\');
+  }
+  for (i = 0; i < 32; i++) {
+    printf("%02x", f->digest[i]);
+  }
+  fputs("  ", stdout);
+  for (s = f->name; *s != '\0'; s++) {
+    if (*s == '\\') {
+      fputs("\\\\", stdout);
+    } else if (*s == '\n') {
+      fputs("\\n", stdout);
+    } else {
+      putchar(*s);
+    }
+  }
+  putchar('\n');
+}
+
+static int hashsum_hexval(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/**
+   @brief Parse one line of a sha256sum list into f (name allocated).
+   @return 0, or -1 if the line is not a SHA-256 line.
+ */
+static int hashsum_parse(char *line, struct hashsum_file *f)
+{
+  int escaped = line[0] == '\\', i, hi, lo;
+  char *s = line + escaped, *out;
+
+  line[strcspn(line, "\r\n")] = '\0';
+  for (i = 0; i < 32; i++) {
+    hi = hashsum_hexval(s[2 * i]);
+    lo = hi < 0 ? -1 : hashsum_hexval(s[2 * i + 1]);
+    if (lo < 0) {
+      return -1;
+    }
+    f->expect[i] = hi << 4 | lo;
+  }
+  s += 64;
+  if (s[0] != ' ' || (s[1] != ' ' && s[1] != '*') || s[2] == '\0') {
+    return -1;
+  }
+  s += 2;
+  if (escaped) {
+    for (out = s, line = s; *line != '\0'; line++) {
+      if (*line == '\\' && (line[1] == '\\' || line[1] == 'n')) {
+        *out++ = *++line == 'n' ? '\n' : '\\';
+      } else {
+        *out++ = *line;
+      }
+    }
+    *out = '\0';
+  }
+  f->name = lsh_strdup(MEM_BUILTINS, s);
+  if (!f->name) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  f->err = 0;
+  return 0;
+}
+
+/**
+   @brief Builtin command: print or check SHA-256 digests of files.
+   @param args List of args.  args[0] is "hashsum".
+   @return Always returns 1, to continue executing.
+ */
+int lsh_hashsum(char **args)
+{
+  struct hashsum_job job;
+  struct hashsum_file *f = NULL;
+  int i, n = 0, cap = 0, check = 0, bad = 0, unread = 0, improper = 0, nolist = 0, nproc, workers;
+  char *line = NULL;
+  size_t linecap = 0;
+  FILE *fp;
+
+  i = 1;
+  if (args[i] != NULL && strcmp(args[i], "-c") == 0) {
+    check = 1;
+    i++;
+  }
+  if (args[i] != NULL && strcmp(args[i], "--") == 0) {
+    i++;
+  }
+  if (args[i] == NULL) {
+    fprintf(stderr, "lsh: usage: hashsum [-c] FILE...\n");
+    lsh_last_status = 2;
+    return 1;
+  }
+  for (; args[i] != NULL; i++) {
+    fp = check ? fopen(args[i], "r") : NULL;
+    if (check && fp == NULL) {
+      fprintf(stderr, "lsh: hashsum: %s: %s\n", args[i], strerror(errno));
+      nolist++;
+      continue;
+    }
+    do {
+      if (n == cap) {
+        cap = cap ? cap * 2 : 64;
+        f = lsh_realloc(MEM_BUILTINS, f, cap * sizeof(struct hashsum_file));
+        if (!f) {
+          fprintf(stderr, "lsh: allocation error\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      if (!check) {
+        memset(&f[n], 0, sizeof(f[n]));
+        f[n++].name = args[i];
+        break;
+      }
+      if (getline(&line, &linecap, fp) < 0) {
+        break;
+      }
+      if (hashsum_parse(line, &f[n]) == 0) {
+        n++;
+      } else if (line[strspn(line, " \t\r\n")] != '\0') {
+        improper++;
+      }
+    } while (1);
+    if (fp != NULL) {
+      fclose(fp);
+    }
+  }
+  free(line);
+
+  if (n > 0) {
+    // Fill each worker's lanes before starting more workers than that.
+    nproc = lsh_nproc();
+    job.file = f;
+    job.nfiles = n;
+    job.next = 0;
+    job.lanes = (n + nproc - 1) / nproc;
+    job.lanes = job.lanes > HASHSUM_LANES ? HASHSUM_LANES : job.lanes;
+    workers = (n + job.lanes - 1) / job.lanes;
+    lsh_parallel(workers, hashsum_run, &job);
+  }
+
+  for (i = 0; i < n; i++) {
+    if (check) {
+      if (f[i].err != 0) {
+        printf("%s: FAILED open or read\n", f[i].name);
+        fprintf(stderr, "lsh: hashsum: %s: %s\n", f[i].name, strerror(f[i].err));
+        unread++;
+      } else if (memcmp(f[i].digest, f[i].expect, 32) != 0) {
+        printf("%s: FAILED\n", f[i].name);
+        bad++;
+      } else {
+        printf("%s: OK\n", f[i].name);
+      }
+      lsh_free(f[i].name);
+    } else if (f[i].err != 0) {
+      fprintf(stderr, "lsh: hashsum: %s: %s\n", f[i].name, strerror(f[i].err));
+      unread++;
+    } else {
+      hashsum_print(&f[i]);
+    }
+  }
+  fflush(stdout);
+  if (improper > 0) {
+    fprintf(stderr, "lsh: hashsum: WARNING: %d line%s improperly formatted\n", improper, improper == 1 ? " is" : "s are");
+  }
+  if (check && unread > 0) {
+    fprintf(stderr, "lsh: hashsum: WARNING: %d listed file%s could not be read\n", unread, unread == 1 ? "" : "s");
+  }
+  if (bad > 0) {
+    fprintf(stderr, "lsh: hashsum: WARNING: %d computed checksum%s did NOT match\n", bad, bad == 1 ? "" : "s");
+  }
+  if (check && n == 0 && nolist == 0) {
+    fprintf(stderr, "lsh: hashsum: no properly formatted SHA256 checksum lines found\n");
+    bad++;
+  }
+  lsh_free(f);
+  lsh_last_status = bad > 0 || unread > 0 || nolist > 0;
+  return 1;
+}
+
+/*
+  pcopy [-j N] SRC... DST
+
+  Copies files and directory trees like cp -r, keeping modes and times.
+  With one SRC, DST that is not an existing directory becomes the copy;
+  otherwise each SRC is copied into DST under its own name.
+
+  The tree is walked by N threads (PCOPY_THREADS by default; copying waits
+  on the disk or the network more than on the CPU) sharing a work-stealing
+  pool: every thread pushes the entries of the directory it lists onto its
+  own deque and pops from the same end, so it goes depth first through its
+  part of the tree, and an idle thread steals the oldest entry of another,
+  which is usually a whole subtree.  File data moves with
+  copy_file_range(), so it never passes through user space and filesystems
+  that can share extents (btrfs, XFS, NFS 4.2 server-side copy) make a
+  reflink instead of copying; files over PCOPY_SPLIT are cut into
+  PCOPY_CHUNK ranges that are pushed as tasks of their own.  A directory's
+  mode and times are set when the last entry under it is done, since
+  writing into it changes its mtime.
+ */
+enum pcopy_kind { PCOPY_ENTRY, PCOPY_RANGE };
+
+struct pcopy_node {           // a directory or split file still being copied
+  struct pcopy_node *parent;
+  int pending;                // entries or ranges not finished
+  char *dst;
+  struct stat st;
+  int in, out;                // split files only, -1 for a directory
+};
+
+struct pcopy_task {
+  enum pcopy_kind kind;
+  char *src, *dst;            // PCOPY_ENTRY
+  struct pcopy_node *parent;  // directory of an entry, the file of a range
+  off_t off;
+  size_t len;
+};
+
+struct pcopy_deque {
+  pthread_mutex_t lock;
+  struct pcopy_task *task;
+  int head, tail, cap;        // thieves take task[head], the owner task[tail - 1]
+};
+
+struct pcopy_pool {
+  struct pcopy_deque *dq;
+  int nworkers;
+  int next;                   // worker number for the next thread
+  int queued;                 // tasks in the deques
+  int pending;                // tasks queued or running
+  int idle;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  unsigned long long files, bytes;
+  int errors;
+};
+
+static void pcopy_error(struct pcopy_pool *pool, const char *path, int err)
+{
+  fprintf(stderr, "lsh: pcopy: %s: %s\n", path, strerror(err));
+  __atomic_add_fetch(&pool->errors, 1, __ATOMIC_RELAXED);
+}
+
+static char *pcopy_join(const char *dir, const char *name)
+{
+  size_t a = strlen(dir), b = strlen(name);
+  char *path = lsh_malloc(MEM_BUILTINS, a + b + 2);
+
+  if (!path) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(path, dir, a);
+  path[a] = '/';
+  memcpy(path + a + 1, name, b + 1);
+  return path;
+}
+
+/**
+   @brief Push a task onto worker w's deque and wake an idle worker.
+ */
+static void pcopy_push(struct pcopy_pool *pool, int w, const struct pcopy_task *t)
+{
+  struct pcopy_deque *dq = &pool->dq[w];
+
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail == dq->cap) {
+    if (dq->head > 0) {
+      memmove(dq->task, dq->task + dq->head, (dq->tail - dq->head) * sizeof(struct pcopy_task));
+      dq->tail -= dq->head;
+      dq->head = 0;
+    } else {
+      dq->cap = dq->cap ? dq->cap * 2 : 64;
+      dq->task = lsh_realloc(MEM_BUILTINS, dq->task, dq->cap * sizeof(struct pcopy_task));
+      if (!dq->task) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  dq->task[dq->tail++] = *t;
+  pthread_mutex_unlock(&dq->lock);
+  // A worker going idle raises idle before it looks at queued, we raise
+  // queued before we look at idle: one of us sees the other.
+  __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+  }
+}
+
+/**
+   @brief Take a task: the newest from worker w's own deque, else the
+   oldest from another's.
+   @return 1 if t was filled.
+ */
+static int pcopy_take(struct pcopy_pool *pool, int w, struct pcopy_task *t)
+{
+  struct pcopy_deque *dq;
+  int i, got;
+
+  for (i = 0; i < pool->nworkers; i++) {
+    dq = &pool->dq[(w + i) % pool->nworkers];
+    if (__atomic_load_n(&dq->tail, __ATOMIC_RELAXED) == __atomic_load_n(&dq->head, __ATOMIC_RELAXED)) {
+      continue;
+    }
+    pthread_mutex_lock(&dq->lock);
+    if ((got = dq->head < dq->tail)) {
+      *t = i == 0 ? dq->task[--dq->tail] : dq->task[dq->head++];
+      if (dq->head == dq->tail) {
+        dq->head = dq->tail = 0;
+      }
+    }
+    pthread_mutex_unlock(&dq->lock);
+    if (got) {
+      __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+   @brief Copy len bytes at off (or up to EOF when len is SIZE_MAX).
+   @return 0, or an errno value.
+ */
+static int pcopy_data(struct pcopy_pool *pool, int in, int out, off_t off, size_t len)
+{
+  off_t off_in = off, off_out = off;
+  char *buf = NULL;
+  ssize_t n, w, r;
+  size_t want;
+  int err = 0;
+
+  while (len > 0) {
+    want = len < PCOPY_CHUNK ? len : PCOPY_CHUNK;
+    if (buf == NULL) {
+      n = copy_file_range(in, &off_in, out, &off_out, want, 0);
+      if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+        // Cross-filesystem on an old kernel, or a source like /proc.
+        buf = lsh_malloc(MEM_BUILTINS, PCOPY_BUF);
+        if (!buf) {
+          fprintf(stderr, "lsh: allocation error\n");
+          exit(EXIT_FAILURE);
+        }
+        continue;
+      }
+    } else if ((n = pread(in, buf, want < PCOPY_BUF ? want : PCOPY_BUF, off_in)) > 0) {
+      for (w = 0; w < n; w += r) {
+        if ((r = pwrite(out, buf + w, n - w, off_out + w)) < 0) {
+          break;
+        }
+      }
+      if (w < n) {
+        n = -1;
+      } else {
+        off_in += n;
+        off_out += n;
+      }
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      err = errno;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    len -= len == SIZE_MAX ? 0 : (size_t)n;
+    __atomic_add_fetch(&pool->bytes, (unsigned long long)n, __ATOMIC_RELAXED);
+  }
+  lsh_free(buf);
+  return err;
+}
+
+/**
+   @brief Set the mode and times of a finished copy.
+ */
+static void pcopy_meta(struct pcopy_pool *pool, int fd, const char *dst, const struct stat *st)
+{
+  struct timespec ts[2] = { st->st_atim, st->st_mtim };
+
+  if ((fd >= 0 ? fchmod(fd, st->st_mode & 07777) : chmod(dst, st->st_mode & 07777)) != 0
+      || (fd >= 0 ? futimens(fd, ts) : utimensat(AT_FDCWD, dst, ts, 0)) != 0) {
+    pcopy_error(pool, dst, errno);
+  }
+}
+
+/**
+   @brief One entry or range under node is done; finish node (and then its
+   parent) when it was the last.
+ */
+static void pcopy_release(struct pcopy_pool *pool, struct pcopy_node *node)
+{
+  struct pcopy_node *parent;
+
+  while (node != NULL && __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    pcopy_meta(pool, node->out, node->dst, &node->st);
+    if (node->out >= 0) {
+      close(node->in);
+      close(node->out);
+      __atomic_add_fetch(&pool->files, 1, __ATOMIC_RELAXED);
+    }
+    parent = node->parent;
+    lsh_free(node->dst);
+    lsh_free(node);
+    node = parent;
+  }
+}
+
+static struct pcopy_node *pcopy_node(struct pcopy_node *parent, char *dst, const struct stat *st, int pending)
+{
+  struct pcopy_node *node = lsh_malloc(MEM_BUILTINS, sizeof(struct pcopy_node));
+
+  if (!node) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  node->parent = parent;
+  node->pending = pending;
+  node->dst = dst;
+  node->st = *st;
+  node->in = node->out = -1;
+  return node;
+}
+
+/**
+   @brief Copy one file or symlink, or make a directory and queue its entries.
+ */
+static void pcopy_entry(struct pcopy_pool *pool, int w, struct pcopy_task *t)
+{
+  struct pcopy_task sub;
+  struct pcopy_node *node;
+  struct dirent *ent;
+  struct stat st;
+  struct timespec ts[2];
+  char target[PATH_MAX];
+  DIR *dir;
+  ssize_t n;
+  off_t off;
+  int in, out, err;
+
+  if (lstat(t->src, &st) != 0) {
+    pcopy_error(pool, t->src, errno);
+  } else if (S_ISDIR(st.st_mode)) {
+    // Owner rwx while filling it; the real mode is set at the end.
+    if (mkdir(t->dst, 0700) != 0 && (errno != EEXIST || chmod(t->dst, 0700) != 0)) {
+      pcopy_error(pool, t->dst, errno);
+    } else if ((dir = opendir(t->src)) == NULL) {
+      pcopy_error(pool, t->src, errno);
+    } else {
+      // One reference for this listing, one per entry queued.
+      node = pcopy_node(t->parent, t->dst, &st, 1);
+      t->dst = NULL;
+      while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+          continue;
+        }
+        __atomic_add_fetch(&node->pending, 1, __ATOMIC_RELAXED);
+        sub.kind = PCOPY_ENTRY;
+        sub.src = pcopy_join(t->src, ent->d_name);
+        sub.dst = pcopy_join(node->dst, ent->d_name);
+        sub.parent = node;
+        pcopy_push(pool, w, &sub);
+      }
+      closedir(dir);
+      pcopy_release(pool, node);
+      return;
+    }
+  } else if (S_ISLNK(st.st_mode)) {
+    if ((n = readlink(t->src, target, sizeof(target) - 1)) < 0) {
+      pcopy_error(pool, t->src, errno);
+    } else {
+      target[n] = '\0';
+      ts[0] = st.st_atim;
+      ts[1] = st.st_mtim;
+      if ((symlink(target, t->dst) != 0 && (errno != EEXIST || unlink(t->dst) != 0 || symlink(target, t->dst) != 0))
+          || utimensat(AT_FDCWD, t->dst, ts, AT_SYMLINK_NOFOLLOW) != 0) {
+        pcopy_error(pool, t->dst, errno);
+      } else {
+        __atomic_add_fetch(&pool->files, 1, __ATOMIC_RELAXED);
+      }
+    }
+  } else if (!S_ISREG(st.st_mode)) {
+    fprintf(stderr, "lsh: pcopy: %s: skipping special file\n", t->src);
+    __atomic_add_fetch(&pool->errors, 1, __ATOMIC_RELAXED);
+  } else if ((in = open(t->src, O_RDONLY | O_CLOEXEC)) < 0) {
+    pcopy_error(pool, t->src, errno);
+  } else if ((out = open(t->dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+    pcopy_error(pool, t->dst, errno);
+    close(in);
+  } else if (st.st_size > PCOPY_SPLIT) {
+    // Ranges other workers can steal; the last one done closes the file.
+    node = pcopy_node(t->parent, t->dst, &st, 1);
+    node->in = in;
+    node->out = out;
+    t->dst = NULL;
+    t->parent = NULL;
+    for (off = 0; off < st.st_size; off += PCOPY_CHUNK) {
+      __atomic_add_fetch(&node->pending, 1, __ATOMIC_RELAXED);
+      sub.kind = PCOPY_RANGE;
+      sub.src = sub.dst = NULL;
+      sub.parent = node;
+      sub.off = off;
+      sub.len = st.st_size - off < PCOPY_CHUNK ? (size_t)(st.st_size - off) : PCOPY_CHUNK;
+      pcopy_push(pool, w, &sub);
+    }
+    pcopy_release(pool, node);
+  } else {
+    if ((err = pcopy_data(pool, in, out, 0, SIZE_MAX)) != 0) {
+      pcopy_error(pool, t->dst, err);
+    } else {
+      pcopy_meta(pool, out, t->dst, &st);
+      __atomic_add_fetch(&pool->files, 1, __ATOMIC_RELAXED);
+    }
+    close(in);
+    close(out);
+  }
+  pcopy_release(pool, t->parent);
+}
+
+/**
+   @brief Run tasks as worker w until every queued task is done.
+ */
+static void pcopy_work(struct pcopy_pool *pool, int w)
+{
+  struct pcopy_task t;
+  int err;
+
+  for (;;) {
+    if (pcopy_take(pool, w, &t)) {
+      if (t.kind == PCOPY_RANGE) {
+        if ((err = pcopy_data(pool, t.parent->in, t.parent->out, t.off, t.len)) != 0) {
+          pcopy_error(pool, t.parent->dst, err);
+        }
+        pcopy_release(pool, t.parent);
+      } else {
+        pcopy_entry(pool, w, &t);
+      }
+      lsh_free(t.src);
+      lsh_free(t.dst);
+      if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_broadcast(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+      }
+      continue;
+    }
+    pthread_mutex_lock(&pool->idle_lock);
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0) {
+      pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+    }
+    __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->idle_lock);
+    if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) {
+      return;
+    }
+  }
+}
+
+static void *pcopy_thread(void *arg)
+{
+  struct pcopy_pool *pool = arg;
+
+  prof_thread_init();
+  pcopy_work(pool, __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED));
+  return NULL;
+}
+
+/**
+   @brief Refuse copies that would never end or would truncate their source:
+   a tree into itself, or a file onto itself.
+   @return 1 if src may be copied to dst.
+ */
+static int pcopy_check(const char *src, const struct stat *st, const char *dst)
+{
+  char real_src[PATH_MAX], real_dst[PATH_MAX], *parent, *slash;
+  struct stat dst_st;
+  size_t len;
+  int ok = 1;
+
+  if (!S_ISDIR(st->st_mode)) {
+    if (stat(dst, &dst_st) == 0 && dst_st.st_dev == st->st_dev && dst_st.st_ino == st->st_ino) {
+      fprintf(stderr, "lsh: pcopy: %s and %s are the same file\n", src, dst);
+      return 0;
+    }
+    return 1;
+  }
+  parent = lsh_strdup(MEM_BUILTINS, dst);
+  if (!parent) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  slash = strrchr(parent, '/');
+  if (slash == NULL) {
+    strcpy(parent, ".");
+  } else {
+    slash[slash == parent] = '\0';
+  }
+  if (realpath(src, real_src) != NULL && realpath(parent, real_dst) != NULL) {
+    len = strlen(real_src);
+    if (strncmp(real_dst, real_src, len) == 0 && (real_dst[len] == '/' || real_dst[len] == '\0' || len == 1)) {
+      fprintf(stderr, "lsh: pcopy: cannot copy %s into itself\n", src);
+      ok = 0;
+    }
+  }
+  lsh_free(parent);
+  return ok;
+}
+
+/**
+   @brief Builtin command: copy files and trees in parallel.
+   @param args List of args.  args[0] is "pcopy".
+   @return Always returns 1, to continue executing.
+ */
+int lsh_pcopy(char **args)
+{
+  struct pcopy_pool pool;
+  struct pcopy_task t;
+  struct timespec t0, t1;
+  struct stat st;
+  pthread_t *threads;
+  char *dst, *base, user_json[BUF_SIZE * 2];
+  int i, first, nsrc, into, started = 0;
+  size_t len;
+
+  memset(&pool, 0, sizeof(pool));
+  pool.nworkers = PCOPY_THREADS;
+  for (i = 1; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL && atoi(args[i + 1]) > 0) {
+      pool.nworkers = atoi(args[++i]);
+    } else if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    } else {
+      break;
+    }
+  }
+  first = i;
+  for (nsrc = 0; args[i] != NULL; i++, nsrc++) {
+  }
+  if (nsrc < 2) {
+    fprintf(stderr, "lsh: usage: pcopy [-j N] SRC... DST\n");
+    lsh_last_status = 2;
+    return 1;
+  }
+  dst = args[first + --nsrc];
+  into = stat(dst, &st) == 0 && S_ISDIR(st.st_mode);
+  if (nsrc > 1 && !into) {
+    fprintf(stderr, "lsh: pcopy: %s: not a directory\n", dst);
+    lsh_last_status = 1;
+    return 1;
+  }
+
+  pool.dq = lsh_calloc(MEM_BUILTINS, pool.nworkers, sizeof(struct pcopy_deque));
+  threads = lsh_malloc(MEM_BUILTINS, pool.nworkers * sizeof(pthread_t));
+  if (!pool.dq || !threads) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < pool.nworkers; i++) {
+    pthread_mutex_init(&pool.dq[i].lock, NULL);
+  }
+  pthread_mutex_init(&pool.idle_lock, NULL);
+  pthread_cond_init(&pool.idle_cond, NULL);
+
+  // Queue the sources on the first deque; the workers spread them out.
+  for (i = first; i < first + nsrc; i++) {
+    if (lstat(args[i], &st) != 0) {
+      pcopy_error(&pool, args[i], errno);
+      continue;
+    }
+    t.kind = PCOPY_ENTRY;
+    t.parent = NULL;
+    t.src = lsh_strdup(MEM_BUILTINS, args[i]);
+    if (into) {
+      len = strlen(args[i]);
+      while (len > 1 && args[i][len - 1] == '/') {
+        len--;
+      }
+      base = memrchr(args[i], '/', len);
+      base = base ? base + 1 : args[i];
+      len -= base - args[i];
+      t.dst = lsh_malloc(MEM_BUILTINS, strlen(dst) + len + 2);
+      if (t.dst) {
+        sprintf(t.dst, "%s/%.*s", dst, (int)len, base);
+      }
+    } else {
+      t.dst = lsh_strdup(MEM_BUILTINS, dst);
+    }
+    if (!t.src || !t.dst) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    if (!pcopy_check(t.src, &st, t.dst)) {
+      pool.errors++;
+      lsh_free(t.src);
+      lsh_free(t.dst);
+      continue;
+    }
+    pcopy_push(&pool, 0, &t);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (pool.pending > 0) {
+    // The calling thread works too, as worker 0.
+    pool.next = 1;
+    for (i = 1; i < pool.nworkers; i++) {
+      if (pthread_create(&threads[started], NULL, pcopy_thread, &pool) == 0) {
+        started++;
+      }
+    }
+    pcopy_work(&pool, 0);
+    for (i = 0; i < started; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  for (i = 0; i < pool.nworkers; i++) {
+    pthread_mutex_destroy(&pool.dq[i].lock);
+    lsh_free(pool.dq[i].task);
+  }
+  pthread_mutex_destroy(&pool.idle_lock);
+  pthread_cond_destroy(&pool.idle_cond);
+  lsh_free(pool.dq);
+  lsh_free(threads);
+  lsh_last_status = pool.errors > 0;
+  lsh_json_str(user_json, sizeof(user_json), lsh_user);
+  lsh_event("\"event\":\"pcopy\",\"user\":\"%s\",\"files\":%llu,\"bytes\":%llu,\"errors\":%d,\"seconds\":%.3f",
+            user_json, pool.files, pool.bytes, pool.errors,
+            (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+  return 1;
+}
+
+/**
+  @brief Launch a program and wait for it to terminate.
+  @param args Null terminated list of arguments (including program).
+  @return Always returns 1, to continue execution.
+ */
+int lsh_launch(char **args)
+{
+  const char *path;
+  pid_t pid;
+  int status, err = 0, fds[2] = { -1, -1 };
+
+  // Resolve through the shared PATH table to skip execvp's directory walk.
+  path = strchr(args[0], '/') == NULL ? lsh_cache_command(args[0]) : NULL;
+
+  // The child reports a failed exec's errno through a close-on-exec pipe.
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    fds[0] = fds[1] = -1;
+  }
+
+  pid = fork();
+  if (pid == 0) {
+    // Child process
+    if (path != NULL) {
+      execv(path, args);
+    }
+    if (execvp(args[0], args) == -1) {
+      err = errno;
+      if (err == ENOENT && strchr(args[0], '/') == NULL) {
+        fprintf(stderr, "lsh: %s: command not found\n", args[0]);
+      } else {
+        perror("lsh");
+      }
+      if (fds[1] >= 0 && write(fds[1], &err, sizeof(err)) != sizeof(err)) {
+        err = 0;
+      }
+    }
+    exit(err == ENOENT ? 127 : EXIT_FAILURE);
+  } else if (pid < 0) {
+    // Error forking
+    perror("lsh");
+  } else {
+    // Parent process
+    if (fds[1] >= 0) {
+      close(fds[1]);
+      fds[1] = -1;
+      if (read(fds[0], &err, sizeof(err)) != sizeof(err)) {
+        err = 0;
+      }
+    }
+    do {
+      waitpid(pid, &status, WUNTRACED);
+    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    lsh_last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (err == ENOENT && strchr(args[0], '/') == NULL) {
+      lsh_suggest(args[0]);
+    }
+  }
+  if (fds[0] >= 0) {
+    close(fds[0]);
+  }
+  if (fds[1] >= 0) {
+    close(fds[1]);
+  }
+
+  return 1;
+}
+
+/**
+   @brief Is this token a process substitution, <(cmd) or >(cmd)?
+ */
+static int lsh_is_procsub(const char *tok)
+{
+  size_t len = strlen(tok);
+
+  return len >= 3 && (tok[0] == '<' || tok[0] == '>') && tok[1] == '(' && tok[len - 1] == ')';
+}
+
+/**
+   @brief Run a command with its process substitutions.  Each <(cmd) or
+   >(cmd) is started concurrently with one end of a pipe as its stdout or
+   stdin, and the outer command gets the other end as /dev/fd/N.
+   @param args Null terminated list of arguments, some of them substitutions.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+static int lsh_execute_procsub(char **args)
+{
+  int n, i, j, nsub = 0, status, ret = 1, failed = 0, fds[2];
+  struct { int fd; pid_t pid; } *subs;
+  char **argv, **inner_args, *inner;
+  pid_t pid;
+
+  for (n = 0; args[n] != NULL; n++) {
+  }
+  argv = lsh_calloc(MEM_TOKENIZER, n + 1, sizeof(char *));
+  subs = lsh_calloc(MEM_TOKENIZER, n, sizeof(*subs));
+  if (!argv || !subs) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < n; i++) {
+    argv[i] = args[i];
+    if (!lsh_is_procsub(args[i])) {
+      continue;
+    }
+    // Leaving the token in place would recurse back here, so give up instead.
+    if (pipe(fds) != 0) {
+      perror("lsh");
+      failed = 1;
+      break;
+    }
+    pid = fork();
+    if (pid == 0) {
+      // Child: the inner command, reading or writing our end of the pipe.
+      for (j = 0; j < nsub; j++) {
+        close(subs[j].fd);
+      }
+      if (args[i][0] == '<') {
+        dup2(fds[1], STDOUT_FILENO);
+      } else {
+        dup2(fds[0], STDIN_FILENO);
+      }
+      close(fds[0]);
+      close(fds[1]);
+      inner = strndup(args[i] + 2, strlen(args[i]) - 3);
+      inner_args = lsh_split_line(inner);
+      lsh_execute(inner_args);
+      fflush(stdout);
+      _exit(lsh_last_status);
+    } else if (pid < 0) {
+      perror("lsh");
+      close(fds[0]);
+      close(fds[1]);
+      failed = 1;
+      break;
+    }
+    if (args[i][0] == '<') {
+      close(fds[1]);
+      subs[nsub].fd = fds[0];
+    } else {
+      close(fds[0]);
+      subs[nsub].fd = fds[1];
+    }
+    subs[nsub].pid = pid;
+    argv[i] = lsh_malloc(MEM_TOKENIZER, 32);
+    if (!argv[i]) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    snprintf(argv[i], 32, "/dev/fd/%d", subs[nsub].fd);
+    nsub++;
+  }
+
+  if (!failed) {
+    ret = lsh_execute(argv);
+    status = lsh_last_status;
+  } else {
+    status = 1;
+  }
+
+  // Closing our ends lets >(cmd) see EOF and stops <(cmd) that was not read.
+  for (i = 0; i < nsub; i++) {
+    close(subs[i].fd);
+  }
+  for (i = 0; i < nsub; i++) {
+    waitpid(subs[i].pid, NULL, 0);
+  }
+  for (i = 0; i < n && argv[i] != NULL; i++) {
+    if (argv[i] != args[i]) {
+      lsh_free(argv[i]);
+    }
+  }
+  lsh_free(argv);
+  lsh_free(subs);
+  lsh_last_status = status;
+  return ret;
+}
+
+/*
+  Shell state.
+
+  The state that a subshell must not leak is the working directory and the
+  environment.  The environment is a reference-counted vector shared between
+  a state and its clones and copied only when one of them writes to it, so
+  entering a subshell costs one open() for the cwd and a reference count.
+ */
+struct lsh_env {
+  int refs;
+  int n, cap;
+  char **vars;                // NULL terminated, installed as environ
+};
+
+struct lsh_state {
+  int cwd_fd;                 // -1 for the live top-level state
+  struct lsh_env *env;
+};
+
+extern char **environ;
+static struct lsh_state lsh_state = { -1, NULL };
+
+static struct lsh_env *env_alloc(int cap)
+{
+  struct lsh_env *env = lsh_malloc(MEM_ENV, sizeof(struct lsh_env));
+
+  if (env) {
+    env->vars = lsh_malloc(MEM_ENV, (cap + 1) * sizeof(char *));
+  }
+  if (!env || !env->vars) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  env->refs = 1;
+  env->n = 0;
+  env->cap = cap;
+  env->vars[0] = NULL;
+  return env;
+}
+
+static struct lsh_env *env_copy(char **vars)
+{
+  struct lsh_env *env;
+  int n;
+
+  for (n = 0; vars != NULL && vars[n] != NULL; n++) {
+  }
+  env = env_alloc(n + 16);
+  for (env->n = 0; env->n < n; env->n++) {
+    env->vars[env->n] = lsh_strdup(MEM_ENV, vars[env->n]);
+  }
+  env->vars[env->n] = NULL;
+  return env;
+}
+
+static void env_release(struct lsh_env *env)
+{
+  int i;
+
+  if (env != NULL && --env->refs == 0) {
+    for (i = 0; i < env->n; i++) {
+      lsh_free(env->vars[i]);
+    }
+    lsh_free(env->vars);
+    lsh_free(env);
+  }
+}
+
+/**
+   @brief Take over the process environment.  Called once before the loop.
+ */
+void lsh_state_init(void)
+{
+  lsh_state.env = env_copy(environ);
+  environ = lsh_state.env->vars;
+}
+
+/**
+   @brief Make the current environment private before writing to it.
+ */
+static struct lsh_env *env_writable(void)
+{
+  struct lsh_env *env = lsh_state.env;
+
+  if (env->refs > 1) {
+    env->refs--;
+    env = env_copy(env->vars);
+    lsh_state.env = env;
+    environ = env->vars;
+  }
+  return env;
+}
+
+/**
+   @brief Set, replace (NAME=VALUE) or remove (NAME) a variable.
+ */
+static void env_put(const char *assign)
+{
+  struct lsh_env *env = env_writable();
+  size_t len = strcspn(assign, "=");
+  int i;
+
+  for (i = 0; i < env->n; i++) {
+    if (strncmp(env->vars[i], assign, len) == 0 && env->vars[i][len] == '=') {
+      break;
+    }
+  }
+  if (i < env->n) {
+    lsh_free(env->vars[i]);
+    if (assign[len] == '\0') {
+      env->vars[i] = env->vars[--env->n];
+      env->vars[env->n] = NULL;
+      return;
+    }
+  } else if (assign[len] == '\0') {
+    return;
+  } else if (env->n == env->cap) {
+    env->cap *= 2;
+    env->vars = lsh_realloc(MEM_ENV, env->vars, (env->cap + 1) * sizeof(char *));
+    if (!env->vars) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    environ = env->vars;
+    env->vars[++env->n] = NULL;
+  } else {
+    env->vars[++env->n] = NULL;
+  }
+  env->vars[i] = lsh_strdup(MEM_ENV, assign);
+}
+
+/**
+   @brief Snapshot the state for an in-process subshell.
+   @return 0 on success, -1 if the cwd could not be saved.
+ */
+static int lsh_state_save(struct lsh_state *saved)
+{
+  saved->cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (saved->cwd_fd < 0) {
+    return -1;
+  }
+  saved->env = lsh_state.env;
+  saved->env->refs++;
+  return 0;
+}
+
+/**
+   @brief Return to a snapshot, dropping whatever the subshell changed.
+ */
+static void lsh_state_restore(struct lsh_state *saved)
+{
+  if (fchdir(saved->cwd_fd) != 0) {
+    perror("lsh");
+  }
+  close(saved->cwd_fd);
+  env_release(lsh_state.env);
+  lsh_state.env = saved->env;
+  environ = lsh_state.env->vars;
+}
+
+/**
+   @brief Builtin command: set environment variables.
+   @param args List of args.  args[0] is "export".  args[1..] are NAME=VALUE.
+   Without arguments, print the environment.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_export(char **args)
+{
+  int i;
+
+  if (args[1] == NULL) {
+    for (i = 0; environ[i] != NULL; i++) {
+      printf("%s\n", environ[i]);
+    }
+    return 1;
+  }
+  for (i = 1; args[i] != NULL; i++) {
+    if (strchr(args[i], '=') == NULL || args[i][0] == '=') {
+      fprintf(stderr, "lsh: export: expected NAME=VALUE, got \"%s\"\n", args[i]);
+      lsh_last_status = 1;
+      continue;
+    }
+    env_put(args[i]);
+  }
+  return 1;
+}
+
+/**
+   @brief Builtin command: remove environment variables.
+   @param args List of args.  args[0] is "unset".  args[1..] are names.
+   @return Always returns 1, to continue executing.
+ */
+int lsh_unset(char **args)
+{
+  int i;
+
+  for (i = 1; args[i] != NULL; i++) {
+    if (strchr(args[i], '=') == NULL) {
+      env_put(args[i]);
+    }
+  }
+  return 1;
+}
+
+/*
+  Sequences and subshells.
+
+  A command line is a list of commands separated by ";", where a command is
+  either a simple command or a subshell "( list )".  A subshell made only of
+  builtins runs in this process on a snapshot of the state; anything that has
+  to exec a program gets a real fork.
+ */
+
+/**
+   @brief Find the ")" closing the "(" at args[open].
+   @return Its index, or -1 if unbalanced.
+ */
+static int lsh_match_paren(char **args, int open)
+{
+  int i, depth = 0;
+
+  for (i = open; args[i] != NULL; i++) {
+    if (strcmp(args[i], "(") == 0) {
+      depth++;
+    } else if (strcmp(args[i], ")") == 0 && --depth == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+   @brief Can args[from..to) run without forking?  True when every simple
+   command in it is a builtin and nothing needs a process substitution.
+ */
+static int lsh_builtins_only(char **args, int from, int to)
+{
+  int i, j, first = 1, found;
+
+  for (i = from; i < to; i++) {
+    if (strcmp(args[i], ";") == 0 || strcmp(args[i], "(") == 0 || strcmp(args[i], ")") == 0) {
+      first = 1;
+      continue;
+    }
+    if (lsh_is_procsub(args[i])) {
+      return 0;
+    }
+    if (first) {
+      for (found = 0, j = 0; j < lsh_num_builtins(); j++) {
+        found |= strcmp(args[i], builtin_str[j]) == 0;
+      }
+      if (!found) {
+        return 0;
+      }
+      first = 0;
+    }
+  }
+  return 1;
+}
+
+/**
+   @brief Run a subshell body args[from..to).
+   @return Always 1: exit inside a subshell only leaves the subshell.
+ */
+static int lsh_subshell(char **args, int from, int to)
+{
+  struct lsh_state saved;
+  char *end = args[to];
+  pid_t pid;
+  int status;
+
+  args[to] = NULL;
+  if (lsh_builtins_only(args, from, to) && lsh_state_save(&saved) == 0) {
+    lsh_run(args + from);
+    lsh_state_restore(&saved);
+    args[to] = end;
+    return 1;
+  }
+
+  pid = fork();
+  if (pid == 0) {
+    lsh_run(args + from);
+    fflush(stdout);
+    _exit(lsh_last_status);
+  } else if (pid < 0) {
+    perror("lsh");
+  } else {
+    do {
+      waitpid(pid, &status, WUNTRACED);
+    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    lsh_last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  }
+  args[to] = end;
+  return 1;
+}
+
+/**
+   @brief Run a list of commands separated by ";", with subshells.
+   @param args Null terminated list of tokens.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int lsh_run(char **args)
+{
+  int start = 0, i, close, status = 1;
+  char *sep;
+
+  while (status && args[start] != NULL) {
+    if (strcmp(args[start], "(") == 0) {
+      close = lsh_match_paren(args, start);
+      if (close < 0 || (args[close + 1] != NULL && strcmp(args[close + 1], ";") != 0)) {
+        fprintf(stderr, "lsh: syntax error near \"(\"\n");
+        lsh_last_status = 2;
+        return 1;
+      }
+      status = lsh_subshell(args, start + 1, close);
+      start = args[close + 1] != NULL ? close + 2 : close + 1;
+      continue;
+    }
+    for (i = start; args[i] != NULL && strcmp(args[i], ";") != 0; i++) {
+      if (strcmp(args[i], "(") == 0 || strcmp(args[i], ")") == 0) {
+        fprintf(stderr, "lsh: syntax error near \"%s\"\n", args[i]);
+        lsh_last_status = 2;
+        return 1;
+      }
+    }
+    sep = args[i];
+    args[i] = NULL;
+    status = lsh_execute(args + start);
+    args[i] = sep;
+    start = sep != NULL ? i + 1 : i;
+  }
+  return status;
+}
+
+/**
+   @brief Execute shell built-in or launch program.
+   @param args Null terminated list of arguments.
+   @return 1 if the shell should continue running, 0 if it should terminate
+ */
+int lsh_execute(char **args)
+{
+  int i;
+
+  if (args[0] == NULL) {
+    // An empty command was entered.
+    return 1;
+  }
+
+  for (i = 0; args[i] != NULL; i++) {
+    if (lsh_is_procsub(args[i])) {
+      return lsh_execute_procsub(args);
+    }
+  }
+
+  for (i = 0; i < lsh_num_builtins(); i++) {
+    if (strcmp(args[0], builtin_str[i]) == 0) {
+      lsh_last_status = 0;
+      return (*builtin_func[i])(args);
+    }
+  }
+
+  return lsh_launch(args);
+}
+
+/**
+   @brief Read a line of input from stdin.
+   @return The line from stdin.
+ */
+char *lsh_read_line(void)
+{
+#ifdef LSH_USE_STD_GETLINE
+  char *line = NULL, *copy;
+  ssize_t bufsize = 0; // have getline allocate a buffer for us
+  if (getline(&line, &bufsize, stdin) == -1) {
+    if (feof(stdin)) {
+      exit(EXIT_SUCCESS);  // We recieved an EOF
+    } else  {
+      perror("lsh: getline\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  // The caller frees with lsh_free(), so hand back an accounted copy.
+  copy = lsh_strdup(MEM_READER, line);
+  free(line);
+  if (!copy) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  return copy;
+#else
+#define LSH_RL_BUFSIZE 1024
+  int bufsize = LSH_RL_BUFSIZE;
+  int position = 0;
+  char *buffer = lsh_malloc(MEM_READER, sizeof(char) * bufsize);
+  int c;
+
+  if (!buffer) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  while (1) {
+    // Read a character
+    c = getchar();
+
+    if (c == EOF) {
+      exit(EXIT_SUCCESS);
+    } else if (c == '\n') {
+      buffer[position] = '\0';
+      return buffer;
+    } else {
+      buffer[position] = c;
+    }
+    position++;
+
+    // If we have exceeded the buffer, reallocate.
+    if (position >= bufsize) {
+      bufsize += LSH_RL_BUFSIZE;
+      buffer = lsh_realloc(MEM_READER, buffer, bufsize);
+      if (!buffer) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+#endif
+}
+
+#define LSH_TOK_BUFSIZE 64
+#define LSH_TOK_DELIM " \t\r\n\a"
+#define LSH_TOK_OPS "();"
+/**
+   @brief Cut the next token out of a line.  Tokens are separated by
+   whitespace, except that a process substitution <(...) or >(...) is kept
+   whole, nested parentheses included.  "(", ")" and ";" are tokens of their
+   own.
+   @param cursor In: where to start scanning.  Out: where to resume.
+   @param pending Holds an operator that ended the previous word.
+   @return The token, or NULL at the end of the line.
+ */
+static char *lsh_next_token(char **cursor, char *pending)
+{
+  static char *ops[] = { "(", ")", ";" };
+  char *p = *cursor, *start;
+  int depth = 0;
+
+  // An operator that ended the previous word.
+  if (*pending) {
+    p = strchr(LSH_TOK_OPS, *pending);
+    *pending = '\0';
+    return ops[p - LSH_TOK_OPS];
+  }
+  p += strspn(p, LSH_TOK_DELIM);
+  if (*p == '\0') {
+    *cursor = p;
+    return NULL;
+  }
+  if (strchr(LSH_TOK_OPS, *p) != NULL) {
+    *cursor = p + 1;
+    return ops[strchr(LSH_TOK_OPS, *p) - LSH_TOK_OPS];
+  }
+  for (start = p; *p; p++) {
+    if ((*p == '<' || *p == '>') && p[1] == '(') {
+      depth++;
+      p++;
+    } else if (*p == '(' && depth > 0) {
+      depth++;
+    } else if (*p == ')' && depth > 0) {
+      depth--;
+    } else if (depth == 0 && strchr(LSH_TOK_DELIM, *p) != NULL) {
+      break;
+    } else if (depth == 0 && strchr(LSH_TOK_OPS, *p) != NULL) {
+      *pending = *p;
+      break;
+    }
+  }
+  if (*p) {
+    *p++ = '\0';
+  }
+  *cursor = p;
+  return start;
+}
+
+/**
+   @brief Split a line into tokens (very naively).
+   @param line The line.
+   @return Null-terminated array of tokens.
+ */
+char **lsh_split_line(char *line)
+{
+  int bufsize = LSH_TOK_BUFSIZE, position = 0;
+  char **tokens = lsh_malloc(MEM_TOKENIZER, bufsize * sizeof(char*));
+  char *token, **tokens_backup, *cursor = line, pending = '\0';
+
+  if (!tokens) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  token = lsh_next_token(&cursor, &pending);
+  while (token != NULL) {
+    tokens[position] = token;
+    position++;
+
+    if (position >= bufsize) {
+      bufsize += LSH_TOK_BUFSIZE;
+      tokens_backup = tokens;
+      tokens = lsh_realloc(MEM_TOKENIZER, tokens, bufsize * sizeof(char*));
+      if (!tokens) {
+		lsh_free(tokens_backup);
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    token = lsh_next_token(&cursor, &pending);
+  }
+  tokens[position] = NULL;
+  return tokens;
+}
+
+/*
+  Prompt.
+
+  The prompt is an info line rendered from LSH_PROMPT followed by "> " on the
+  next line.  Cheap segments are rendered immediately; the expensive ones (git
+  branch, job count) come from a per-directory cache that a background thread
+  refreshes after every prompt, redrawing the info line in place when they
+  change.
+ */
+#define LSH_PROMPT_CACHE 64
+// Nobody types a full terminal row this fast, so within this window after the
+// prompt the cursor is still on the input row.  Later redraws are skipped.
+#define LSH_PROMPT_REDRAW_MS 500
+
+struct lsh_prompt_entry {
+  char dir[PATH_MAX];
+  char branch[128];
+  unsigned long used;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int started;
+  unsigned long gen;          // bumped for every prompt and when it is consumed
+  unsigned long request;      // generation the worker should refresh for
+  int jobs;                   // -1 until first computed
+  char dir[PATH_MAX];         // cwd of the current prompt
+  char shown[BUF_SIZE];       // info line currently on screen
+  struct timespec shown_at;   // when the current prompt was printed
+  struct lsh_prompt_entry cache[LSH_PROMPT_CACHE];
+  unsigned long clock;
+} prompt = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, -1 };
+
+/**
+   @brief Find the git branch for a directory by walking up to .git/HEAD.
+   @param dir Directory to start from.
+   @param out Receives the branch name (short hash if detached), or "".
+   @param size Size of out.
+ */
+static void prompt_git_branch(const char *dir, char *out, size_t size)
+{
+  char path[PATH_MAX], head[PATH_MAX], line[256];
+  char *slash;
+  FILE *fp;
+
+  out[0] = '\0';
+  snprintf(path, sizeof(path), "%s", dir);
+  for (;;) {
+    snprintf(head, sizeof(head), "%.*s/.git/HEAD", (int)(sizeof(head) - 11), path);
+    fp = fopen(head, "r");
+    if (fp == NULL) {
+      // Worktrees and submodules have a .git file pointing at the real dir.
+      snprintf(head, sizeof(head), "%.*s/.git", (int)(sizeof(head) - 6), path);
+      fp = fopen(head, "r");
+      if (fp != NULL) {
+        if (fgets(line, sizeof(line), fp) && strncmp(line, "gitdir: ", 8) == 0) {
+          line[strcspn(line, "\n")] = '\0';
+          fclose(fp);
+          if (line[8] == '/') {
+            snprintf(head, sizeof(head), "%s/HEAD", line + 8);
+          } else {
+            snprintf(head, sizeof(head), "%.*s/%s/HEAD", (int)(sizeof(head) / 2), path, line + 8);
+          }
+          fp = fopen(head, "r");
+        } else {
+          fclose(fp);
+          fp = NULL;
+        }
+      }
+    }
+    if (fp != NULL) {
+      if (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "ref: refs/heads/", 16) == 0) {
+          snprintf(out, size, "%s", line + 16);
+        } else {
+          snprintf(out, size, "%.7s", line);
+        }
+      }
+      fclose(fp);
+      return;
+    }
+    slash = strrchr(path, '/');
+    if (slash == NULL || slash == path) {
+      return;
+    }
+    *slash = '\0';
+  }
+}
+
+/**
+   @brief Count our live child processes by scanning /proc.
+ */
+static int prompt_count_jobs(void)
+{
+  char path[64], buf[512], *p;
+  struct dirent *ent;
+  int ppid, count = 0;
+  pid_t self = getpid();
+  DIR *dp;
+  FILE *fp;
+
+  dp = opendir("/proc");
+  if (!dp) {
+    return 0;
+  }
+  while ((ent = readdir(dp)) != NULL) {
+    if (get_pid(ent->d_name) <= 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/proc/%s/stat", ent->d_name);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+      continue;
+    }
+    if (fgets(buf, sizeof(buf), fp) && (p = strrchr(buf, ')')) != NULL
+        && sscanf(p + 2, "%*c %d", &ppid) == 1 && ppid == self) {
+      count++;
+    }
+    fclose(fp);
+  }
+  closedir(dp);
+  return count;
+}
+
+/**
+   @brief Look up (or claim) the cache entry for a directory.  Caller holds
+   prompt.lock.
+ */
+static struct lsh_prompt_entry *prompt_cache(const char *dir, int create)
+{
+  struct lsh_prompt_entry *victim = &prompt.cache[0];
+  int i;
+
+  for (i = 0; i < LSH_PROMPT_CACHE; i++) {
+    if (strcmp(prompt.cache[i].dir, dir) == 0) {
+      prompt.cache[i].used = ++prompt.clock;
+      return &prompt.cache[i];
+    }
+    if (prompt.cache[i].used < victim->used) {
+      victim = &prompt.cache[i];
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  snprintf(victim->dir, sizeof(victim->dir), "%s", dir);
+  victim->branch[0] = '\0';
+  victim->used = ++prompt.clock;
+  return victim;
+}
+
+/**
+   @brief Render the info line.  Caller holds prompt.lock.
+   @param out Output buffer.
+   @param size Size of out.
+ */
+static void prompt_render(char *out, size_t size)
+{
+  const char *fmt = getenv("LSH_PROMPT");
+  struct lsh_prompt_entry *ent;
+  size_t n = 0;
+
+  if (fmt == NULL) {
+    fmt = LSH_PROMPT_DEFAULT;
+  }
+  out[0] = '\0';
+  for (; *fmt && n + 1 < size; fmt++) {
+    if (*fmt != '%' || fmt[1] == '\0') {
+      out[n++] = *fmt;
+      out[n] = '\0';
+      continue;
+    }
+    switch (*++fmt) {
+    case 'w':
+      snprintf(out + n, size - n, "%s", prompt.dir);
+      break;
+    case 'u':
+      snprintf(out + n, size - n, "%s", lsh_user);
+      break;
+    case '?':
+      snprintf(out + n, size - n, "%d", lsh_last_status);
+      break;
+    case 'b':
+      // Placeholder until the worker has looked at this directory.
+      ent = prompt_cache(prompt.dir, 0);
+      if (ent == NULL) {
+        snprintf(out + n, size - n, " (...)");
+      } else if (ent->branch[0] != '\0') {
+        snprintf(out + n, size - n, " (%s)", ent->branch);
+      }
+      break;
+    case 'j':
+      if (prompt.jobs < 0) {
+        snprintf(out + n, size - n, "?");
+      } else {
+        snprintf(out + n, size - n, "%d", prompt.jobs);
+      }
+      break;
+    default:
+      out[n++] = *fmt;
+      out[n] = '\0';
+      break;
+    }
+    n += strlen(out + n);
+  }
+}
+
+/**
+   @brief Terminal columns a rendered info line takes.  Escape sequences take
+   none; anything from U+1000 up is counted as wide so the estimate errs high.
+ */
+static size_t prompt_width(const char *s)
+{
+  const unsigned char *p = (const unsigned char *)s;
+  size_t cols = 0;
+
+  while (*p) {
+    if (*p == '\033') {
+      for (p++; *p == '[' || (*p >= 0x20 && *p < 0x40); p++) {
+      }
+      if (*p) {
+        p++;
+      }
+    } else if (*p < 0x80) {
+      cols++;
+      p++;
+    } else if (*p < 0xc0) {
+      p++;                    // continuation byte
+    } else {
+      cols += *p >= 0xe1 ? 2 : 1;
+      p++;
+    }
+  }
+  return cols;
+}
+
+/**
+   @brief Whether the cursor is still on the input row right below the info
+   line, so that "up one row" lands on it.  Caller holds prompt.lock.
+ */
+static int prompt_on_input_row(const char *line)
+{
+  struct winsize ws;
+  struct timespec now;
+  int pending;
+  long ms;
+
+  // A finished line waiting in the tty means the cursor has moved on.
+  if (ioctl(STDIN_FILENO, FIONREAD, &pending) == 0 && pending > 0) {
+    return 0;
+  }
+  // A wrapped info line (old or new) sits on more than one row.
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0
+      && (prompt_width(prompt.shown) >= ws.ws_col || prompt_width(line) >= ws.ws_col)) {
+    return 0;
+  }
+  // The tty does not tell how much of a line is typed, so assume input may
+  // have wrapped once the redraw window is over.
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = (now.tv_sec - prompt.shown_at.tv_sec) * 1000 + (now.tv_nsec - prompt.shown_at.tv_nsec) / 1000000;
+  return ms < LSH_PROMPT_REDRAW_MS;
+}
+
+/**
+   @brief Background thread computing the expensive prompt segments.
+ */
+static void *prompt_worker(void *arg)
+{
+  char dir[PATH_MAX], branch[128], line[BUF_SIZE];
+  struct lsh_prompt_entry *ent;
+  unsigned long gen;
+  int jobs;
+
+  pthread_mutex_lock(&prompt.lock);
+  for (;;) {
+    while (prompt.request == 0) {
+      pthread_cond_wait(&prompt.wake, &prompt.lock);
+    }
+    gen = prompt.request;
+    prompt.request = 0;
+    snprintf(dir, sizeof(dir), "%s", prompt.dir);
+    pthread_mutex_unlock(&prompt.lock);
+
+    prompt_git_branch(dir, branch, sizeof(branch));
+    jobs = prompt_count_jobs();
+
+    pthread_mutex_lock(&prompt.lock);
+    ent = prompt_cache(dir, 1);
+    snprintf(ent->branch, sizeof(ent->branch), "%s", branch);
+    prompt.jobs = jobs;
+    if (gen != prompt.gen) {
+      continue;               // the prompt is already gone
+    }
+    prompt_render(line, sizeof(line));
+    if (strcmp(line, prompt.shown) != 0 && prompt_on_input_row(line)) {
+      snprintf(prompt.shown, sizeof(prompt.shown), "%s", line);
+      // Save cursor, go to the info line, rewrite it, restore cursor.
+      printf("\0337\033[1A\r%s\033[K\0338", line);
+      fflush(stdout);
+    }
+  }
+  return NULL;
+}
+
+/**
+   @brief Print the prompt and ask the worker to refresh it.
+ */
+void lsh_prompt(void)
+{
+  sigset_t all, old;
+  pthread_t thread;
+
+  pthread_mutex_lock(&prompt.lock);
+  if (getcwd(prompt.dir, sizeof(prompt.dir)) == NULL) {
+    snprintf(prompt.dir, sizeof(prompt.dir), "?");
+  }
+  prompt_render(prompt.shown, sizeof(prompt.shown));
+  printf("%s\n> ", prompt.shown);
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &prompt.shown_at);
+
+  prompt.request = ++prompt.gen;
+  if (!prompt.started && isatty(STDOUT_FILENO)) {
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&thread, NULL, prompt_worker, NULL) == 0) {
+      pthread_detach(thread);
+      prompt.started = 1;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+  }
+  pthread_cond_signal(&prompt.wake);
+  pthread_mutex_unlock(&prompt.lock);
+}
+
+/**
+   @brief Wait for the command line and mark the prompt as consumed.  The
+   read() that takes the line off the tty and the generation bump happen under
+   prompt.lock, so the worker either still sees the line pending or sees the
+   prompt gone; it never redraws over a line that was just read.
+ */
+void lsh_prompt_wait(void)
+{
+  struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+  int c, buffered = 0;
+
+#ifdef __GLIBC__
+  buffered = stdin->_IO_read_ptr < stdin->_IO_read_end;
+#endif
+  // Wait unlocked so the worker can redraw while the user types.
+  if (prompt.started && !buffered) {
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+      prof_poll();            // woken by SIGUSR2, for instance
+    }
+  }
+  pthread_mutex_lock(&prompt.lock);
+  c = getchar();
+  if (c != EOF) {
+    ungetc(c, stdin);
+  }
+  prompt.gen++;
+  pthread_mutex_unlock(&prompt.lock);
+}
+
+/**
+   @brief Loop getting input and executing it.
+ */
+void lsh_loop(void)
+{
+  char *line;
+  char **args;
+  int status;
+
+  do {
+    prof_poll();
+    lsh_prompt();
+    lsh_prompt_wait();
+    line = lsh_read_line();
+    args = lsh_split_line(line);
+    status = lsh_run(args);
+
+    lsh_free(line);
+    lsh_free(args);
+  } while (status);
+}
+
+int get_pid(char *s)
+{
+	int len, i;
+	
+	len = strlen(s);
+	for(i=0;i<len;i++)
+	{
+	  if((s[i] < '0' || s[i] > '9'))
+		{
+			return -1;
+		}
+	}
+	return atoi(s);
+}
+
+int getch(void)
+{
+	int ch;							 
+	struct termios buf;
+	struct termios save;
+
+	tcgetattr(0, &save);
+	buf = save;
+	buf.c_lflag &= ~(ICANON|ECHO);
+	buf.c_cc[VMIN] = 1;
+	buf.c_cc[VTIME] = 0;
+	tcsetattr(0, TCSAFLUSH, &buf);
+	ch = getchar();	
+	tcsetattr(0, TCSAFLUSH, &save);
+	return ch;
+}
+
+int check_logon(char* ip_addr)
+{
+	DIR *dp;
 	struct dirent *dir;
 	char buf[BUF_SIZE], line[BUF_SIZE], tag[BUF_SIZE], name[BUF_SIZE], log[BUF_SIZE];
 	char program_name[BUF_SIZE] = "lsh";
 	int pid;
 	int logon_count = 0;
 	FILE *fp;
-	time_t now;
-	char *cur_time;
+	time_t now;
+	char *cur_time;
+
+	dp = opendir("/proc");
+	if(!dp)
+	{
+		return -1;
+	}
+	
+	
+	while((dir = readdir(dp)) != NULL)
+	{
+		pid = get_pid(dir->d_name);
+
+		if(pid == -1)
+		{
+			continue;
+		}
+
+		snprintf(buf, 100, "/proc/%d/status", pid);
+		fp = fopen(buf, "r");
+		if(fp == NULL)
+		{
+			continue;
+		}
+
+		fgets(line, BUF_SIZE, fp);
+		fclose(fp);
+		sscanf(line, "%s %s", tag, name);
+		
+		if(strcmp(name, program_name) == 0)
+		{
+			logon_count += 1;
+			if(logon_count == MAX_LOGIN + 1)
+			{
+				printf("이미실행중입니다.\n");
+				time(&now);
+				cur_time = ctime(&now);
+				cur_time[strlen(cur_time)-1]='\0';
+				sprintf(log, "%s FULL LOGIN %s\n", cur_time, ip_addr);
+				store_failed_log(log);
+				return 1;
+			}
+		}
+	}
+	closedir(dp);
+	return 0;
+}
+
+/*
+  화이트리스트 컴파일러
+
+  list 의 각 줄을 정규화한 뒤 IPv4 항목은 구간 합집합으로 모아서 최소 prefix
+  집합으로 다시 쪼갠다. 포함되거나 인접한 항목은 이 과정에서 사라진다.
+  IPv6 와 그 밖의 문자열 항목은 기존처럼 정확히 일치할 때만 허용한다.
+*/
+struct wl_src
+{
+	uint32_t start, end;
+	uint32_t plen;
+	int line;
+	int kind;		// 4 = IPv4 prefix, 0 = exact name
+	char text[WL_NAME_LEN];	// normalised form
+	char raw[WL_NAME_LEN];	// as written in list
+};
+
+static uint32_t wl_mask(uint32_t plen)
+{
+	return plen == 0 ? 0 : 0xFFFFFFFFu << (32 - plen);
+}
+
+static void wl_format(char *buf, size_t size, uint32_t addr, uint32_t plen)
+{
+	struct in_addr a;
+
+	a.s_addr = htonl(addr);
+	inet_ntop(AF_INET, &a, buf, size);
+	if(plen != 32)
+	{
+		snprintf(buf + strlen(buf), size - strlen(buf), "/%u", plen);
+	}
+}
+
+static void *wl_grow(void *ptr, int *cap, size_t elem)
+{
+	*cap = *cap ? *cap * 2 : 64;
+	ptr = realloc(ptr, *cap * elem);
+	if(!ptr)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+/*
+  한 줄을 정규화한다. 주석(#)과 앞뒤 공백을 지우고
+  IPv4/CIDR 은 네트워크 주소로, IPv6 는 표준 표기로, v4-mapped IPv6 는 IPv4 로 바꾼다.
+  returns 4 (IPv4 prefix), 0 (exact name) or -1 (blank / unusable line)
+*/
+static char *wl_trim(char *line)
+{
+	char *p, *end;
+
+	if((p = strchr(line, '#')) != NULL)
+	{
+		*p = '\0';
+	}
+	p = line;
+	while(*p == ' ' || *p == '\t')
+	{
+		p++;
+	}
+	end = p + strlen(p);
+	while(end > p && strchr(" \t\r\n", end[-1]) != NULL)
+	{
+		*--end = '\0';
+	}
+	return p;
+}
+
+static int wl_parse_entry(char *line, uint32_t *addr, uint32_t *plen, char *name)
+{
+	struct in_addr a4;
+	struct in6_addr a6;
+	char *p, *slash, *q;
+	long n;
+
+	p = wl_trim(line);
+	if(*p == '\0' || strlen(p) >= WL_NAME_LEN)
+	{
+		return -1;
+	}
+
+	*plen = 32;
+	if((slash = strchr(p, '/')) != NULL)
+	{
+		n = strtol(slash + 1, &q, 10);
+		*slash = '\0';
+		if(*q == '\0' && q != slash + 1 && n >= 0 && n <= 32 && inet_pton(AF_INET, p, &a4) == 1)
+		{
+			*plen = n;
+			*addr = ntohl(a4.s_addr) & wl_mask(n);
+			return 4;
+		}
+		*slash = '/';
+	}
+	else if(inet_pton(AF_INET, p, &a4) == 1)
+	{
+		*addr = ntohl(a4.s_addr);
+		return 4;
+	}
+	else if(inet_pton(AF_INET6, p, &a6) == 1)
+	{
+		if(IN6_IS_ADDR_V4MAPPED(&a6))
+		{
+			memcpy(&a4.s_addr, &a6.s6_addr[12], 4);
+			*addr = ntohl(a4.s_addr);
+			return 4;
+		}
+		inet_ntop(AF_INET6, &a6, name, WL_NAME_LEN);
+		return 0;
+	}
+	strcpy(name, p);
+	return 0;
+}
+
+static int wl_src_cmp(const void *a, const void *b)
+{
+	const struct wl_src *x = a, *y = b;
+
+	if(x->start != y->start)
+	{
+		return x->start < y->start ? -1 : 1;
+	}
+	if(x->end != y->end)
+	{
+		return x->end > y->end ? -1 : 1;
+	}
+	return x->line - y->line;
+}
+
+static int wl_name_cmp(const void *a, const void *b)
+{
+	return strcmp(a, b);
+}
+
+static int wl_rule_find(const struct whitelist *wl, uint32_t addr)
+{
+	int lo = 0, hi = wl->nrules - 1, mid;
+
+	// last rule whose network address is <= addr
+	while(lo <= hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if(wl->rules[mid].addr <= addr)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+	if(hi >= 0 && (addr & wl_mask(wl->rules[hi].plen)) == wl->rules[hi].addr)
+	{
+		return hi;
+	}
+	return -1;
+}
+
+/*
+  [start, end] 구간을 정렬된 최대 크기 prefix 들로 나눈다.
+*/
+static void wl_add_range(struct whitelist *wl, int *cap, uint32_t start, uint32_t end)
+{
+	uint32_t plen, last;
+
+	for(;;)
+	{
+		plen = 32;
+		while(plen > 0 && (start & ~wl_mask(plen - 1)) == 0 && (start | ~wl_mask(plen - 1)) <= end)
+		{
+			plen--;
+		}
+		if(wl->nrules == *cap)
+		{
+			wl->rules = wl_grow(wl->rules, cap, sizeof(struct wl_rule));
+		}
+		wl->rules[wl->nrules].addr = start;
+		wl->rules[wl->nrules].plen = plen;
+		wl->nrules++;
+
+		last = start | ~wl_mask(plen);
+		if(last >= end)
+		{
+			break;
+		}
+		start = last + 1;
+	}
+}
+
+/*
+  컴파일 결과가 원본과 같은 주소 집합을 허용하는지 확인한다.
+  원본 구간 합집합과 규칙들을 다시 이어붙인 구간이 정확히 같아야 한다.
+*/
+static int wl_verify(const struct whitelist *wl, const struct wl_src *sorted, int n)
+{
+	uint64_t ustart, uend, rstart, rend;
+	int i = 0, r = 0;
+
+	for(r = 0; r < wl->nrules; r++)
+	{
+		if((wl->rules[r].addr & ~wl_mask(wl->rules[r].plen)) != 0)
+		{
+			return -1;
+		}
+	}
+
+	r = 0;
+	while(i < n && sorted[i].kind != 4)
+	{
+		i++;
+	}
+	while(i < n)
+	{
+		ustart = sorted[i].start;
+		uend = sorted[i].end;
+		for(i++; i < n; i++)
+		{
+			if(sorted[i].kind != 4)
+			{
+				continue;
+			}
+			if(sorted[i].start > uend + 1)
+			{
+				break;
+			}
+			if(sorted[i].end > uend)
+			{
+				uend = sorted[i].end;
+			}
+		}
+
+		if(r >= wl->nrules || wl->rules[r].addr != ustart)
+		{
+			return -1;
+		}
+		rstart = wl->rules[r].addr;
+		rend = rstart | ~wl_mask(wl->rules[r].plen);
+		for(r++; r < wl->nrules && wl->rules[r].addr == rend + 1; r++)
+		{
+			rend = wl->rules[r].addr | ~wl_mask(wl->rules[r].plen);
+		}
+		if(rstart != ustart || rend != uend)
+		{
+			return -1;
+		}
+	}
+	return r == wl->nrules ? 0 : -1;
+}
+
+static void wl_report(const struct whitelist *wl, const struct wl_src *src, int n, FILE *report)
+{
+	int *owner, i, r, removed = 0;
+	char buf[WL_NAME_LEN];
+
+	owner = calloc(wl->nrules + 1, sizeof(int));
+	if(!owner)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// 규칙과 똑같은 항목 중 가장 먼저 나온 줄이 그 규칙을 차지한다
+	for(i = 0; i < n; i++)
+	{
+		if(src[i].kind != 4)
+		{
+			continue;
+		}
+		r = wl_rule_find(wl, src[i].start);
+		if(wl->rules[r].addr == src[i].start && wl->rules[r].plen == src[i].plen && owner[r] == 0)
+		{
+			owner[r] = src[i].line;
+		}
+	}
+
+	for(i = 0; i < n; i++)
+	{
+		if(strcmp(src[i].raw, src[i].text) != 0)
+		{
+			fprintf(report, "line %d: %s normalised to %s\n", src[i].line, src[i].raw, src[i].text);
+		}
+		if(src[i].kind != 4)
+		{
+			for(r = 0; r < i; r++)
+			{
+				if(src[r].kind == 0 && strcmp(src[r].text, src[i].text) == 0)
+				{
+					fprintf(report, "line %d: %s removed, duplicate of line %d\n", src[i].line, src[i].raw, src[r].line);
+					removed++;
+					break;
+				}
+			}
+			continue;
+		}
+		r = wl_rule_find(wl, src[i].start);
+		if(owner[r] == src[i].line)
+		{
+			continue;
+		}
+		removed++;
+		wl_format(buf, sizeof(buf), wl->rules[r].addr, wl->rules[r].plen);
+		if(wl->rules[r].addr == src[i].start && wl->rules[r].plen == src[i].plen)
+		{
+			fprintf(report, "line %d: %s removed, duplicate of line %d\n", src[i].line, src[i].raw, owner[r]);
+		}
+		else if(owner[r] != 0)
+		{
+			fprintf(report, "line %d: %s removed, contained in line %d (%s)\n", src[i].line, src[i].raw, owner[r], buf);
+		}
+		else
+		{
+			fprintf(report, "line %d: %s merged into %s\n", src[i].line, src[i].raw, buf);
+		}
+	}
+	fprintf(report, "%d entries, %d rules, %d names, %d removed\n", n, wl->nrules, wl->nnames, removed);
+	free(owner);
+}
+
+static int wl_rule_line_cmp(const void *a, const void *b)
+{
+	const uint32_t *x = a, *y = b;
+
+	// rule, 긴 prefix 먼저, 줄 순서
+	if(x[0] != y[0])
+	{
+		return x[0] < y[0] ? -1 : 1;
+	}
+	if(x[1] != y[1])
+	{
+		return x[1] > y[1] ? -1 : 1;
+	}
+	return x[2] < y[2] ? -1 : x[2] > y[2];
+}
+
+/*
+  합쳐진 규칙에서 list 의 원래 줄로 돌아가는 표를 만든다. hit 는 줄 단위로 세야
+  다른 줄과 합쳐지거나 이웃한 죽은 줄도 --list-unused 에 나온다.
+  정렬된 prefix 는 최소 prefix 로 나눌 때 쪼개지지 않으므로 IPv4 줄 하나는 규칙 하나에 들어간다.
+*/
+static void wl_map_lines(struct whitelist *wl, const struct wl_src *src, int n)
+{
+	uint32_t (*key)[3];
+	int i, k, nv4 = 0;
+
+	wl->lines = malloc((n ? n : 1) * sizeof(struct wl_line));
+	wl->rule_first = calloc(wl->nrules + 1, sizeof(uint32_t));
+	key = malloc((n ? n : 1) * sizeof(*key));
+	if(!wl->lines || !wl->rule_first || !key)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < n; i++)
+	{
+		wl->lines[i].start = src[i].start;
+		wl->lines[i].end = src[i].end;
+		wl->lines[i].plen = src[i].plen;
+		wl->lines[i].line = src[i].line;
+		wl->lines[i].kind = src[i].kind;
+		memcpy(wl->lines[i].text, src[i].text, WL_NAME_LEN);
+		if(src[i].kind == 4)
+		{
+			key[nv4][0] = wl_rule_find(wl, src[i].start);
+			key[nv4][1] = src[i].plen;
+			key[nv4][2] = i;
+			nv4++;
+		}
+	}
+	wl->nlines = n;
+	qsort(key, nv4, sizeof(*key), wl_rule_line_cmp);
+	wl->rule_lines = malloc((nv4 ? nv4 : 1) * sizeof(uint32_t));
+	if(!wl->rule_lines)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < nv4; i++)
+	{
+		wl->rule_lines[i] = key[i][2];
+		wl->rule_first[key[i][0] + 1]++;
+	}
+	for(k = 0; k < wl->nrules; k++)
+	{
+		wl->rule_first[k + 1] += wl->rule_first[k];
+	}
+	free(key);
+}
+
+/*
+  list 파일을 읽어 최소 규칙 집합으로 컴파일한다.
+  report 가 NULL 이 아니면 지워지거나 합쳐진 항목을 적는다.
+  returns 0 on success, -1 if the compiled set failed verification
+*/
+int wl_compile(FILE *fp, struct whitelist *wl, FILE *report)
+{
+	char line[BUF_SIZE];
+	struct wl_src *src = NULL, *sorted;
+	int n = 0, cap = 0, rcap = 0, ncap = 0, lineno = 0, i, kind;
+	uint32_t addr, plen, start, end;
+
+	memset(wl, 0, sizeof(*wl));
+
+	while(fgets(line, BUF_SIZE, fp))
+	{
+		lineno++;
+		if(n == cap)
+		{
+			src = wl_grow(src, &cap, sizeof(struct wl_src));
+		}
+		memset(&src[n], 0, sizeof(struct wl_src));
+		snprintf(src[n].raw, WL_NAME_LEN, "%s", wl_trim(line));
+
+		kind = wl_parse_entry(line, &addr, &plen, src[n].text);
+		if(kind < 0)
+		{
+			continue;
+		}
+
+		src[n].kind = kind;
+		src[n].line = lineno;
+		if(kind == 4)
+		{
+			src[n].start = addr;
+			src[n].end = addr | ~wl_mask(plen);
+			src[n].plen = plen;
+			wl_format(src[n].text, WL_NAME_LEN, addr, plen);
+		}
+		else
+		{
+			if(wl->nnames == ncap)
+			{
+				wl->names = wl_grow(wl->names, &ncap, WL_NAME_LEN);
+			}
+			strcpy(wl->names[wl->nnames++], src[n].text);
+		}
+		n++;
+	}
+
+	// 이름 항목: 정렬 후 중복 제거
+	if(wl->nnames > 0)
+	{
+		qsort(wl->names, wl->nnames, WL_NAME_LEN, wl_name_cmp);
+		for(i = 1, kind = 1; i < wl->nnames; i++)
+		{
+			if(strcmp(wl->names[i], wl->names[kind - 1]) != 0)
+			{
+				memmove(wl->names[kind++], wl->names[i], WL_NAME_LEN);
+			}
+		}
+		wl->nnames = kind;
+	}
+
+	// IPv4 항목: 구간 합집합 -> 최소 prefix
+	sorted = malloc((n ? n : 1) * sizeof(struct wl_src));
+	if(!sorted)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(sorted, src, n * sizeof(struct wl_src));
+	qsort(sorted, n, sizeof(struct wl_src), wl_src_cmp);
+
+	i = 0;
+	while(i < n && sorted[i].kind != 4)
+	{
+		i++;
+	}
+	while(i < n)
+	{
+		start = sorted[i].start;
+		end = sorted[i].end;
+		for(i++; i < n; i++)
+		{
+			if(sorted[i].kind != 4)
+			{
+				continue;
+			}
+			if(end != 0xFFFFFFFFu && sorted[i].start > end + 1)
+			{
+				break;
+			}
+			if(sorted[i].end > end)
+			{
+				end = sorted[i].end;
+			}
+		}
+		wl_add_range(wl, &rcap, start, end);
+	}
+
+	if(wl_verify(wl, sorted, n) != 0)
+	{
+		if(report)
+		{
+			fprintf(report, "whitelist compile failed verification\n");
+		}
+		free(sorted);
+		free(src);
+		wl_free(wl);
+		return -1;
+	}
+
+	if(report)
+	{
+		wl_report(wl, src, n, report);
+	}
+	wl_map_lines(wl, src, n);
+	free(sorted);
+	free(src);
+	return 0;
+}
+
+/*
+  returns rule index, nrules + name index, or -1 when ip_addr is not allowed
+*/
+int wl_match(const struct whitelist *wl, const char *ip_addr)
+{
+	char buf[WL_NAME_LEN], name[WL_NAME_LEN];
+	uint32_t addr, plen;
+	char (*found)[WL_NAME_LEN];
+
+	snprintf(buf, sizeof(buf), "%s", ip_addr);
+	switch(wl_parse_entry(buf, &addr, &plen, name))
+	{
+	case 4:
+		return plen == 32 ? wl_rule_find(wl, addr) : -1;
+	case 0:
+		found = bsearch(name, wl->names, wl->nnames, WL_NAME_LEN, wl_name_cmp);
+		return found ? wl->nrules + (int)(found - wl->names) : -1;
+	}
+	return -1;
+}
+
+void wl_write(const struct whitelist *wl, FILE *out)
+{
+	char buf[WL_NAME_LEN];
+	int i;
+
+	for(i = 0; i < wl->nrules; i++)
+	{
+		wl_format(buf, sizeof(buf), wl->rules[i].addr, wl->rules[i].plen);
+		fprintf(out, "%s\n", buf);
+	}
+	for(i = 0; i < wl->nnames; i++)
+	{
+		fprintf(out, "%s\n", wl->names[i]);
+	}
+}
+
+void wl_free(struct whitelist *wl)
+{
+	free(wl->rules);
+	free(wl->names);
+	free(wl->lines);
+	free(wl->rule_lines);
+	free(wl->rule_first);
+	memset(wl, 0, sizeof(*wl));
+}
+
+int lsh_state_path(char *buf, size_t size, const char *name)
+{
+	return snprintf(buf, size, "%s/%s", lsh_state_dir, name);
+}
+
+/*
+  로그인한 계정 전용 상태 파일 경로 "<name>.<user>". 계정 이름의 영숫자와 ._- 외의
+  바이트는 %XX 로 바꿔서 경로를 벗어나지 못하게 한다. returns snprintf 와 같은 길이
+*/
+int lsh_user_state_path(char *buf, size_t size, const char *name)
+{
+	char user[BUF_SIZE * 3];
+	const unsigned char *p;
+	size_t n = 0;
+
+	for(p = (const unsigned char *)lsh_user; *p && n + 4 < sizeof(user); p++)
+	{
+		if((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')
+			|| *p == '.' || *p == '_' || *p == '-')
+		{
+			user[n++] = *p;
+		}
+		else
+		{
+			n += snprintf(user + n, sizeof(user) - n, "%%%02X", *p);
+		}
+	}
+	user[n] = '\0';
+	return snprintf(buf, size, "%s/%s.%s", lsh_state_dir, name, user);
+}
+
+/*
+  상태 파일을 size 만큼 늘리고 MAP_SHARED 로 매핑한다. 실패하면 NULL.
+  새로 만든 파일은 0 으로 채워져 있다.
+*/
+void *lsh_map_shared(const char *name, size_t size)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	void *map;
+	int fd;
+
+	lsh_state_path(path, sizeof(path), name);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd < 0)
+	{
+		return NULL;
+	}
+	if(fstat(fd, &st) != 0 || (st.st_size < (off_t)size && ftruncate(fd, size) != 0))
+	{
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+/*
+  간단한 스레드 풀: fn(0..n-1, arg) 를 CPU 수만큼의 스레드가 나눠서 실행한다.
+  각 스레드는 다음 번호를 원자적으로 가져가므로 작업 크기가 들쭉날쭉해도 고르게 돌아간다.
+*/
+struct lsh_pool
+{
+	void (*fn)(int i, void *arg);
+	void *arg;
+	int n;
+	int next;
+};
+
+static void *lsh_pool_worker(void *p)
+{
+	struct lsh_pool *pool = p;
+	int i;
+
+	prof_thread_init();
+	while((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->n)
+	{
+		pool->fn(i, pool->arg);
+	}
+	return NULL;
+}
+
+int lsh_nproc(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (int)n : 1;
+}
+
+void lsh_parallel(int n, void (*fn)(int i, void *arg), void *arg)
+{
+	struct lsh_pool pool = { fn, arg, n, 0 };
+	pthread_t *threads;
+	int nthreads, i, started = 0;
+
+	nthreads = lsh_nproc();
+	if(nthreads > n)
+	{
+		nthreads = n;
+	}
+	threads = malloc(sizeof(pthread_t) * (nthreads > 0 ? nthreads : 1));
+	if(!threads)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	// 호출한 스레드도 일꾼으로 쓴다
+	for(i = 1; i < nthreads; i++)
+	{
+		if(pthread_create(&threads[started], NULL, lsh_pool_worker, &pool) == 0)
+		{
+			started++;
+		}
+	}
+	lsh_pool_worker(&pool);
+	for(i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	prof_poll();
+}
+
+/*
+  64 바이트 블록에서 특정 바이트가 있는 위치를 비트마스크로 돌려준다 (비트 i = p[i]).
+  줄 색인 (view) 처럼 큰 파일을 훑는 곳에서 쓴다. AVX2 가 있으면 32 바이트씩, 없으면 SSE2 로
+  16 바이트씩 비교하고, x86 이 아니면 바이트 단위로 센다. 고르는 건 처음 한 번만 한다.
+*/
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static uint64_t simd_eq64_avx2(const char *p, unsigned char c)
+{
+	__m256i v = _mm256_set1_epi8((char)c);
+	uint32_t lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), v));
+	uint32_t hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), v));
+
+	return (uint64_t)hi << 32 | lo;
+}
+
+static uint64_t simd_eq64_sse2(const char *p, unsigned char c)
+{
+	__m128i v = _mm_set1_epi8((char)c);
+	uint64_t m = 0;
+	int i;
+
+	for(i = 0; i < 4; i++)
+	{
+		m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i * 16)), v)) << (i * 16);
+	}
+	return m;
+}
+#else
+static uint64_t simd_eq64_scalar(const char *p, unsigned char c)
+{
+	return lsh_simd_eq_tail(p, 64, c);
+}
+#endif
+
+static uint64_t (*simd_eq64_impl)(const char *, unsigned char);
+
+uint64_t lsh_simd_eq64(const char *p, unsigned char c)
+{
+	if(simd_eq64_impl == NULL)
+	{
+#if defined(__x86_64__)
+		simd_eq64_impl = __builtin_cpu_supports("avx2") ? simd_eq64_avx2 : simd_eq64_sse2;
+#else
+		simd_eq64_impl = simd_eq64_scalar;
+#endif
+	}
+	return simd_eq64_impl(p, c);
+}
+
+/*
+  끝에 남은 64 바이트 미만 블록: 읽을 수 있는 만큼만 본다
+*/
+uint64_t lsh_simd_eq_tail(const char *p, size_t n, unsigned char c)
+{
+	uint64_t m = 0;
+	size_t i;
+
+	for(i = 0; i < n && i < 64; i++)
+	{
+		m |= (uint64_t)((unsigned char)p[i] == c) << i;
+	}
+	return m;
+}
+
+/*
+  JSON 한 블록 (64 바이트) 의 구조 문자 비트마스크: quote ("), backslash (\), structural ({ } [ ] : ,)
+  [ 와 ] 는 0x20 을 OR 하면 { 와 } 가 되므로 비교 네 번으로 여섯 문자를 찾는다.
+*/
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static void simd_json64_avx2(const char *p, uint64_t *quote, uint64_t *backslash, uint64_t *structural)
+{
+	__m256i v[2], lower;
+	uint64_t m[3] = { 0, 0, 0 };
+	int i;
+
+	v[0] = _mm256_loadu_si256((const __m256i *)p);
+	v[1] = _mm256_loadu_si256((const __m256i *)(p + 32));
+	for(i = 0; i < 2; i++)
+	{
+		lower = _mm256_or_si256(v[i], _mm256_set1_epi8(0x20));
+		m[0] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v[i], _mm256_set1_epi8('"'))) << (i * 32);
+		m[1] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v[i], _mm256_set1_epi8('\\'))) << (i * 32);
+		m[2] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v[i], _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(v[i], _mm256_set1_epi8(','))))) << (i * 32);
+	}
+	*quote = m[0];
+	*backslash = m[1];
+	*structural = m[2];
+}
+
+static void simd_json64_sse2(const char *p, uint64_t *quote, uint64_t *backslash, uint64_t *structural)
+{
+	__m128i v, lower;
+	uint64_t m[3] = { 0, 0, 0 };
+	int i;
+
+	for(i = 0; i < 4; i++)
+	{
+		v = _mm_loadu_si128((const __m128i *)(p + i * 16));
+		lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+		m[0] |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << (i * 16);
+		m[1] |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << (i * 16);
+		m[2] |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')), _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), _mm_cmpeq_epi8(v, _mm_set1_epi8(','))))) << (i * 16);
+	}
+	*quote = m[0];
+	*backslash = m[1];
+	*structural = m[2];
+}
+#else
+static void simd_json64_scalar(const char *p, uint64_t *quote, uint64_t *backslash, uint64_t *structural)
+{
+	unsigned char c;
+	int i;
+
+	*quote = *backslash = *structural = 0;
+	for(i = 0; i < 64; i++)
+	{
+		c = p[i];
+		*quote |= (uint64_t)(c == '"') << i;
+		*backslash |= (uint64_t)(c == '\\') << i;
+		*structural |= (uint64_t)((c | 0x20) == '{' || (c | 0x20) == '}' || c == ':' || c == ',') << i;
+	}
+}
+#endif
+
+static void (*simd_json64_impl)(const char *, uint64_t *, uint64_t *, uint64_t *);
+
+void lsh_simd_json64(const char *p, uint64_t *quote, uint64_t *backslash, uint64_t *structural)
+{
+	if(simd_json64_impl == NULL)
+	{
+#if defined(__x86_64__)
+		simd_json64_impl = __builtin_cpu_supports("avx2") ? simd_json64_avx2 : simd_json64_sse2;
+#else
+		simd_json64_impl = simd_json64_scalar;
+#endif
+	}
+	simd_json64_impl(p, quote, backslash, structural);
+}
+
+#define WL_HITS_MAGIC 0x6c736877	// "lshw"
+#define WL_HIT_DEAD UINT64_MAX	// 지운 슬롯 (탐색은 계속, 새 키가 다시 쓸 수 있음)
+
+static uint64_t wl_hash(const char *text)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while(*text)
+	{
+		h = (h ^ (unsigned char)*text++) * 1099511628211ULL;
+	}
+	return h && h != WL_HIT_DEAD ? h : 1;
+}
+
+struct wl_hits *wl_hits_open(void)
+{
+	struct wl_hits *hits;
+	uint32_t zero = 0;
+	int64_t created;
+
+	hits = lsh_map_shared("wl_hits", sizeof(struct wl_hits));
+	if(hits == NULL)
+	{
+		return NULL;
+	}
+	if(__atomic_compare_exchange_n(&hits->magic, &zero, WL_HITS_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		hits->version = 1;
+	}
+	else if(zero != WL_HITS_MAGIC)
+	{
+		munmap(hits, sizeof(struct wl_hits));
+		return NULL;
+	}
+	// 만든 쪽이 created 를 쓰기 전에 다른 세션이 읽을 수 있으므로 연 쪽 모두가 채운다
+	created = 0;
+	__atomic_compare_exchange_n(&hits->created, &created, (int64_t)time(NULL), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	return hits;
+}
+
+/*
+  줄 텍스트에 해당하는 슬롯을 찾는다. create 가 0 이 아니면 지운 슬롯이나 빈 슬롯을 차지한다.
+  returns slot index or -1
+*/
+static int wl_hit_slot(struct wl_hits *hits, const char *text, int create)
+{
+	uint64_t key = wl_hash(text), cur;
+	int i, n, dead;
+
+	for(;;)
+	{
+		dead = -1;
+		for(n = 0, i = key % WL_HIT_SLOTS; n < WL_HIT_SLOTS; n++, i = (i + 1) % WL_HIT_SLOTS)
+		{
+			cur = __atomic_load_n(&hits->slot[i].key, __ATOMIC_ACQUIRE);
+			if(cur == key)
+			{
+				return i;
+			}
+			if(cur == 0)
+			{
+				break;
+			}
+			if(cur == WL_HIT_DEAD && dead < 0)
+			{
+				dead = i;
+			}
+		}
+		if(!create || (n == WL_HIT_SLOTS && dead < 0))
+		{
+			return -1;
+		}
+		if(dead >= 0)
+		{
+			i = dead;
+			cur = WL_HIT_DEAD;
+		}
+		if(__atomic_compare_exchange_n(&hits->slot[i].key, &cur, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			snprintf(hits->slot[i].text, WL_NAME_LEN, "%s", text);
+			return i;
+		}
+		// 다른 세션이 먼저 차지했다: 처음부터 다시 찾는다
+	}
+}
+
+/*
+  지금 list 에 없는 줄의 슬롯을 비운다 (캐시를 다시 만들 때, 즉 list 가 바뀌었을 때).
+  카운터를 먼저 0 으로 만들고 나서 지운 표시를 하므로 다시 차지한 키는 0 부터 센다.
+*/
+void wl_hits_prune(struct wl_hits *hits, const struct whitelist *wl)
+{
+	uint64_t key;
+	int i, j, live;
+
+	for(i = 0; i < WL_HIT_SLOTS; i++)
+	{
+		key = __atomic_load_n(&hits->slot[i].key, __ATOMIC_ACQUIRE);
+		if(key == 0 || key == WL_HIT_DEAD || hits->slot[i].text[0] == '\0')
+		{
+			continue;
+		}
+		for(j = 0, live = 0; j < wl->nlines && !live; j++)
+		{
+			live = strcmp(wl->lines[j].text, hits->slot[i].text) == 0;
+		}
+		if(live)
+		{
+			continue;
+		}
+		for(j = 0; j < WL_HIT_SHARDS; j++)
+		{
+			__atomic_store_n(&hits->shard[j][i].count, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&hits->shard[j][i].last_hit, 0, __ATOMIC_RELAXED);
+		}
+		hits->slot[i].text[0] = '\0';
+		__atomic_compare_exchange_n(&hits->slot[i].key, &key, WL_HIT_DEAD, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	}
+}
+
+static void wl_entry_text(const struct whitelist *wl, int matched, char *buf, size_t size)
+{
+	if(matched < wl->nrules)
+	{
+		wl_format(buf, size, wl->rules[matched].addr, wl->rules[matched].plen);
+	}
+	else
+	{
+		snprintf(buf, size, "%s", wl->names[matched - wl->nrules]);
+	}
+}
+
+/*
+  ip_addr 를 허용한 list 의 줄: 매칭된 규칙에 들어간 줄 중 ip_addr 를 포함하는 가장 긴 prefix
+*/
+static const char *wl_hit_text(const struct whitelist *wl, int matched, const char *ip_addr)
+{
+	char buf[WL_NAME_LEN], name[WL_NAME_LEN];
+	const struct wl_line *line;
+	uint32_t addr, plen, i;
+
+	if(matched >= wl->nrules)
+	{
+		return wl->names[matched - wl->nrules];
+	}
+	snprintf(buf, sizeof(buf), "%s", ip_addr);
+	if(wl_parse_entry(buf, &addr, &plen, name) != 4)
+	{
+		return NULL;
+	}
+	for(i = wl->rule_first[matched]; i < wl->rule_first[matched + 1]; i++)
+	{
+		line = &wl->lines[wl->rule_lines[i]];
+		if(line->start <= addr && addr <= line->end)
+		{
+			return line->text;
+		}
+	}
+	return NULL;
+}
+
+/*
+  ip_addr 를 허용한 줄의 카운터를 현재 CPU 의 shard 에서 올린다. 잠금 없음.
+*/
+void wl_hit(struct wl_hits *hits, const struct whitelist *wl, int matched, const char *ip_addr)
+{
+	const char *text;
+	struct wl_hit_count *c;
+	int slot, cpu;
+
+	if(hits == NULL || matched < 0 || (text = wl_hit_text(wl, matched, ip_addr)) == NULL)
+	{
+		return;
+	}
+	slot = wl_hit_slot(hits, text, 1);
+	if(slot < 0)
+	{
+		return;
+	}
+	cpu = sched_getcpu();
+	c = &hits->shard[(cpu < 0 ? getpid() : cpu) % WL_HIT_SHARDS][slot];
+	__atomic_fetch_add(&c->count, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->last_hit, (int64_t)time(NULL), __ATOMIC_RELAXED);
+}
+
+/*
+  비동기 이벤트 큐 (bounded MPMC, 슬롯마다 sequence 번호)
+*/
+static struct
+{
+	struct lsh_event slot[EV_RING];
+	unsigned seq[EV_RING];
+	unsigned head;		// producers reserve here
+	unsigned tail;		// writer thread consumes here
+	unsigned dropped;
+	int stopping;
+	pid_t owner;
+	sem_t ready;
+	pthread_t thread;
+} ev_ring;
+
+static pthread_once_t ev_once = PTHREAD_ONCE_INIT;
+static int ev_running;
+
+static void *lsh_event_thread(void *arg)
+{
+	char path[PATH_MAX];
+	struct lsh_event *ev;
+	unsigned pos, dropped, reported = 0;
+	FILE *out;
+
+	lsh_state_path(path, sizeof(path), "event_log");
+	out = fopen(path, "ae");
+
+	for(;;)
+	{
+		sem_wait(&ev_ring.ready);
+		pos = ev_ring.tail;
+		while(__atomic_load_n(&ev_ring.seq[pos % EV_RING], __ATOMIC_ACQUIRE) == pos + 1)
+		{
+			ev = &ev_ring.slot[pos % EV_RING];
+			if(out != NULL)
+			{
+				if(ev->fn)
+				{
+					ev->fn(ev, out);
+				}
+				else
+				{
+					fputs(ev->data, out);
+				}
+			}
+			__atomic_store_n(&ev_ring.seq[pos % EV_RING], pos + EV_RING, __ATOMIC_RELEASE);
+			ev_ring.tail = ++pos;
+		}
+		dropped = __atomic_load_n(&ev_ring.dropped, __ATOMIC_RELAXED);
+		if(out != NULL && dropped != reported)
+		{
+			lsh_event_write(out, "\"event\":\"dropped\",\"count\":%u", dropped - reported);
+			reported = dropped;
+		}
+		if(out != NULL)
+		{
+			fflush(out);
+		}
+		if(__atomic_load_n(&ev_ring.stopping, __ATOMIC_ACQUIRE) && ev_ring.tail == __atomic_load_n(&ev_ring.head, __ATOMIC_ACQUIRE))
+		{
+			break;
+		}
+	}
+	if(out != NULL)
+	{
+		fclose(out);
+	}
+	return NULL;
+}
+
+/*
+  남은 이벤트를 EV_EXIT_WAIT_MS 까지만 기다린다. fork 된 자식에서는 아무것도 하지 않는다.
+*/
+void lsh_event_stop(void)
+{
+	struct timespec deadline;
+
+	if(!ev_running || ev_ring.owner != getpid())
+	{
+		return;
+	}
+	__atomic_store_n(&ev_ring.stopping, 1, __ATOMIC_RELEASE);
+	sem_post(&ev_ring.ready);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += EV_EXIT_WAIT_MS * 1000000L;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+	deadline.tv_nsec %= 1000000000L;
+	if(pthread_timedjoin_np(ev_ring.thread, NULL, &deadline) == 0)
+	{
+		ev_running = 0;
+	}
+}
+
+static void lsh_event_start(void)
+{
+	sigset_t all, old;
+	unsigned i;
+
+	for(i = 0; i < EV_RING; i++)
+	{
+		ev_ring.seq[i] = i;
+	}
+	sem_init(&ev_ring.ready, 0, 0);
+	ev_ring.owner = getpid();
+
+	// 시그널은 메인 스레드에서만 받는다
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if(pthread_create(&ev_ring.thread, NULL, lsh_event_thread, NULL) == 0)
+	{
+		ev_running = 1;
+		atexit(lsh_event_stop);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void lsh_event_vpost(void (*fn)(struct lsh_event *, FILE *), int json, const char *fmt, va_list ap)
+{
+	struct lsh_event *ev;
+	unsigned pos, seq;
+	struct timespec ts;
+	int len = 0;
+
+	pthread_once(&ev_once, lsh_event_start);
+	if(!ev_running)
+	{
+		return;
+	}
+
+	pos = __atomic_load_n(&ev_ring.head, __ATOMIC_RELAXED);
+	for(;;)
+	{
+		seq = __atomic_load_n(&ev_ring.seq[pos % EV_RING], __ATOMIC_ACQUIRE);
+		if(seq == pos)
+		{
+			if(__atomic_compare_exchange_n(&ev_ring.head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if((int)(seq - pos) < 0)
+		{
+			// 큐가 가득 참
+			__atomic_fetch_add(&ev_ring.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+		{
+			pos = __atomic_load_n(&ev_ring.head, __ATOMIC_RELAXED);
+		}
+	}
+
+	ev = &ev_ring.slot[pos % EV_RING];
+	ev->fn = fn;
+	if(json)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		len = snprintf(ev->data, EV_LEN, "{\"time\":%lld.%03ld,\"pid\":%d,",
+			(long long)ts.tv_sec, ts.tv_nsec / 1000000, (int)getpid());
+	}
+	len += vsnprintf(ev->data + len, EV_LEN - len, fmt, ap);
+	if(json)
+	{
+		if(len > EV_LEN - 3)
+		{
+			len = EV_LEN - 3;
+		}
+		strcpy(ev->data + len, "}\n");
+	}
+	__atomic_store_n(&ev_ring.seq[pos % EV_RING], pos + 1, __ATOMIC_RELEASE);
+	sem_post(&ev_ring.ready);
+}
+
+/*
+  JSON 객체 한 줄을 기록한다. fmt 은 바깥 중괄호 없이 필드만 적는다.
+  time, pid 필드는 자동으로 붙는다.
+*/
+void lsh_event(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	lsh_event_vpost(NULL, 1, fmt, ap);
+	va_end(ap);
+}
+
+/*
+  fn 을 이벤트 스레드에서 실행한다. data 에는 fmt 로 만든 문자열이 들어간다.
+*/
+void lsh_event_call(void (*fn)(struct lsh_event *, FILE *), const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	lsh_event_vpost(fn, 0, fmt, ap);
+	va_end(ap);
+}
+
+/*
+  이벤트 스레드 안에서 바로 JSON 한 줄을 기록할 때 쓴다.
+*/
+void lsh_event_write(FILE *out, const char *fmt, ...)
+{
+	struct timespec ts;
+	va_list ap;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	fprintf(out, "{\"time\":%lld.%03ld,\"pid\":%d,", (long long)ts.tv_sec, ts.tv_nsec / 1000000, (int)getpid());
+	va_start(ap, fmt);
+	vfprintf(out, fmt, ap);
+	va_end(ap);
+	fputs("}\n", out);
+}
+
+void lsh_json_str(char *out, size_t size, const char *in)
+{
+	size_t n = 0;
+
+	for(; *in && n + 7 < size; in++)
+	{
+		if(*in == '"' || *in == '\\')
+		{
+			out[n++] = '\\';
+			out[n++] = *in;
+		}
+		else if((unsigned char)*in < 0x20)
+		{
+			n += snprintf(out + n, size - n, "\\u%04x", *in);
+		}
+		else
+		{
+			out[n++] = *in;
+		}
+	}
+	out[n] = '\0';
+}
+
+/*
+  샘플링 프로파일러
+  SIGUSR2 를 받으면 켜고, 다시 받으면 끄면서 profile.<pid>.folded 에 folded stack 으로 쓴다.
+  (flamegraph.pl profile.<pid>.folded > lsh.svg)
+  켜져 있는 동안 ITIMER_PROF 가 CPU 시간 1/PROF_HZ 초마다 SIGPROF 를 보내고, 핸들러는 frame pointer 를
+  따라 올라간 주소들만 잠금 없이 샘플 버퍼에 넣는다. 심볼 변환과 파일 쓰기는 별도 스레드에서 한다.
+  시작할 때는 시그널 핸들러만 걸어 두고, 쓰기 스레드와 세마포어는 처음 켜진 뒤 메인 스레드가
+  prof_poll() 을 부르는 지점 (명령 사이, 프롬프트 대기, lsh_parallel 끝) 에서 만든다. 시그널 핸들러
+  안에서는 스레드를 만들 수 없기 때문이다. 그 전에 끝나면 종료할 때 바로 쓴다.
+  꺼져 있을 때는 타이머도 스레드도 없으니 비용이 없다. (-fno-omit-frame-pointer 로 빌드해야 스택이 온전히 나온다)
+*/
+struct prof_sample
+{
+	uint32_t depth;
+	uintptr_t pc[PROF_DEPTH];	// pc[0] 이 샘플 위치, 그 뒤는 호출한 쪽
+};
+
+static struct
+{
+	volatile sig_atomic_t on;
+	volatile sig_atomic_t busy;	// 쓰기 스레드가 이전 결과를 쓰는 중
+	int started;		// 쓰기 스레드와 ready 를 만들었는지
+	unsigned head;		// 다음에 받을 샘플 번호
+	unsigned done;		// 다 쓴 샘플 수
+	unsigned dropped;
+	sem_t ready;
+	struct prof_sample sample[PROF_SAMPLES];	// bss 라서 켜기 전에는 메모리를 차지하지 않는다
+} prof;
+
+static __thread uintptr_t prof_stack_hi;	// 이 스레드 스택의 끝, 0 이면 pc 만 기록
+
+struct prof_sym
+{
+	uintptr_t addr;
+	uintptr_t size;
+	const char *name;
+};
+
+/*
+  시그널 핸들러가 스택을 읽어도 되는 범위를 기록한다. 샘플링될 수 있는 스레드마다 한 번 부른다.
+*/
+void prof_thread_init(void)
+{
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+
+	if(prof_stack_hi == 0 && pthread_getattr_np(pthread_self(), &attr) == 0)
+	{
+		if(pthread_attr_getstack(&attr, &addr, &size) == 0)
+		{
+			prof_stack_hi = (uintptr_t)addr + size;
+		}
+		pthread_attr_destroy(&attr);
+	}
+}
+
+static void prof_on_sigprof(int sig, siginfo_t *si, void *ctx)
+{
+	ucontext_t *uc = ctx;
+	struct prof_sample *s;
+	uintptr_t pc = 0, fp = 0, sp = 0, hi = prof_stack_hi, *frame;
+	unsigned i, n;
+
+	if(!prof.on)
+	{
+		return;
+	}
+#if defined(__x86_64__)
+	pc = uc->uc_mcontext.gregs[REG_RIP];
+	fp = uc->uc_mcontext.gregs[REG_RBP];
+	sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+	pc = uc->uc_mcontext.pc;
+	fp = uc->uc_mcontext.regs[29];
+	sp = uc->uc_mcontext.sp;
+#else
+	(void)uc;
+	hi = 0;
+#endif
+	i = __atomic_fetch_add(&prof.head, 1, __ATOMIC_RELAXED);
+	if(i >= PROF_SAMPLES)
+	{
+		__atomic_add_fetch(&prof.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	s = &prof.sample[i];
+	s->pc[0] = pc;
+	n = 1;
+	// 프레임은 항상 sp 와 스택 끝 사이에 있고 위로만 올라가야 한다. 벗어나면 거기서 멈춘다.
+	while(n < PROF_DEPTH && fp >= sp && fp % sizeof(uintptr_t) == 0 && fp + 2 * sizeof(uintptr_t) <= hi)
+	{
+		frame = (uintptr_t *)fp;
+		if(frame[1] == 0)
+		{
+			break;
+		}
+		s->pc[n++] = frame[1];
+		sp = fp + 2 * sizeof(uintptr_t);
+		fp = frame[0];
+	}
+	s->depth = n;
+	__atomic_add_fetch(&prof.done, 1, __ATOMIC_RELEASE);
+}
+
+static void prof_on_sigusr2(int sig)
+{
+	struct itimerval it;
+	int saved = errno;
+
+	memset(&it, 0, sizeof(it));
+	if(!prof.on && !prof.busy)
+	{
+		prof.head = prof.done = prof.dropped = 0;
+		it.it_interval.tv_usec = 1000000 / PROF_HZ;
+		it.it_value = it.it_interval;
+		prof.on = 1;
+		setitimer(ITIMER_PROF, &it, NULL);
+	}
+	else if(prof.on)
+	{
+		setitimer(ITIMER_PROF, &it, NULL);
+		prof.on = 0;
+		prof.busy = 1;
+		if(__atomic_load_n(&prof.started, __ATOMIC_ACQUIRE))
+		{
+			sem_post(&prof.ready);
+		}
+	}
+	errno = saved;
+}
+
+static int prof_sym_cmp(const void *a, const void *b)
+{
+	const struct prof_sym *x = a, *y = b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static int prof_exe_base(struct dl_phdr_info *info, size_t size, void *arg)
+{
+	*(uintptr_t *)arg = info->dlpi_addr;
+	return 1;		// 첫 항목이 실행 파일
+}
+
+/*
+  실행 파일의 .symtab 에서 함수 심볼을 읽는다. static 함수까지 나오므로 dladdr 보다 낫다.
+  returns the number of symbols in *out (sorted by address)
+*/
+static int prof_load_syms(struct prof_sym **out)
+{
+	const Elf64_Ehdr *eh;
+	const Elf64_Shdr *sh;
+	const Elf64_Sym *sym;
+	struct prof_sym *syms = NULL;
+	const char *strtab;
+	uintptr_t base = 0;
+	struct stat st;
+	void *map;
+	int fd, i, j, n = 0, nsyms, cap = 0;
+
+	fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+	if(fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Elf64_Ehdr))
+	{
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		return 0;
+	}
+	eh = map;
+	if(memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64
+		|| eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) > (uint64_t)st.st_size)
+	{
+		munmap(map, st.st_size);
+		return 0;
+	}
+	dl_iterate_phdr(prof_exe_base, &base);
+	sh = (const Elf64_Shdr *)((const char *)map + eh->e_shoff);
+	for(i = 0; i < eh->e_shnum; i++)
+	{
+		if(sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum
+			|| sh[i].sh_offset + sh[i].sh_size > (uint64_t)st.st_size)
+		{
+			continue;
+		}
+		sym = (const Elf64_Sym *)((const char *)map + sh[i].sh_offset);
+		strtab = (const char *)map + sh[sh[i].sh_link].sh_offset;
+		nsyms = sh[i].sh_size / sizeof(Elf64_Sym);
+		for(j = 0; j < nsyms; j++)
+		{
+			if(ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC || sym[j].st_value == 0)
+			{
+				continue;
+			}
+			if(n == cap)
+			{
+				syms = wl_grow(syms, &cap, sizeof(struct prof_sym));
+			}
+			syms[n].addr = base + sym[j].st_value;
+			syms[n].size = sym[j].st_size;
+			syms[n].name = strtab + sym[j].st_name;	// map 은 계속 둔다
+			n++;
+		}
+	}
+	if(n == 0)
+	{
+		munmap(map, st.st_size);
+	}
+	qsort(syms, n, sizeof(struct prof_sym), prof_sym_cmp);
+	*out = syms;
+	return n;
+}
+
+static const char *prof_name(uintptr_t pc, const struct prof_sym *syms, int nsyms)
+{
+	int lo = 0, hi = nsyms - 1, mid;
+	const char *slash;
+	Dl_info info;
+
+	while(lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		if(syms[mid].addr <= pc)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+	if(hi >= 0 && pc < syms[hi].addr + (syms[hi].size ? syms[hi].size : 1))
+	{
+		return syms[hi].name;
+	}
+	if(dladdr((void *)pc, &info) != 0)
+	{
+		if(info.dli_sname != NULL)
+		{
+			return info.dli_sname;
+		}
+		if(info.dli_fname != NULL)
+		{
+			slash = strrchr(info.dli_fname, '/');
+			return slash ? slash + 1 : info.dli_fname;
+		}
+	}
+	return "[unknown]";
+}
+
+static int prof_line_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+  샘플마다 "바깥;...;안쪽" 줄을 만들고, 같은 줄끼리 묶어서 "줄 개수" 로 쓴다.
+*/
+static void prof_write(void)
+{
+	static struct prof_sym *syms;
+	static int nsyms = -1;
+	char name[64], path[PATH_MAX], path_json[PATH_MAX * 2], line[PROF_DEPTH * 64], **lines;
+	const struct prof_sample *s;
+	unsigned n, i, count, stacks = 0;
+	size_t len;
+	int d, wait;
+	FILE *out;
+
+	n = __atomic_load_n(&prof.head, __ATOMIC_RELAXED);
+	if(n > PROF_SAMPLES)
+	{
+		n = PROF_SAMPLES;
+	}
+	// 다른 스레드에서 아직 끝나지 않은 핸들러를 잠깐 기다린다
+	for(wait = 0; __atomic_load_n(&prof.done, __ATOMIC_ACQUIRE) < n && wait < 100; wait++)
+	{
+		usleep(1000);
+	}
+	if(nsyms < 0)
+	{
+		nsyms = prof_load_syms(&syms);
+	}
+	lines = malloc((n ? n : 1) * sizeof(char *));
+	if(!lines)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < n; i++)
+	{
+		s = &prof.sample[i];
+		for(len = 0, d = s->depth - 1; d >= 0 && len < sizeof(line); d--)
+		{
+			// 돌아갈 주소는 호출 다음 명령이라 1 을 빼야 호출한 함수 안을 가리킨다
+			len += snprintf(line + len, sizeof(line) - len, "%s%s",
+				prof_name(d ? s->pc[d] - 1 : s->pc[d], syms, nsyms), d ? ";" : "");
+		}
+		lines[i] = strdup(line);
+		if(!lines[i])
+		{
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	qsort(lines, n, sizeof(char *), prof_line_cmp);
+
+	snprintf(name, sizeof(name), "profile.%d.folded", (int)getpid());
+	lsh_state_path(path, sizeof(path), name);
+	out = fopen(path, "we");
+	for(i = 0; i < n; i += count)
+	{
+		for(count = 1; i + count < n && strcmp(lines[i], lines[i + count]) == 0; count++)
+		{
+		}
+		if(out != NULL)
+		{
+			fprintf(out, "%s %u\n", lines[i], count);
+		}
+		stacks++;
+	}
+	for(i = 0; i < n; i++)
+	{
+		free(lines[i]);
+	}
+	free(lines);
+	if(out == NULL)
+	{
+		return;
+	}
+	fclose(out);
+	lsh_json_str(path_json, sizeof(path_json), path);
+	lsh_event("\"event\":\"profile\",\"file\":\"%s\",\"samples\":%u,\"stacks\":%u,\"dropped\":%u",
+		path_json, n, stacks, prof.dropped);
+}
+
+static void *prof_thread(void *arg)
+{
+	for(;;)
+	{
+		if(sem_wait(&prof.ready) != 0 || !prof.busy)
+		{
+			continue;	// prof_poll 과 핸들러가 같은 결과로 두 번 깨운 경우
+		}
+		prof_write();
+		prof.busy = 0;
+	}
+	return NULL;
+}
+
+/*
+  메인 스레드의 안전한 지점에서 부른다. 프로파일러가 처음 켜졌으면 쓰기 스레드를 만들고,
+  그 사이에 이미 꺼졌으면 바로 깨운다.
+*/
+void prof_poll(void)
+{
+	sigset_t all, old;
+	pthread_t thread;
+
+	if(prof.started || (!prof.on && !prof.busy))
+	{
+		return;
+	}
+	sem_init(&prof.ready, 0, 0);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if(pthread_create(&thread, NULL, prof_thread, NULL) == 0)
+	{
+		pthread_detach(thread);
+		__atomic_store_n(&prof.started, 1, __ATOMIC_RELEASE);
+		if(prof.busy)
+		{
+			sem_post(&prof.ready);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+  쓰기 스레드가 생기기 전에 끝나는 프로세스 (짧은 관리자 명령 등) 는 여기서 직접 쓴다.
+*/
+static void prof_exit(void)
+{
+	struct itimerval it;
+
+	if(prof.started)
+	{
+		return;
+	}
+	if(prof.on)
+	{
+		memset(&it, 0, sizeof(it));
+		setitimer(ITIMER_PROF, &it, NULL);
+		prof.on = 0;
+		prof.busy = 1;
+	}
+	if(prof.busy)
+	{
+		prof_write();
+		prof.busy = 0;
+	}
+}
+
+/*
+  SIGUSR2 로 켜고 끌 수 있게 시그널 핸들러만 건다. 쓰기 스레드는 prof_poll 이 만든다.
+*/
+void prof_init(void)
+{
+	struct sigaction sa;
+
+	prof_thread_init();
+	atexit(prof_exit);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = prof_on_sigprof;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, NULL);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = prof_on_sigusr2;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaddset(&sa.sa_mask, SIGPROF);
+	sigaction(SIGUSR2, &sa, NULL);
+}
+
+/*
+  세션 공유 캐시 (lsh_cache)
+
+  컴파일된 화이트리스트(lsh_cache)와 PATH 명령어 해시 테이블(lsh_cmds)을 같은 형식의
+  파일에 담아 두고 모든 세션이 읽기 전용으로 매핑한다. 입력 파일(list, PATH 의 각 디렉터리)의
+  장치/inode/크기/mtime/ctime 이 하나라도 바뀌면 처음 들어온 세션이 다시 만들어 rename 으로 교체한다.
+  (cp -p, rsync -a, touch -r 로 mtime 을 되돌려도 ctime 이나 inode 는 바뀐다)
+  화이트리스트 검사 전에는 lsh_cache 만 열고 (list 하나만 stat), 명령어 테이블은
+  통과한 세션이 처음 명령어를 찾을 때 연다.
+  섀도 평가용 list.candidate 는 lsh_cache.candidate 에 따로 담는다.
+*/
+#define CACHE_MAGIC 0x6c73686b	// "lshk"
+#define CACHE_VERSION 4
+
+struct cache_source
+{
+	char path[CACHE_PATH_LEN];
+	uint64_t dev, ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+};
+
+struct cache_cmd
+{
+	uint32_t name;		// offset into strings, 0 = empty slot
+	uint32_t path;
+};
+
+struct cache_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint64_t path_hash;	// $PATH the command table was built for
+	uint32_t nsources, sources_off;
+	uint32_t nrules, rules_off;
+	uint32_t nnames, names_off;
+	uint32_t nlines, lines_off;
+	uint32_t rule_lines_off, rule_first_off;	// rule_first has nrules + 1 entries
+	uint32_t cmd_slots, cmds_off;	// cmd_slots is a power of two
+	uint32_t ncmds;
+	uint32_t strings_off;
+};
+
+struct lsh_cache
+{
+	void *map;
+	size_t size;
+	const struct cache_header *hdr;
+	struct whitelist wl;	// points into map, never wl_free()d
+};
+
+struct lsh_cache *lsh_cache;
+static struct lsh_cache *lsh_cmds;	// 명령어 테이블, 처음 찾을 때 연다
+
+struct cache_buf
+{
+	char *data;
+	size_t len, cap;
+};
+
+static uint32_t cache_put(struct cache_buf *b, const void *data, size_t len)
+{
+	size_t off = (b->len + 7) & ~(size_t)7;
+
+	while(off + len > b->cap)
+	{
+		b->cap = b->cap ? b->cap * 2 : 65536;
+		b->data = realloc(b->data, b->cap);
+		if(!b->data)
+		{
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memset(b->data + b->len, 0, off - b->len);
+	if(data)
+	{
+		memcpy(b->data + off, data, len);
+	}
+	else
+	{
+		memset(b->data + off, 0, len);
+	}
+	b->len = off + len;
+	return off;
+}
+
+static int cache_source_fill(const char *path, const struct stat *st, struct cache_source *src)
+{
+	if(strlen(path) >= CACHE_PATH_LEN)
+	{
+		return -1;
+	}
+	memset(src, 0, sizeof(*src));
+	strcpy(src->path, path);
+	src->dev = st->st_dev;
+	src->ino = st->st_ino;
+	src->size = st->st_size;
+	src->mtime_sec = st->st_mtim.tv_sec;
+	src->mtime_nsec = st->st_mtim.tv_nsec;
+	src->ctime_sec = st->st_ctim.tv_sec;
+	src->ctime_nsec = st->st_ctim.tv_nsec;
+	return 0;
+}
+
+static int cache_stat(const char *path, struct cache_source *src)
+{
+	struct stat st;
+
+	if(stat(path, &st) != 0)
+	{
+		return -1;
+	}
+	return cache_source_fill(path, &st, src);
+}
+
+/*
+  헤더의 각 구역 (off, count * size) 이 매핑 안에 있는지 확인한다. returns 0 if it fits
+*/
+static int cache_span(size_t size, uint32_t off, uint64_t count, size_t elem)
+{
+	return (off & 7) == 0 && off <= size && count <= (size - off) / elem ? 0 : -1;
+}
+
+static int cache_bounds(const struct cache_header *hdr, size_t size)
+{
+	const struct cache_cmd *cmds;
+	const uint32_t *first;
+	uint32_t i;
+
+	if(cache_span(size, hdr->sources_off, hdr->nsources, sizeof(struct cache_source)) != 0
+		|| cache_span(size, hdr->rules_off, hdr->nrules, sizeof(struct wl_rule)) != 0
+		|| cache_span(size, hdr->names_off, hdr->nnames, WL_NAME_LEN) != 0
+		|| cache_span(size, hdr->lines_off, hdr->nlines, sizeof(struct wl_line)) != 0
+		|| cache_span(size, hdr->rule_first_off, (uint64_t)hdr->nrules + 1, sizeof(uint32_t)) != 0
+		|| hdr->cmd_slots == 0 || (hdr->cmd_slots & (hdr->cmd_slots - 1)) != 0 || hdr->ncmds >= hdr->cmd_slots
+		|| cache_span(size, hdr->cmds_off, hdr->cmd_slots, sizeof(struct cache_cmd)) != 0
+		|| hdr->strings_off >= size || ((const char *)hdr)[size - 1] != '\0')
+	{
+		return -1;
+	}
+	first = (const uint32_t *)((const char *)hdr + hdr->rule_first_off);
+	if(cache_span(size, hdr->rule_lines_off, first[hdr->nrules], sizeof(uint32_t)) != 0)
+	{
+		return -1;
+	}
+	// 문자열은 모두 NUL 로 끝나는 마지막 구역 안을 가리켜야 한다
+	cmds = (const struct cache_cmd *)((const char *)hdr + hdr->cmds_off);
+	for(i = 0; i < hdr->cmd_slots; i++)
+	{
+		if(cmds[i].name >= size - hdr->strings_off || cmds[i].path >= size - hdr->strings_off)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+  캐시를 만든 뒤의 입력 파일 변경 여부를 확인한다. returns 0 if still valid
+*/
+static int cache_check(const struct cache_header *hdr, size_t size, uint64_t path_hash)
+{
+	const struct cache_source *src;
+	struct cache_source now;
+	uint32_t i;
+
+	if(size < sizeof(*hdr) || hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION
+		|| hdr->size != size || hdr->path_hash != path_hash
+		|| cache_span(size, hdr->sources_off, hdr->nsources, sizeof(struct cache_source)) != 0)
+	{
+		return -1;
+	}
+	src = (const struct cache_source *)((const char *)hdr + hdr->sources_off);
+	for(i = 0; i < hdr->nsources; i++)
+	{
+		if(memchr(src[i].path, '\0', CACHE_PATH_LEN) == NULL || cache_stat(src[i].path, &now) != 0
+			|| now.dev != src[i].dev || now.ino != src[i].ino || now.size != src[i].size
+			|| now.mtime_sec != src[i].mtime_sec || now.mtime_nsec != src[i].mtime_nsec
+			|| now.ctime_sec != src[i].ctime_sec || now.ctime_nsec != src[i].ctime_nsec)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+  상태 파일 name 과 PATH 로 새 캐시 파일을 만든다. name 이 NULL 이면 화이트리스트를,
+  pathenv 가 NULL 이면 명령어 테이블을 비워 둔다. returns 0 on success
+*/
+static int cache_build(const char *file, const char *name, const char *pathenv, uint64_t path_hash)
+{
+	struct cache_buf b = { NULL, 0, 0 }, strs = { NULL, 0, 0 };
+	struct cache_header hdr;
+	struct cache_source *srcs = NULL;
+	struct cache_cmd *cmds;
+	struct whitelist wl;
+	struct wl_hits *hits;
+	struct dirent *ent;
+	struct stat st, src_st;
+	char list[PATH_MAX], full[PATH_MAX], tmp[PATH_MAX + 16];
+	char *dirs, *dir, *save;
+	int nsrc = 0, srccap = 0, fd, ok;
+	uint32_t slots = pathenv ? 1024 : 1, ncmds = 0, h;
+	size_t name_len;
+	DIR *dp;
+	FILE *fp;
+
+	memset(&wl, 0, sizeof(wl));
+	if(name != NULL)
+	{
+		// 컴파일하는 바로 그 파일을 읽기 전에 fstat 한다. 그 뒤의 수정은 다음 확인에서 걸린다.
+		lsh_state_path(list, sizeof(list), name);
+		fd = open(list, O_RDONLY | O_CLOEXEC);
+		if(fd < 0)
+		{
+			return -1;
+		}
+		if(fstat(fd, &src_st) != 0 || (fp = fdopen(fd, "r")) == NULL)
+		{
+			close(fd);
+			return -1;
+		}
+		ok = wl_compile(fp, &wl, NULL);
+		fclose(fp);
+		if(ok != 0)
+		{
+			return -1;
+		}
+		// list 가 바뀌었으니 없어진 줄의 hit 카운터를 비운다
+		if(strcmp(name, "list") == 0 && (hits = wl_hits_open()) != NULL)
+		{
+			wl_hits_prune(hits, &wl);
+			munmap(hits, sizeof(struct wl_hits));
+		}
+		srcs = wl_grow(srcs, &srccap, sizeof(struct cache_source));
+		if(cache_source_fill(list, &src_st, &srcs[nsrc++]) != 0)
+		{
+			wl_free(&wl);
+			free(srcs);
+			return -1;
+		}
+	}
+
+	// 명령어 해시 테이블: PATH 앞쪽 디렉터리가 우선 (execvp 와 같은 순서)
+	cmds = calloc(slots, sizeof(struct cache_cmd));
+	if(!cmds)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	cache_put(&strs, "", 1);	// offset 0 은 빈 슬롯 표시
+	dirs = pathenv ? strdup(pathenv) : NULL;
+	for(dir = dirs ? strtok_r(dirs, ":", &save) : NULL; dir != NULL; dir = strtok_r(NULL, ":", &save))
+	{
+		if(nsrc == srccap)
+		{
+			srcs = wl_grow(srcs, &srccap, sizeof(struct cache_source));
+		}
+		if(cache_stat(dir, &srcs[nsrc]) != 0 || (dp = opendir(dir)) == NULL)
+		{
+			continue;
+		}
+		nsrc++;
+		while((ent = readdir(dp)) != NULL)
+		{
+			name_len = strlen(ent->d_name);
+			if(ent->d_name[0] == '.' || snprintf(full, sizeof(full), "%s/%s", dir, ent->d_name) >= (int)sizeof(full)
+				|| stat(full, &st) != 0 || !S_ISREG(st.st_mode) || access(full, X_OK) != 0)
+			{
+				continue;
+			}
+			if(ncmds * 2 >= slots)
+			{
+				// 테이블을 두 배로 키우고 다시 넣는다
+				struct cache_cmd *old = cmds;
+				uint32_t j;
+
+				cmds = calloc(slots * 2, sizeof(struct cache_cmd));
+				if(!cmds)
+				{
+					fprintf(stderr, "lsh: allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+				for(j = 0; j < slots; j++)
+				{
+					if(old[j].name == 0)
+					{
+						continue;
+					}
+					for(h = wl_hash(strs.data + old[j].name) & (slots * 2 - 1); cmds[h].name; h = (h + 1) & (slots * 2 - 1))
+					{
+					}
+					cmds[h] = old[j];
+				}
+				free(old);
+				slots *= 2;
+			}
+			for(h = wl_hash(ent->d_name) & (slots - 1); cmds[h].name; h = (h + 1) & (slots - 1))
+			{
+				if(strcmp(strs.data + cmds[h].name, ent->d_name) == 0)
+				{
+					break;
+				}
+			}
+			if(cmds[h].name)
+			{
+				continue;
+			}
+			cmds[h].name = cache_put(&strs, ent->d_name, name_len + 1);
+			cmds[h].path = cache_put(&strs, full, strlen(full) + 1);
+			ncmds++;
+		}
+		closedir(dp);
+	}
+	free(dirs);
+
+	memset(&hdr, 0, sizeof(hdr));
+	cache_put(&b, &hdr, sizeof(hdr));
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	hdr.path_hash = path_hash;
+	hdr.nsources = nsrc;
+	hdr.sources_off = cache_put(&b, srcs, nsrc * sizeof(struct cache_source));
+	hdr.nrules = wl.nrules;
+	hdr.rules_off = cache_put(&b, wl.rules, wl.nrules * sizeof(struct wl_rule));
+	hdr.nnames = wl.nnames;
+	hdr.names_off = cache_put(&b, wl.names, (size_t)wl.nnames * WL_NAME_LEN);
+	hdr.nlines = wl.nlines;
+	hdr.lines_off = cache_put(&b, wl.lines, (size_t)wl.nlines * sizeof(struct wl_line));
+	hdr.rule_lines_off = cache_put(&b, wl.rule_lines, (wl.rule_first ? wl.rule_first[wl.nrules] : 0) * sizeof(uint32_t));
+	hdr.rule_first_off = cache_put(&b, wl.rule_first, (wl.nrules + 1) * sizeof(uint32_t));
+	hdr.cmd_slots = slots;
+	hdr.ncmds = ncmds;
+	hdr.cmds_off = cache_put(&b, cmds, slots * sizeof(struct cache_cmd));
+	hdr.strings_off = cache_put(&b, strs.data, strs.len);
+	hdr.size = b.len;
+	memcpy(b.data, &hdr, sizeof(hdr));
+	wl_free(&wl);
+	free(srcs);
+	free(cmds);
+	free(strs.data);
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	ok = fd >= 0 && write(fd, b.data, b.len) == (ssize_t)b.len && rename(tmp, file) == 0 ? 0 : -1;
+	if(fd >= 0)
+	{
+		close(fd);
+	}
+	if(ok != 0)
+	{
+		unlink(tmp);
+	}
+	free(b.data);
+	return ok;
+}
+
+static struct lsh_cache *cache_map(const char *file, uint64_t path_hash)
+{
+	struct lsh_cache *cache;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		return NULL;
+	}
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct cache_header))
+	{
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		return NULL;
+	}
+	if(cache_check(map, st.st_size, path_hash) != 0 || cache_bounds(map, st.st_size) != 0)
+	{
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	cache = lsh_malloc(MEM_CACHES, sizeof(struct lsh_cache));
+	if(!cache)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	cache->map = map;
+	cache->size = st.st_size;
+	lsh_mem_mapped(MEM_CACHES, st.st_size);
+	cache->hdr = map;
+	cache->wl.nrules = cache->hdr->nrules;
+	cache->wl.rules = (struct wl_rule *)((char *)map + cache->hdr->rules_off);
+	cache->wl.nnames = cache->hdr->nnames;
+	cache->wl.names = (char (*)[WL_NAME_LEN])((char *)map + cache->hdr->names_off);
+	cache->wl.nlines = cache->hdr->nlines;
+	cache->wl.lines = (struct wl_line *)((char *)map + cache->hdr->lines_off);
+	cache->wl.rule_lines = (uint32_t *)((char *)map + cache->hdr->rule_lines_off);
+	cache->wl.rule_first = (uint32_t *)((char *)map + cache->hdr->rule_first_off);
+	return cache;
+}
+
+static void cache_close(struct lsh_cache *cache)
+{
+	munmap(cache->map, cache->size);
+	lsh_mem_mapped(MEM_CACHES, -(ssize_t)cache->size);
+	lsh_free(cache);
+}
+
+/*
+  상태 디렉터리의 캐시 파일 file_name 을 매핑한다. 없거나 오래됐으면 name 과 pathenv 로
+  새로 만든다. 실패하면 NULL.
+*/
+static struct lsh_cache *cache_open(const char *file_name, const char *name, const char *pathenv)
+{
+	struct lsh_cache *cache;
+	char file[PATH_MAX];
+	uint64_t path_hash = pathenv ? wl_hash(pathenv) : 0;
+
+	lsh_state_path(file, sizeof(file), file_name);
+	cache = cache_map(file, path_hash);
+	if(cache == NULL && cache_build(file, name, pathenv, path_hash) == 0)
+	{
+		cache = cache_map(file, path_hash);
+	}
+	return cache;
+}
+
+/*
+  화이트리스트 공유 캐시를 연다. 없거나 오래됐으면 새로 만든다. 실패하면 NULL (캐시 없이 동작).
+*/
+struct lsh_cache *lsh_cache_open(void)
+{
+	if(lsh_cache == NULL)
+	{
+		lsh_cache = cache_open("lsh_cache", "list", NULL);
+	}
+	return lsh_cache;
+}
+
+/*
+  명령어 테이블 캐시를 지금 PATH 로 연다. PATH 가 바뀌었으면 다시 연다.
+*/
+static struct lsh_cache *cache_cmds_open(void)
+{
+	const char *pathenv = getenv("PATH");
+
+	if(pathenv == NULL)
+	{
+		return NULL;
+	}
+	if(lsh_cmds != NULL && lsh_cmds->hdr->path_hash != wl_hash(pathenv))
+	{
+		cache_close(lsh_cmds);
+		lsh_cmds = NULL;
+	}
+	if(lsh_cmds == NULL)
+	{
+		lsh_cmds = cache_open("lsh_cmds", NULL, pathenv);
+	}
+	return lsh_cmds;
+}
+
+/*
+  오래 살아 있는 프로세스 (zygote 의 warm 프로세스) 용: 매핑해 둔 캐시가 지금의 list/PATH 와
+  맞지 않으면 내리고 다시 연다. 명령어 테이블은 다음에 찾을 때 다시 연다.
+*/
+void lsh_cache_refresh(void)
+{
+	if(lsh_cache != NULL && cache_check(lsh_cache->hdr, lsh_cache->size, 0) != 0)
+	{
+		cache_close(lsh_cache);
+		lsh_cache = NULL;
+	}
+	if(lsh_cmds != NULL && cache_check(lsh_cmds->hdr, lsh_cmds->size, lsh_cmds->hdr->path_hash) != 0)
+	{
+		cache_close(lsh_cmds);
+		lsh_cmds = NULL;
+	}
+	lsh_cache_open();
+}
+
+/*
+  섀도 평가: list.candidate 가 있으면 같은 접속 IP 를 후보 목록으로도 검사해서
+  현재 list 와 결과가 다를 때만 기록한다. 이벤트 스레드에서만 실행된다.
+  컴파일된 후보 목록은 공유 캐시(lsh_cache.candidate)에서 mtime 으로 확인해 쓰므로
+  list.candidate 가 바뀌었을 때 처음 들어온 세션만 컴파일한다.
+  data: "<0|1 active allowed> <ip>"
+*/
+void wl_shadow_eval(struct lsh_event *ev, FILE *out)
+{
+	static struct lsh_cache *cand;
+	char path[PATH_MAX], ip[WL_NAME_LEN], ip_json[WL_NAME_LEN * 2], rule[WL_NAME_LEN], rule_json[WL_NAME_LEN * 2];
+	struct stat st;
+	int active, matched;
+
+	if(cand != NULL && cache_check(cand->hdr, cand->size, 0) != 0)
+	{
+		cache_close(cand);
+		cand = NULL;
+	}
+	lsh_state_path(path, sizeof(path), "list.candidate");
+	if(stat(path, &st) != 0)
+	{
+		return;
+	}
+	if(cand == NULL && (cand = cache_open("lsh_cache.candidate", "list.candidate", NULL)) == NULL)
+	{
+		lsh_event_write(out, "\"event\":\"shadow_invalid\",\"file\":\"list.candidate\"");
+		return;
+	}
+
+	if(sscanf(ev->data, "%d %47s", &active, ip) != 2)
+	{
+		return;
+	}
+	matched = wl_match(&cand->wl, ip);
+	if((matched >= 0) == (active != 0))
+	{
+		return;
+	}
+	lsh_json_str(ip_json, sizeof(ip_json), ip);
+	if(matched >= 0)
+	{
+		wl_entry_text(&cand->wl, matched, rule, sizeof(rule));
+		lsh_json_str(rule_json, sizeof(rule_json), rule);
+		lsh_event_write(out, "\"event\":\"shadow_disagree\",\"ip\":\"%s\",\"active\":\"deny\",\"candidate\":\"allow\",\"rule\":\"%s\"", ip_json, rule_json);
+	}
+	else
+	{
+		lsh_event_write(out, "\"event\":\"shadow_disagree\",\"ip\":\"%s\",\"active\":\"allow\",\"candidate\":\"deny\"", ip_json);
+	}
+}
+
+/*
+  지금 PATH 로 만든 명령어 테이블 캐시를 쓸 수 있는지 (없으면 이때 만든다)
+*/
+int lsh_cache_command_table_matches(void)
+{
+	return cache_cmds_open() != NULL;
+}
+
+/*
+  PATH 에서 name 을 찾은 전체 경로. 캐시가 없거나 PATH 가 바뀌었으면 NULL.
+*/
+const char *lsh_cache_command(const char *name)
+{
+	const struct cache_header *hdr;
+	const struct cache_cmd *cmds;
+	const char *strs;
+	uint32_t h;
+
+	if(!lsh_cache_command_table_matches())
+	{
+		return NULL;
+	}
+	hdr = lsh_cmds->hdr;
+	cmds = (const struct cache_cmd *)((const char *)hdr + hdr->cmds_off);
+	strs = (const char *)hdr + hdr->strings_off;
+	for(h = wl_hash(name) & (hdr->cmd_slots - 1); cmds[h].name; h = (h + 1) & (hdr->cmd_slots - 1))
+	{
+		if(strcmp(strs + cmds[h].name, name) == 0)
+		{
+			return strs + cmds[h].path;
+		}
+	}
+	return NULL;
+}
+
+/*
+  캐시에 든 명령어 이름을 하나씩 fn 에 넘긴다.
+*/
+void lsh_cache_each_command(void (*fn)(const char *name, void *arg), void *arg)
+{
+	const struct cache_header *hdr;
+	const struct cache_cmd *cmds;
+	const char *strs;
+	uint32_t i;
+
+	if(!lsh_cache_command_table_matches())
+	{
+		return;
+	}
+	hdr = lsh_cmds->hdr;
+	cmds = (const struct cache_cmd *)((const char *)hdr + hdr->cmds_off);
+	strs = (const char *)hdr + hdr->strings_off;
+	for(i = 0; i < hdr->cmd_slots; i++)
+	{
+		if(cmds[i].name)
+		{
+			fn(strs + cmds[i].name, arg);
+		}
+	}
+}
+
+/*
+  Command suggestions.
+
+  A BK-tree over every builtin and every executable on PATH answers "which
+  names are within edit distance k of this one" while visiting only a small
+  part of the tree.  It is built the first time a command is not found and
+  kept until PATH changes.
+ */
+struct bk_node {
+  const char *name;
+  int child;                  // first child, -1 if none
+  int sibling;                // next child of the same parent
+  int dist;                   // distance to the parent
+};
+
+static struct {
+  struct bk_node *nodes;
+  int n, cap;
+  uint64_t path_hash;
+  char *names;                // storage for names read from PATH directly
+  size_t names_len, names_cap;
+} bk;
+
+/**
+   @brief Damerau-Levenshtein distance (insertions, deletions, substitutions
+   and transpositions of any two adjacent characters, even ones edited
+   afterwards), giving up once it exceeds limit.  Unlike the restricted
+   variant this is a metric, which the BK-tree pruning relies on.  The
+   minimum of a row never decreases from one row to the next, so giving up on
+   it is exact.
+ */
+static int bk_distance(const char *a, const char *b, int limit)
+{
+  int la = strlen(a), lb = strlen(b), i, j, k, l, db, best, cost, v;
+  int d[LSH_SUGGEST_MAXLEN + 2][LSH_SUGGEST_MAXLEN + 2];
+  int last[256];              // last row of a holding each byte, 0 = none
+  int inf = la + lb;
+
+  if (la > LSH_SUGGEST_MAXLEN || lb > LSH_SUGGEST_MAXLEN) {
+    return limit + 1;
+  }
+  if (la - lb > limit || lb - la > limit) {
+    return limit + 1;
+  }
+  memset(last, 0, sizeof(last));
+  d[0][0] = inf;
+  for (i = 0; i <= la; i++) {
+    d[i + 1][0] = inf;
+    d[i + 1][1] = i;
+  }
+  for (j = 0; j <= lb; j++) {
+    d[0][j + 1] = inf;
+    d[1][j + 1] = j;
+  }
+  for (i = 1; i <= la; i++) {
+    db = 0;
+    best = i;
+    for (j = 1; j <= lb; j++) {
+      k = last[(unsigned char)b[j - 1]];
+      l = db;
+      cost = 1;
+      if (a[i - 1] == b[j - 1]) {
+        cost = 0;
+        db = j;
+      }
+      v = d[i][j] + cost;
+      if (d[i + 1][j] + 1 < v) {
+        v = d[i + 1][j] + 1;
+      }
+      if (d[i][j + 1] + 1 < v) {
+        v = d[i][j + 1] + 1;
+      }
+      if (d[k][l] + (i - k - 1) + 1 + (j - l - 1) < v) {
+        v = d[k][l] + (i - k - 1) + 1 + (j - l - 1);
+      }
+      d[i + 1][j + 1] = v;
+      if (v < best) {
+        best = v;
+      }
+    }
+    if (best > limit) {
+      return limit + 1;
+    }
+    last[(unsigned char)a[i - 1]] = i;
+  }
+  return d[la + 1][lb + 1];
+}
+
+static void bk_insert(const char *name, void *arg)
+{
+  int at = 0, d, c;
+
+  if (strlen(name) > LSH_SUGGEST_MAXLEN) {
+    return;
+  }
+  if (bk.n == bk.cap) {
+    bk.cap = bk.cap ? bk.cap * 2 : 1024;
+    bk.nodes = lsh_realloc(MEM_CACHES, bk.nodes, bk.cap * sizeof(struct bk_node));
+    if (!bk.nodes) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  bk.nodes[bk.n].name = name;
+  bk.nodes[bk.n].child = -1;
+  bk.nodes[bk.n].sibling = -1;
+  if (bk.n == 0) {
+    bk.n++;
+    return;
+  }
+  for (;;) {
+    d = bk_distance(name, bk.nodes[at].name, LSH_SUGGEST_MAXLEN);
+    if (d == 0) {
+      return;                 // already present (earlier PATH entry)
+    }
+    for (c = bk.nodes[at].child; c >= 0 && bk.nodes[c].dist != d; c = bk.nodes[c].sibling) {
+    }
+    if (c < 0) {
+      bk.nodes[bk.n].dist = d;
+      bk.nodes[bk.n].sibling = bk.nodes[at].child;
+      bk.nodes[at].child = bk.n++;
+      return;
+    }
+    at = c;
+  }
+}
+
+/**
+   @brief Collect executable names straight from PATH when the shared cache
+   does not match the current PATH.
+ */
+static void bk_scan_path(const char *pathenv)
+{
+  char *dirs = lsh_strdup(MEM_CACHES, pathenv), *dir, *save, *name;
+  struct dirent *ent;
+  size_t len, off;
+  DIR *dp;
+
+  bk.names_len = 0;
+  for (dir = strtok_r(dirs, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save)) {
+    if ((dp = opendir(dir)) == NULL) {
+      continue;
+    }
+    while ((ent = readdir(dp)) != NULL) {
+      if (ent->d_name[0] == '.') {
+        continue;
+      }
+      len = strlen(ent->d_name) + 1;
+      while (bk.names_len + len > bk.names_cap) {
+        bk.names_cap = bk.names_cap ? bk.names_cap * 2 : 65536;
+        bk.names = lsh_realloc(MEM_CACHES, bk.names, bk.names_cap);
+        if (!bk.names) {
+          fprintf(stderr, "lsh: allocation error\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      memcpy(bk.names + bk.names_len, ent->d_name, len);
+      bk.names_len += len;
+    }
+    closedir(dp);
+  }
+  lsh_free(dirs);
+  // Insert only once the buffer has stopped moving.
+  for (off = 0; off < bk.names_len; off += strlen(name) + 1) {
+    name = bk.names + off;
+    bk_insert(name, NULL);
+  }
+}
+
+static void bk_build(void)
+{
+  const char *pathenv = getenv("PATH");
+  uint64_t hash = wl_hash(pathenv ? pathenv : "");
+  int i;
+
+  if (bk.n > 0 && bk.path_hash == hash) {
+    return;
+  }
+  bk.n = 0;
+  bk.path_hash = hash;
+  for (i = 0; i < lsh_num_builtins(); i++) {
+    bk_insert(builtin_str[i], NULL);
+  }
+  if (lsh_cache_command_table_matches()) {
+    lsh_cache_each_command(bk_insert, NULL);
+  } else if (pathenv != NULL) {
+    bk_scan_path(pathenv);
+  }
+}
+
+static void bk_query(int at, const char *name, int limit, const char **out, int *dist, int *n)
+{
+  int d, c, i, j;
+
+  d = bk_distance(name, bk.nodes[at].name, LSH_SUGGEST_MAXLEN);
+  if (d <= limit) {
+    // Keep the LSH_SUGGEST_MAX closest, in order.
+    for (i = 0; i < *n && dist[i] <= d; i++) {
+    }
+    if (i < LSH_SUGGEST_MAX) {
+      for (j = (*n < LSH_SUGGEST_MAX ? *n : LSH_SUGGEST_MAX - 1); j > i; j--) {
+        out[j] = out[j - 1];
+        dist[j] = dist[j - 1];
+      }
+      out[i] = bk.nodes[at].name;
+      dist[i] = d;
+      if (*n < LSH_SUGGEST_MAX) {
+        (*n)++;
+      }
+    }
+  }
+  for (c = bk.nodes[at].child; c >= 0; c = bk.nodes[c].sibling) {
+    if (bk.nodes[c].dist >= d - limit && bk.nodes[c].dist <= d + limit) {
+      bk_query(c, name, limit, out, dist, n);
+    }
+  }
+}
+
+/**
+   @brief Print "did you mean" suggestions for an unknown command.
+   @param name The command that was not found.
+ */
+void lsh_suggest(const char *name)
+{
+  const char *out[LSH_SUGGEST_MAX];
+  int dist[LSH_SUGGEST_MAX], n = 0, i, limit;
+
+  if (strlen(name) > LSH_SUGGEST_MAXLEN) {
+    return;
+  }
+  bk_build();
+  if (bk.n == 0) {
+    return;
+  }
+  limit = strlen(name) <= 4 ? 1 : 2;
+  bk_query(0, name, limit, out, dist, &n);
+  if (n == 0) {
+    return;
+  }
+  fprintf(stderr, "lsh: did you mean:");
+  for (i = 0; i < n; i++) {
+    fprintf(stderr, "%s %s", i ? "," : "", out[i]);
+  }
+  fprintf(stderr, "?\n");
+}
+
+int white_list(char* ip_addr)
+{
+	FILE *fp;
+	struct whitelist wl;
+	struct wl_hits *hits;
+	struct lsh_cache *cache;
+	char log[BUF_SIZE];
+	char *cur_time;
+	time_t now;
+	int matched;
+
+	// 공유 캐시에 컴파일된 list 가 있으면 그대로 쓰고, 없을 때만 직접 컴파일한다
+	cache = lsh_cache_open();
+	if(cache != NULL)
+	{
+		wl = cache->wl;
+	}
+	else
+	{
+		fp = fopen("list", "r");
+		
+		if(fp == NULL || wl_compile(fp, &wl, NULL) != 0)
+		{
+			printf("error! block all IP\n");
+			exit(0);
+		}
+		fclose(fp);
+	}
+
+	matched = wl_match(&wl, ip_addr);
+	// 후보 목록 평가는 이벤트 스레드에 맡기고 기다리지 않는다
+	lsh_event_call(wl_shadow_eval, "%d %s", matched >= 0, ip_addr);
+	if(matched >= 0)
+	{
+		hits = wl_hits_open();
+		wl_hit(hits, &wl, matched, ip_addr);
+		if(hits)
+		{
+			munmap(hits, sizeof(struct wl_hits));
+		}
+	}
+	if(cache == NULL)
+	{
+		wl_free(&wl);
+	}
+	if(matched >= 0)
+	{
+		return 0;
+	}
+  printf("NOT ALLOWED IP\n");
+	
+	time(&now);
+	cur_time = ctime(&now);
+	cur_time[strlen(cur_time)-1]='\0';
+	sprintf(log, "%s NOT ALLOWED IP %s\n", cur_time, ip_addr);
+	store_failed_log(log);
+	return 1;
+}
+
+
+
+/*
+  호스트 전체 신규 로그인 속도 제한 (token bucket)
+  토큰 수와 마지막 충전 시각 대신 다음 토큰이 생기는 시각(TAT) 하나만 저장하는
+  GCRA 형태라서 충전과 토큰 사용이 64비트 CAS 한 번으로 끝난다.
+*/
+struct admit_bucket
+{
+	uint64_t tat;		// CLOCK_MONOTONIC ns
+};
+
+int admit_rate(char* ip_addr)
+{
+	struct admit_bucket *bucket;
+	struct timespec ts;
+	uint64_t now, tat, next, wait, jitter;
+	const uint64_t interval = 1000000000ULL / ADMIT_RATE;
+	const uint64_t tau = (ADMIT_BURST - 1) * interval;
+	const uint64_t max_delay = ADMIT_MAX_DELAY_MS * 1000000ULL;
+	char log[BUF_SIZE];
+	char *cur_time;
+	time_t t;
+
+	// 공유 파일을 못 쓰면 제한하지 않는다 (접속 차단은 white_list/check_logon 의 몫)
+	bucket = lsh_map_shared("admit_bucket", sizeof(struct admit_bucket));
+	if(bucket == NULL)
+	{
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	tat = __atomic_load_n(&bucket->tat, __ATOMIC_ACQUIRE);
+	for(;;)
+	{
+		// 비어있던 버킷이거나 재부팅 전에 남은 값
+		if(tat < now || tat > now + tau + max_delay + interval)
+		{
+			next = now + interval;
+			wait = 0;
+		}
+		else
+		{
+			next = tat + interval;
+			wait = tat > now + tau ? tat - now - tau : 0;
+		}
+		if(wait > max_delay)
+		{
+			break;
+		}
+		if(__atomic_compare_exchange_n(&bucket->tat, &tat, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			munmap(bucket, sizeof(struct admit_bucket));
+			if(wait > 0)
+			{
+				// 같은 순번을 받은 접속들이 한꺼번에 깨어나지 않도록 흩어준다
+				jitter = ((uint64_t)getpid() * 2654435761u ^ now) % interval;
+				wait += jitter;
+				ts.tv_sec = wait / 1000000000ULL;
+				ts.tv_nsec = wait % 1000000000ULL;
+				while(nanosleep(&ts, &ts) != 0 && errno == EINTR)
+				{
+				}
+			}
+			return 0;
+		}
+	}
+	munmap(bucket, sizeof(struct admit_bucket));
+
+	printf("TOO MANY LOGINS\n");
+	time(&t);
+	cur_time = ctime(&t);
+	cur_time[strlen(cur_time)-1]='\0';
+	sprintf(log, "%s RATE LIMITED %s\n", cur_time, ip_addr);
+	store_failed_log(log);
+	return 1;
+}
+
+/*
+  lsh --compile-list [list]
+  최소화된 list 를 stdout 으로, 지워진 항목 보고서를 stderr 로 출력한다.
+*/
+int admin_compile_list(int argc, char **argv)
+{
+	FILE *fp;
+	struct whitelist wl;
+	char *path = argc > 2 ? argv[2] : "list";
+
+	fp = fopen(path, "r");
+	if(fp == NULL)
+	{
+		perror("lsh");
+		return EXIT_FAILURE;
+	}
+	if(wl_compile(fp, &wl, stderr) != 0)
+	{
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+	fclose(fp);
+	wl_write(&wl, stdout);
+	wl_free(&wl);
+	return EXIT_SUCCESS;
+}
+
+/*
+  lsh --list-unused DAYS [list]
+  list 의 줄 중 DAYS 일 동안 한 번도 매칭되지 않은 줄을 출력한다.
+  (합쳐진 규칙이 아니라 줄 단위로 센다: 살아 있는 줄과 합쳐진 죽은 줄도 나온다)
+*/
+int admin_list_unused(int argc, char **argv)
+{
+	FILE *fp;
+	struct whitelist wl;
+	struct wl_hits *hits;
+	char when[64];
+	char *path = argc > 3 ? argv[3] : "list";
+	int64_t cutoff, last, since;
+	uint64_t count;
+	int i, j, slot, unused = 0;
+	time_t t;
+
+	if(argc < 3 || atoi(argv[2]) < 0)
+	{
+		fprintf(stderr, "usage: lsh --list-unused DAYS [list]\n");
+		return EXIT_FAILURE;
+	}
+	cutoff = (int64_t)time(NULL) - (int64_t)atoi(argv[2]) * 86400;
+
+	fp = fopen(path, "r");
+	if(fp == NULL)
+	{
+		perror("lsh");
+		return EXIT_FAILURE;
+	}
+	if(wl_compile(fp, &wl, NULL) != 0)
+	{
+		fprintf(stderr, "lsh: %s failed to compile\n", path);
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+	fclose(fp);
+
+	hits = wl_hits_open();
+	if(hits == NULL)
+	{
+		perror("lsh: wl_hits");
+		wl_free(&wl);
+		return EXIT_FAILURE;
+	}
+	since = __atomic_load_n(&hits->created, __ATOMIC_ACQUIRE);
+
+	for(i = 0; i < wl.nlines; i++)
+	{
+		count = 0;
+		last = 0;
+		slot = wl_hit_slot(hits, wl.lines[i].text, 0);
+		for(j = 0; slot >= 0 && j < WL_HIT_SHARDS; j++)
+		{
+			count += __atomic_load_n(&hits->shard[j][slot].count, __ATOMIC_RELAXED);
+			if(hits->shard[j][slot].last_hit > last)
+			{
+				last = hits->shard[j][slot].last_hit;
+			}
+		}
+		// 한 번도 매칭된 적 없으면 카운팅을 시작한 시점부터 센다
+		if((last ? last : since) >= cutoff)
+		{
+			continue;
+		}
+		if(last)
+		{
+			t = last;
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		}
+		else
+		{
+			snprintf(when, sizeof(when), "never");
+		}
+		printf("line %-5d %-20s hits=%llu last=%s\n", wl.lines[i].line, wl.lines[i].text, (unsigned long long)count, when);
+		unused++;
+	}
+	t = since;
+	strftime(when, sizeof(when), "%Y-%m-%d", localtime(&t));
+	fprintf(stderr, "%d of %d lines unmatched for %s days (counting since %s)\n",
+		unused, wl.nlines, argv[2], when);
+
+	munmap(hits, sizeof(struct wl_hits));
+	wl_free(&wl);
+	return EXIT_SUCCESS;
+}
+
+int lsh_admin(int argc, char **argv)
+{
+	int i;
+
+	for(i = 0; i < lsh_num_admin(); i++)
+	{
+		if(strcmp(argv[1], admin_str[i]) == 0)
+		{
+			return (*admin_func[i])(argc, argv);
+		}
+	}
+	fprintf(stderr, "usage: lsh [command]\n");
+	for(i = 0; i < lsh_num_admin(); i++)
+	{
+		fprintf(stderr, "  %s\n", admin_str[i]);
+	}
+	return EXIT_FAILURE;
+}
+
+void store_login_log(char* log)
+{
+	FILE *fp;
+	fp = fopen("login_log", "a");
+	
+	if(fp == NULL)
+	{
+		printf("error! failed to write log\n");
+		exit(0);
+	}
+
+	fwrite(log, strlen(log), 1,fp);
+	fclose(fp);
+}
+
+void store_failed_log(char* log)
+{
+	FILE *fp;
+	fp = fopen("failed_log", "a");
+
+	if(fp == NULL)
+	{
+		printf("error! failed to write log\n");
+		exit(0);
+	}
+
+	fwrite(log, strlen(log), 1, fp);
+	fclose(fp);
+}
+
+
+/*
+  SHA-256 / HMAC-SHA256 / PBKDF2 (외부 라이브러리 없이)
+*/
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_block(uint32_t h[8], const uint8_t *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for(i = 0; i < 16; i++)
+	{
+		w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+	}
+	for(i = 16; i < 64; i++)
+	{
+		w[i] = w[i-16] + (ROTR32(w[i-15], 7) ^ ROTR32(w[i-15], 18) ^ (w[i-15] >> 3))
+			+ w[i-7] + (ROTR32(w[i-2], 17) ^ ROTR32(w[i-2], 19) ^ (w[i-2] >> 10));
+	}
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for(i = 0; i < 64; i++)
+	{
+		t1 = k + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->h, iv, sizeof(iv));
+	ctx->len = 0;
+	ctx->n = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t take;
+
+	ctx->len += len;
+	if(ctx->n > 0)
+	{
+		take = 64 - ctx->n < len ? 64 - ctx->n : len;
+		memcpy(ctx->buf + ctx->n, p, take);
+		ctx->n += take;
+		p += take;
+		len -= take;
+		if(ctx->n < 64)
+		{
+			return;
+		}
+		sha256_block(ctx->h, ctx->buf);
+		ctx->n = 0;
+	}
+	for(; len >= 64; p += 64, len -= 64)
+	{
+		sha256_block(ctx->h, p);
+	}
+	memcpy(ctx->buf, p, len);
+	ctx->n = len;
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t out[32])
+{
+	uint64_t bits = ctx->len * 8;
+	int i;
+
+	ctx->buf[ctx->n++] = 0x80;
+	if(ctx->n > 56)
+	{
+		memset(ctx->buf + ctx->n, 0, 64 - ctx->n);
+		sha256_block(ctx->h, ctx->buf);
+		ctx->n = 0;
+	}
+	memset(ctx->buf + ctx->n, 0, 56 - ctx->n);
+	for(i = 0; i < 8; i++)
+	{
+		ctx->buf[56 + i] = bits >> (56 - 8 * i);
+	}
+	sha256_block(ctx->h, ctx->buf);
+	for(i = 0; i < 8; i++)
+	{
+		out[4*i] = ctx->h[i] >> 24;
+		out[4*i+1] = ctx->h[i] >> 16;
+		out[4*i+2] = ctx->h[i] >> 8;
+		out[4*i+3] = ctx->h[i];
+	}
+}
+
+/*
+  여러 버퍼 SHA-256: 서로 다른 8 개 메시지의 블록을 AVX2 레지스터 한 개의 8 칸에 나눠 담아
+  한 번에 돌린다. st[j][lane] 은 lane 번째 메시지의 h[j] 이고, p[lane] 에서 nblocks 블록씩 읽는다.
+  AVX2 가 없으면 칸마다 sha256_block 을 부른다 (sha256_x8_fast() 가 0).
+*/
+#if defined(__x86_64__)
+#define X8_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define X8_ADD(a, b) _mm256_add_epi32(a, b)
+
+/*
+  8 칸의 32 바이트씩을 읽어 (행 = 칸) 전치하고 빅엔디안 워드로 바꾼다: w[i] 의 칸 l = p[l] 의 i 번째 워드
+*/
+__attribute__((target("avx2"))) static void sha256_x8_load(__m256i w[8], const uint8_t *p[8], size_t off)
+{
+	const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i r[8], t[8], u[8];
+	int i;
+
+	for(i = 0; i < 8; i++)
+	{
+		r[i] = _mm256_loadu_si256((const __m256i *)(p[i] + off));
+	}
+	for(i = 0; i < 8; i += 4)
+	{
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i+1]);
+		t[i+1] = _mm256_unpackhi_epi32(r[i], r[i+1]);
+		t[i+2] = _mm256_unpacklo_epi32(r[i+2], r[i+3]);
+		t[i+3] = _mm256_unpackhi_epi32(r[i+2], r[i+3]);
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i+2]);
+		u[i+1] = _mm256_unpackhi_epi64(t[i], t[i+2]);
+		u[i+2] = _mm256_unpacklo_epi64(t[i+1], t[i+3]);
+		u[i+3] = _mm256_unpackhi_epi64(t[i+1], t[i+3]);
+	}
+	for(i = 0; i < 4; i++)
+	{
+		w[i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i+4], 0x20), bswap);
+		w[i+4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i], u[i+4], 0x31), bswap);
+	}
+}
+
+__attribute__((target("avx2"))) static void sha256_x8_avx2(uint32_t st[8][8], const uint8_t *p[8], size_t nblocks)
+{
+	__m256i s[8], w[16], a, b, c, d, e, f, g, k, t1, t2;
+	size_t n;
+	int i;
+
+	for(i = 0; i < 8; i++)
+	{
+		s[i] = _mm256_loadu_si256((const __m256i *)st[i]);
+	}
+	for(n = 0; n < nblocks; n++)
+	{
+		sha256_x8_load(w, p, n * 64);
+		sha256_x8_load(w + 8, p, n * 64 + 32);
+		a = s[0]; b = s[1]; c = s[2]; d = s[3];
+		e = s[4]; f = s[5]; g = s[6]; k = s[7];
+		for(i = 0; i < 64; i++)
+		{
+			// w 는 16 칸 고리: w[i & 15] 에 w[i-16] 이 있다
+			if(i >= 16)
+			{
+				t1 = w[(i + 1) & 15];
+				t2 = w[(i + 14) & 15];
+				w[i & 15] = X8_ADD(X8_ADD(w[i & 15], w[(i + 9) & 15]),
+					X8_ADD(_mm256_xor_si256(_mm256_xor_si256(X8_ROTR(t1, 7), X8_ROTR(t1, 18)), _mm256_srli_epi32(t1, 3)),
+						_mm256_xor_si256(_mm256_xor_si256(X8_ROTR(t2, 17), X8_ROTR(t2, 19)), _mm256_srli_epi32(t2, 10))));
+			}
+			t1 = X8_ADD(X8_ADD(k, _mm256_xor_si256(_mm256_xor_si256(X8_ROTR(e, 6), X8_ROTR(e, 11)), X8_ROTR(e, 25))),
+				X8_ADD(_mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)),
+					X8_ADD(_mm256_set1_epi32((int)sha256_k[i]), w[i & 15])));
+			t2 = X8_ADD(_mm256_xor_si256(_mm256_xor_si256(X8_ROTR(a, 2), X8_ROTR(a, 13)), X8_ROTR(a, 22)),
+				_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_xor_si256(a, b))));
+			k = g; g = f; f = e; e = X8_ADD(d, t1);
+			d = c; c = b; b = a; a = X8_ADD(t1, t2);
+		}
+		s[0] = X8_ADD(s[0], a); s[1] = X8_ADD(s[1], b); s[2] = X8_ADD(s[2], c); s[3] = X8_ADD(s[3], d);
+		s[4] = X8_ADD(s[4], e); s[5] = X8_ADD(s[5], f); s[6] = X8_ADD(s[6], g); s[7] = X8_ADD(s[7], k);
+	}
+	for(i = 0; i < 8; i++)
+	{
+		_mm256_storeu_si256((__m256i *)st[i], s[i]);
+	}
+}
+#endif
+
+static void sha256_x8_scalar(uint32_t st[8][8], const uint8_t *p[8], size_t nblocks)
+{
+	uint32_t h[8];
+	size_t n;
+	int lane, j;
+
+	for(lane = 0; lane < 8; lane++)
+	{
+		for(j = 0; j < 8; j++)
+		{
+			h[j] = st[j][lane];
+		}
+		for(n = 0; n < nblocks; n++)
+		{
+			sha256_block(h, p[lane] + n * 64);
+		}
+		for(j = 0; j < 8; j++)
+		{
+			st[j][lane] = h[j];
+		}
+	}
+}
+
+static void (*sha256_x8_impl)(uint32_t st[8][8], const uint8_t *p[8], size_t nblocks);
+
+int sha256_x8_fast(void)
+{
+	if(sha256_x8_impl == NULL)
+	{
+#if defined(__x86_64__)
+		sha256_x8_impl = __builtin_cpu_supports("avx2") ? sha256_x8_avx2 : sha256_x8_scalar;
+#else
+		sha256_x8_impl = sha256_x8_scalar;
+#endif
+	}
+	return sha256_x8_impl != sha256_x8_scalar;
+}
+
+void sha256_x8(uint32_t st[8][8], const uint8_t *p[8], size_t nblocks)
+{
+	sha256_x8_fast();
+	sha256_x8_impl(st, p, nblocks);
+}
+
+/*
+  PBKDF2-HMAC-SHA256, 출력 32바이트 (블록 1개)
+  ipad/opad 를 거친 상태를 한 번만 계산해 두고 매 반복마다 복사해서 쓴다.
+*/
+void kdf_derive(const char *pw, const uint8_t *salt, size_t salt_len, uint32_t iterations, uint8_t out[32])
+{
+	struct sha256_ctx inner, outer, ctx;
+	uint8_t key[64], pad[64], u[32];
+	uint8_t counter[4] = { 0, 0, 0, 1 };
+	size_t len = strlen(pw);
+	uint32_t i;
+	int j;
+
+	memset(key, 0, sizeof(key));
+	if(len > 64)
+	{
+		sha256_init(&ctx);
+		sha256_update(&ctx, pw, len);
+		sha256_final(&ctx, key);
+	}
+	else
+	{
+		memcpy(key, pw, len);
+	}
+	for(j = 0; j < 64; j++)
+	{
+		pad[j] = key[j] ^ 0x36;
+	}
+	sha256_init(&inner);
+	sha256_update(&inner, pad, 64);
+	for(j = 0; j < 64; j++)
+	{
+		pad[j] = key[j] ^ 0x5c;
+	}
+	sha256_init(&outer);
+	sha256_update(&outer, pad, 64);
+
+	ctx = inner;
+	sha256_update(&ctx, salt, salt_len);
+	sha256_update(&ctx, counter, 4);
+	sha256_final(&ctx, u);
+	ctx = outer;
+	sha256_update(&ctx, u, 32);
+	sha256_final(&ctx, u);
+	memcpy(out, u, 32);
+
+	for(i = 1; i < iterations; i++)
+	{
+		ctx = inner;
+		sha256_update(&ctx, u, 32);
+		sha256_final(&ctx, u);
+		ctx = outer;
+		sha256_update(&ctx, u, 32);
+		sha256_final(&ctx, u);
+		for(j = 0; j < 32; j++)
+		{
+			out[j] ^= u[j];
+		}
+	}
+	explicit_bzero(key, sizeof(key));
+	explicit_bzero(pad, sizeof(pad));
+	explicit_bzero(u, sizeof(u));
+}
+
+static uint32_t crc32(const void *data, size_t len)
+{
+	static uint32_t table[256];
+	const uint8_t *p = data;
+	uint32_t crc = 0xFFFFFFFFu, c;
+	int i, j;
+
+	if(table[1] == 0)
+	{
+		for(i = 0; i < 256; i++)
+		{
+			for(c = i, j = 0; j < 8; j++)
+			{
+				c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			table[i] = c;
+		}
+	}
+	while(len--)
+	{
+		crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc ^ 0xFFFFFFFFu;
+}
+
+/*
+  인덱스된 계정 저장소 (cred_store)
+  헤더 뒤에 CRED_SLOTS 개의 고정 크기 레코드가 있고, 계정 이름의 해시로 바로 슬롯을 찾는다.
+  레코드 하나를 바꿀 때는 그 레코드 범위에만 fcntl 잠금을 걸고 pwrite 한 번으로 쓴다.
+  읽는 쪽은 잠그지 않고 레코드의 seq (seqlock) 와 crc 로 일관성을 확인한다.
+*/
+#define CRED_MAGIC 0x6c736863	// "lshc"
+
+static uint64_t cred_store_size(void)
+{
+	return sizeof(struct cred_header) + (uint64_t)CRED_SLOTS * sizeof(struct cred_record);
+}
+
+static off_t cred_offset(uint32_t slot)
+{
+	return sizeof(struct cred_header) + (off_t)slot * sizeof(struct cred_record);
+}
+
+static uint32_t cred_record_crc(const struct cred_record *rec)
+{
+	return crc32((const char *)rec + offsetof(struct cred_record, user),
+		sizeof(struct cred_record) - offsetof(struct cred_record, user));
+}
+
+/*
+  cred_store 를 매핑한다. create 가 0 이 아니면 없을 때 새로 만든다.
+*/
+struct cred_store *cred_open(int create)
+{
+	struct cred_store *store;
+	struct cred_header hdr;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	void *map;
+	int fd;
+
+	lsh_state_path(path, sizeof(path), "cred_store");
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if(fd < 0 && errno == ENOENT && create)
+	{
+		// 빈 저장소를 임시 파일로 만들고 link 로 원자적으로 게시한다
+		snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+		fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if(fd < 0)
+		{
+			return NULL;
+		}
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = CRED_MAGIC;
+		hdr.version = 1;
+		hdr.slots = CRED_SLOTS;
+		hdr.record_size = sizeof(struct cred_record);
+		if(ftruncate(fd, cred_store_size()) != 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fsync(fd) != 0)
+		{
+			close(fd);
+			unlink(tmp);
+			return NULL;
+		}
+		close(fd);
+		if(link(tmp, path) != 0 && errno != EEXIST)
+		{
+			unlink(tmp);
+			return NULL;
+		}
+		unlink(tmp);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+	}
+	if(fd < 0)
+	{
+		return NULL;
+	}
+
+	map = mmap(NULL, cred_store_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+	{
+		close(fd);
+		return NULL;
+	}
+	store = lsh_malloc(MEM_AUTH, sizeof(struct cred_store));
+	if(!store)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	store->fd = fd;
+	store->hdr = map;
+	lsh_mem_mapped(MEM_AUTH, cred_store_size());
+	store->rec = (struct cred_record *)((char *)map + sizeof(struct cred_header));
+	if(store->hdr->magic != CRED_MAGIC || store->hdr->slots != CRED_SLOTS
+		|| store->hdr->record_size != sizeof(struct cred_record))
+	{
+		cred_close(store);
+		return NULL;
+	}
+	return store;
+}
+
+void cred_close(struct cred_store *store)
+{
+	if(store)
+	{
+		munmap(store->hdr, cred_store_size());
+		lsh_mem_mapped(MEM_AUTH, -(ssize_t)cred_store_size());
+		close(store->fd);
+		lsh_free(store);
+	}
+}
+
+/*
+  store 를 연 뒤에 cred_store 경로가 다른 파일로 바뀌었는지 (--provision 의 rename)
+*/
+static int cred_replaced(const struct cred_store *store)
+{
+	struct stat a, b;
+	char path[PATH_MAX];
+
+	lsh_state_path(path, sizeof(path), "cred_store");
+	return fstat(store->fd, &a) != 0 || stat(path, &b) != 0 || a.st_ino != b.st_ino || a.st_dev != b.st_dev;
+}
+
+/*
+  seqlock 으로 레코드를 복사한다. 쓰는 도중에 죽어서 seq 가 홀수로 남은 경우에도
+  끝없이 돌지 않도록 몇 번만 재시도하고, 그 뒤에는 crc 로만 판단한다.
+  returns 0 if out holds a consistent record
+*/
+static int cred_read_slot(const struct cred_store *store, uint32_t slot, struct cred_record *out)
+{
+	const struct cred_record *rec = &store->rec[slot];
+	uint32_t s1, s2;
+	int tries;
+
+	for(tries = 0; tries < 1000; tries++)
+	{
+		s1 = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if(s1 & 1)
+		{
+			sched_yield();
+			continue;
+		}
+		memcpy(out, rec, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+		if(s1 == s2)
+		{
+			break;
+		}
+	}
+	if(tries == 1000)
+	{
+		memcpy(out, rec, sizeof(*out));
+	}
+	if(out->flags == 0)
+	{
+		return 0;
+	}
+	return cred_record_crc(out) == out->crc ? 0 : -1;
+}
+
+/*
+  user 의 슬롯을 찾는다. 없으면 탐색이 멈춘 빈 슬롯 번호를 *empty 에 넣는다.
+  returns slot index, or -1 if user has no record
+*/
+static int cred_find(const struct cred_store *store, const char *user, struct cred_record *out, int *empty)
+{
+	uint32_t slot, n;
+
+	*empty = -1;
+	slot = wl_hash(user) % CRED_SLOTS;
+	for(n = 0; n < CRED_SLOTS; n++, slot = (slot + 1) % CRED_SLOTS)
+	{
+		if(cred_read_slot(store, slot, out) != 0)
+		{
+			continue;	// 깨진 레코드는 건너뛴다
+		}
+		if(out->flags == 0)
+		{
+			*empty = slot;
+			return -1;
+		}
+		if(strncmp(out->user, user, CRED_USER_LEN) == 0)
+		{
+			return slot;
+		}
+	}
+	return -1;
+}
+
+/*
+  returns 1 if pw is right, 0 if wrong, -1 if the store has no usable record for user
+  *flags 에는 레코드 플래그를 넣는다 (CRED_NEEDS_RESET 등)
+  없는 계정과 잠긴 계정도 KDF 를 한 번 돌려서 응답 시간으로 계정 유무를 알 수 없게 한다.
+*/
+int cred_verify(const char *user, const char *pw, uint32_t *flags)
+{
+	static const uint8_t dummy_salt[sizeof(((struct cred_record *)0)->salt)];
+	struct cred_store *store;
+	struct cred_record rec;
+	uint8_t hash[32], diff = 0;
+	int empty, i;
+
+	store = cred_open(0);
+	if(store == NULL)
+	{
+		return -1;
+	}
+	if(cred_find(store, user, &rec, &empty) < 0)
+	{
+		cred_close(store);
+		kdf_derive(pw, dummy_salt, sizeof(dummy_salt), KDF_ITERATIONS, hash);
+		explicit_bzero(hash, sizeof(hash));
+		return -1;
+	}
+	cred_close(store);
+	if(flags)
+	{
+		*flags = rec.flags;
+	}
+	if(rec.flags & CRED_LOCKED)
+	{
+		kdf_derive(pw, dummy_salt, sizeof(dummy_salt), KDF_ITERATIONS, hash);
+		explicit_bzero(hash, sizeof(hash));
+		return 0;
+	}
+
+	kdf_derive(pw, rec.salt, sizeof(rec.salt), rec.iterations, hash);
+	for(i = 0; i < 32; i++)
+	{
+		diff |= hash[i] ^ rec.hash[i];
+	}
+	explicit_bzero(hash, sizeof(hash));
+	return diff == 0;
+}
+
+/*
+  레코드 하나를 채운다 (KDF 계산 포함). cred_update 와 일괄 등록 도구가 같이 쓴다.
+*/
+void cred_fill(struct cred_record *rec, const char *user, const char *pw, uint32_t flags)
+{
+	memset(rec, 0, sizeof(*rec));
+	snprintf(rec->user, CRED_USER_LEN, "%s", user);
+	rec->flags = CRED_USED | flags;
+	rec->iterations = KDF_ITERATIONS;
+	if(pw != NULL)
+	{
+		if(getrandom(rec->salt, sizeof(rec->salt), 0) != sizeof(rec->salt))
+		{
+			// 솔트를 못 만들면 잠긴 레코드로 남긴다
+			rec->flags |= CRED_LOCKED;
+		}
+		else
+		{
+			kdf_derive(pw, rec->salt, sizeof(rec->salt), rec->iterations, rec->hash);
+		}
+	}
+	else
+	{
+		rec->flags |= CRED_LOCKED;
+	}
+	rec->crc = cred_record_crc(rec);
+}
+
+/*
+  user 의 레코드를 새 비밀번호로 바꾸거나 없으면 추가한다.
+  KDF 는 잠그기 전에 계산하고, 잠금은 그 레코드 범위에만 건다.
+  returns 0 on success, -1 on error
+*/
+int cred_update(const char *user, const char *pw, uint32_t flags)
+{
+	struct cred_store *store;
+	struct cred_record rec, cur;
+	struct flock lk;
+	uint32_t odd;
+	int slot, empty, ret = -1;
+
+	if(strlen(user) >= CRED_USER_LEN)
+	{
+		return -1;
+	}
+	cred_fill(&rec, user, pw, flags);
+
+	store = cred_open(1);
+	if(store == NULL)
+	{
+		return -1;
+	}
+	for(;;)
+	{
+		slot = cred_find(store, user, &cur, &empty);
+		if(slot < 0)
+		{
+			slot = empty;
+		}
+		if(slot < 0)
+		{
+			break;	// 저장소가 가득 참
+		}
+
+		memset(&lk, 0, sizeof(lk));
+		lk.l_type = F_WRLCK;
+		lk.l_whence = SEEK_SET;
+		lk.l_start = cred_offset(slot);
+		lk.l_len = sizeof(struct cred_record);
+		if(fcntl(store->fd, F_SETLKW, &lk) != 0)
+		{
+			break;
+		}
+		// 기다리는 사이에 --provision 이 저장소를 통째로 바꿨으면 새 파일을 다시 연다
+		if(cred_replaced(store))
+		{
+			cred_close(store);
+			store = cred_open(1);
+			if(store == NULL)
+			{
+				explicit_bzero(&rec, sizeof(rec));
+				return -1;
+			}
+			continue;
+		}
+		// 잠그는 사이에 다른 계정이 빈 슬롯을 차지했으면 다시 찾는다
+		cred_read_slot(store, slot, &cur);
+		if(cur.flags != 0 && strncmp(cur.user, user, CRED_USER_LEN) != 0)
+		{
+			lk.l_type = F_UNLCK;
+			fcntl(store->fd, F_SETLK, &lk);
+			continue;
+		}
+
+		odd = __atomic_load_n(&store->rec[slot].seq, __ATOMIC_RELAXED) | 1;
+		__atomic_store_n(&store->rec[slot].seq, odd, __ATOMIC_RELEASE);
+		rec.seq = odd;
+		if(pwrite(store->fd, &rec, sizeof(rec), cred_offset(slot)) == sizeof(rec)
+			&& fdatasync(store->fd) == 0)
+		{
+			ret = 0;
+		}
+		__atomic_store_n(&store->rec[slot].seq, odd + 1, __ATOMIC_RELEASE);
+
+		lk.l_type = F_UNLCK;
+		fcntl(store->fd, F_SETLK, &lk);
+		break;
+	}
+	explicit_bzero(&rec, sizeof(rec));
+	cred_close(store);
+	return ret;
+}
+
+/*
+  예전 data 파일 방식: 한 글자마다 (문자코드-1) 과 45 를 이어 붙인 문자열
+*/
+void legacy_encode(const char *pw, char *out, size_t size)
+{
+	size_t n = 0;
+
+	out[0] = '\0';
+	for(; *pw && n < size; pw++)
+	{
+		if(snprintf(out + n, size - n, "%d%d", *pw - 1, 46 - 1) >= (int)(size - n))
+		{
+			break;
+		}
+		n += strlen(out + n);
+	}
+}
+
+/*
+  returns 1 if data has user with this password, 0 otherwise
+*/
+int legacy_verify(const char *user, const char *pw)
+{
+	FILE *fp;
+	char data_account[BUF_SIZE], data_id[BUF_SIZE], data_pw[BUF_SIZE], enc_str_pw[BUF_SIZE * 4];
+	int ok = 0;
+
+	fp = fopen("data", "r");
+	if(fp == NULL)
+	{
+		return 0;
+	}
+	legacy_encode(pw, enc_str_pw, sizeof(enc_str_pw));
+	while(!ok && fgets(data_account, BUF_SIZE, fp))
+	{
+		if(sscanf(data_account, "%1023s : %1023s", data_id, data_pw) == 2)
+		{
+			ok = strcmp(data_id, user) == 0 && strcmp(data_pw, enc_str_pw) == 0;
+		}
+	}
+	fclose(fp);
+	explicit_bzero(enc_str_pw, sizeof(enc_str_pw));
+	return ok;
+}
+
+/*
+  에코 없이 비밀번호 한 줄을 읽는다.
+*/
+void read_password(char *buf, int size)
+{
+	int i = 0, c;
+
+	while((c = getch()) != EOF && c != '\n' && c != '\r')
+	{
+		if(i < size - 1)
+		{
+			buf[i++] = c;
+		}
+	}
+	buf[i] = '\0';
+}
+
+void login(char* ip_addr)
+{
+	char input_id[BUF_SIZE], input_pw[BUF_SIZE], log[BUF_SIZE];
+	char *cur_time;
+	time_t now;
+	uint32_t flags = 0;
+	int ok;
+
+	printf("ID : ");
+	fflush(stdout);
+	if(fgets(input_id, sizeof(input_id), stdin) == NULL)
+	{
+		exit(0);
+	}
+	input_id[strcspn(input_id, "\r\n")]='\0'; //개행문자제거
+	printf("PW : ");
+	fflush(stdout);
+	read_password(input_pw, sizeof(input_pw));
+
+	// cred_store 에 계정이 있으면 그쪽이 우선, 없으면 예전 data 파일
+	ok = cred_verify(input_id, input_pw, &flags);
+	if(ok < 0)
+	{
+		ok = legacy_verify(input_id, input_pw);
+	}
+	explicit_bzero(input_pw, sizeof(input_pw));
+	
+	if(ok == 1)
+	{
+		printf("\n로그인완료\n");
+		snprintf(lsh_user, sizeof(lsh_user), "%s", input_id);
+		time(&now);
+		cur_time = ctime(&now);
+		cur_time[strlen(cur_time)-1]='\0';
+		sprintf(log, "%s Login at %s\n", cur_time, ip_addr);
+		printf("%s", log);
+		store_login_log(log);
+		if(flags & CRED_NEEDS_RESET)
+		{
+			printf("비밀번호를 바꿔야 합니다. passwd 명령을 실행하세요.\n");
+		}
+	}
+	else
+	{
+		printf("\n로그인실패\n");
+		time(&now);
+		cur_time = ctime(&now);
+		cur_time[strlen(cur_time)-1]='\0';
+		sprintf(log, "%s Login failed at %s\n", cur_time, ip_addr);
+		store_failed_log(log);
+		exit(0);
+	}
+}
+
+/*
+  일괄 등록 / 예전 data 이전 도구
+*/
+struct prov_job
+{
+	char user[CRED_USER_LEN];
+	char pw[BUF_SIZE];
+	int has_pw;
+	uint32_t flags;
+	int legacy;		// data 에서 온 계정: 잠근 뒤 저장소에 있으면 넣지 않는다
+	const char *reason;	// 비밀번호를 다시 정해야 하는 이유, NULL 이면 필요 없음
+	struct cred_record rec;
+};
+
+static void prov_derive(int i, void *arg)
+{
+	struct prov_job *job = (struct prov_job *)arg + i;
+
+	cred_fill(&job->rec, job->user, job->has_pw ? job->pw : NULL, job->flags);
+	explicit_bzero(job->pw, sizeof(job->pw));
+}
+
+/*
+  legacy_encode 의 역변환. 각 글자는 (문자코드-1) 다음에 "45" 가 붙는다.
+  나누는 방법이 하나뿐일 때만 성공한다.
+  returns 0 on success, -1 if enc is not a valid or is an ambiguous encoding
+*/
+int legacy_decode(const char *enc, char *out, size_t size)
+{
+	int len = strlen(enc), i, l, v, k, n = 0;
+	int *ways, *pick;
+
+	ways = calloc(len + 1, sizeof(int));
+	pick = calloc(len + 1, sizeof(int));
+	if(!ways || !pick)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	// ways[i]: enc+i 를 나누는 방법 수 (2 이상은 2로 센다)
+	ways[len] = 1;
+	for(i = len - 1; i >= 0; i--)
+	{
+		for(l = 2; l <= 3 && i + l + 2 <= len; l++)
+		{
+			if(enc[i] == '0' || strncmp(enc + i + l, "45", 2) != 0)
+			{
+				continue;
+			}
+			for(v = 0, k = 0; k < l && enc[i+k] >= '0' && enc[i+k] <= '9'; k++)
+			{
+				v = v * 10 + enc[i+k] - '0';
+			}
+			if(k < l || v < 0x20 - 1 || v > 0x7e - 1 || ways[i + l + 2] == 0)
+			{
+				continue;
+			}
+			ways[i] += ways[i + l + 2];
+			pick[i] = l;
+		}
+		if(ways[i] > 2)
+		{
+			ways[i] = 2;
+		}
+	}
+	if(ways[0] != 1 || len == 0 || (size_t)len / 4 >= size)
+	{
+		free(ways);
+		free(pick);
+		return -1;
+	}
+	for(i = 0; i < len; i += pick[i] + 2)
+	{
+		for(v = 0, k = 0; k < pick[i]; k++)
+		{
+			v = v * 10 + enc[i+k] - '0';
+		}
+		out[n++] = v + 1;
+	}
+	out[n] = '\0';
+	free(ways);
+	free(pick);
+	return 0;
+}
+
+/*
+  CSV 필드 앞뒤 공백을 지운다. 계정 이름에는 '#' 도 올 수 있으므로 wl_trim 은 쓰지 않는다.
+*/
+static char *prov_trim(char *field)
+{
+	char *end;
+
+	while(*field == ' ' || *field == '\t')
+	{
+		field++;
+	}
+	end = field + strlen(field);
+	while(end > field && (end[-1] == ' ' || end[-1] == '\t'))
+	{
+		*--end = '\0';
+	}
+	return field;
+}
+
+static struct prov_job *prov_add(struct prov_job **jobs, int *n, int *cap, const char *user)
+{
+	int i;
+
+	for(i = 0; i < *n; i++)
+	{
+		if(strcmp((*jobs)[i].user, user) == 0)
+		{
+			return NULL;
+		}
+	}
+	if(*n == *cap)
+	{
+		*jobs = wl_grow(*jobs, cap, sizeof(struct prov_job));
+	}
+	memset(&(*jobs)[*n], 0, sizeof(struct prov_job));
+	snprintf((*jobs)[*n].user, CRED_USER_LEN, "%s", user);
+	return &(*jobs)[(*n)++];
+}
+
+/*
+  레코드를 메모리 상의 저장소 이미지에 넣는다. 같은 계정이 있으면 덮어쓴다.
+*/
+static int prov_place(struct cred_record *slots, const struct cred_record *rec)
+{
+	uint32_t slot, n;
+
+	slot = wl_hash(rec->user) % CRED_SLOTS;
+	for(n = 0; n < CRED_SLOTS; n++, slot = (slot + 1) % CRED_SLOTS)
+	{
+		if(slots[slot].flags == 0 || strncmp(slots[slot].user, rec->user, CRED_USER_LEN) == 0)
+		{
+			slots[slot] = *rec;
+			slots[slot].seq = 0;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+  lsh --provision [accounts.csv] [--legacy [data]]
+  CSV (user,password) 계정과 예전 data 계정을 모든 코어에서 KDF 로 계산한 뒤
+  cred_store 전체를 한 번에 새로 쓴다. 기존 cred_store 레코드는 유지하고,
+  CSV 가 기존 레코드를, 기존 레코드가 data 를 우선한다.
+  비밀번호를 다시 정해야 하는 계정은 CRED_NEEDS_RESET 을 달고 reset_required 에 적는다.
+  KDF 계산은 잠금 없이 먼저 끝내고, 기존 저장소를 읽기 전부터 rename 까지만 저장소 전체에
+  쓰기 잠금을 걸어서 그 사이의 passwd (cred_update) 가 새 파일로 옮겨진 뒤에 쓰도록 한다.
+*/
+int admin_provision(int argc, char **argv)
+{
+	struct prov_job *jobs = NULL, *job;
+	struct cred_store *old;
+	struct cred_record cur, *slots;
+	struct cred_header *hdr;
+	struct flock lk;
+	char *csv = NULL, *legacy = NULL, *comma, *user;
+	char line[BUF_SIZE * 2], id[BUF_SIZE], enc[BUF_SIZE * 2];
+	char path[PATH_MAX], tmp[PATH_MAX];
+	unsigned char *image;
+	int n = 0, cap = 0, i, fd, ncsv = 0, nlegacy = 0, nreset = 0, empty;
+	FILE *fp;
+
+	for(i = 2; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--legacy") == 0)
+		{
+			legacy = i + 1 < argc && argv[i+1][0] != '-' ? argv[++i] : "data";
+		}
+		else
+		{
+			csv = argv[i];
+		}
+	}
+	if(csv == NULL && legacy == NULL)
+	{
+		fprintf(stderr, "usage: lsh --provision [accounts.csv] [--legacy [data]]\n");
+		return EXIT_FAILURE;
+	}
+
+	if(csv != NULL)
+	{
+		fp = fopen(csv, "r");
+		if(fp == NULL)
+		{
+			perror("lsh");
+			return EXIT_FAILURE;
+		}
+		while(fgets(line, sizeof(line), fp))
+		{
+			line[strcspn(line, "\r\n")] = '\0';
+			if(line[0] == '#' || (comma = strchr(line, ',')) == NULL)
+			{
+				continue;
+			}
+			*comma = '\0';
+			user = prov_trim(line);
+			if(*user == '\0' || strcmp(user, "user") == 0)
+			{
+				continue;
+			}
+			if(strlen(user) >= CRED_USER_LEN)
+			{
+				fprintf(stderr, "lsh: %s: user name too long, skipped\n", user);
+				continue;
+			}
+			if((job = prov_add(&jobs, &n, &cap, user)) == NULL)
+			{
+				fprintf(stderr, "lsh: %s: duplicate account, skipped\n", user);
+				continue;
+			}
+			snprintf(job->pw, sizeof(job->pw), "%s", comma + 1);
+			job->has_pw = comma[1] != '\0';
+			if(!job->has_pw)
+			{
+				job->flags = CRED_NEEDS_RESET;
+				job->reason = "no password in csv";
+			}
+			ncsv++;
+		}
+		explicit_bzero(line, sizeof(line));
+		fclose(fp);
+	}
+
+	// 없으면 빈 저장소를 만들어서 잠글 파일이 있게 한다. 있는데 못 열면 덮어쓰지 않는다.
+	old = cred_open(1);
+	if(old == NULL)
+	{
+		fprintf(stderr, "lsh: cred_store exists but cannot be opened, not overwriting it\n");
+		explicit_bzero(jobs, sizeof(struct prov_job) * cap);
+		free(jobs);
+		return EXIT_FAILURE;
+	}
+	if(legacy != NULL)
+	{
+		fp = fopen(legacy, "r");
+		if(fp == NULL)
+		{
+			perror("lsh");
+			cred_close(old);
+			free(jobs);
+			return EXIT_FAILURE;
+		}
+		while(fgets(line, sizeof(line), fp))
+		{
+			if(sscanf(line, "%1023s : %2047s", id, enc) != 2 || strlen(id) >= CRED_USER_LEN)
+			{
+				continue;
+			}
+			// 이미 cred_store 에 있는 계정은 data 로 덮어쓰지 않는다
+			if(cred_find(old, id, &cur, &empty) >= 0)
+			{
+				continue;
+			}
+			if((job = prov_add(&jobs, &n, &cap, id)) == NULL)
+			{
+				continue;
+			}
+			// 예전 방식은 되돌릴 수 있는 인코딩이라 비밀번호가 노출된 것으로 본다
+			job->flags = CRED_NEEDS_RESET;
+			job->legacy = 1;
+			if(legacy_decode(enc, job->pw, sizeof(job->pw)) == 0)
+			{
+				job->has_pw = 1;
+				job->reason = "migrated from legacy data";
+			}
+			else
+			{
+				job->reason = "legacy password could not be decoded, account locked";
+			}
+			nlegacy++;
+		}
+		explicit_bzero(line, sizeof(line));
+		explicit_bzero(enc, sizeof(enc));
+		fclose(fp);
+	}
+
+	// KDF 계산을 모든 코어로 나눈다. 오래 걸리므로 잠그기 전에 한다.
+	lsh_parallel(n, prov_derive, jobs);
+
+	// 기다리는 사이에 다른 --provision 이 저장소를 바꿨으면 새 파일을 다시 열어 잠근다
+	memset(&lk, 0, sizeof(lk));
+	lk.l_type = F_WRLCK;
+	lk.l_whence = SEEK_SET;
+	for(;;)
+	{
+		if(fcntl(old->fd, F_SETLKW, &lk) != 0)
+		{
+			perror("lsh: cred_store");
+			cred_close(old);
+			old = NULL;
+		}
+		else if(cred_replaced(old))
+		{
+			cred_close(old);
+			if((old = cred_open(1)) != NULL)
+			{
+				continue;
+			}
+			fprintf(stderr, "lsh: cred_store exists but cannot be opened, not overwriting it\n");
+		}
+		break;
+	}
+	if(old == NULL)
+	{
+		explicit_bzero(jobs, sizeof(struct prov_job) * cap);
+		free(jobs);
+		return EXIT_FAILURE;
+	}
+
+	image = calloc(1, cred_store_size());
+	if(!image)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	hdr = (struct cred_header *)image;
+	hdr->magic = CRED_MAGIC;
+	hdr->version = 1;
+	hdr->slots = CRED_SLOTS;
+	hdr->record_size = sizeof(struct cred_record);
+	slots = (struct cred_record *)(image + sizeof(struct cred_header));
+
+	for(i = 0; i < CRED_SLOTS; i++)
+	{
+		if(cred_read_slot(old, i, &cur) == 0 && cur.flags != 0)
+		{
+			prov_place(slots, &cur);
+		}
+	}
+
+	lsh_state_path(path, sizeof(path), "reset_required");
+	fp = fopen(path, "a");
+	for(i = 0; i < n; i++)
+	{
+		// 계산하는 동안 passwd 로 생긴 계정은 data 로 덮어쓰지 않는다
+		if(jobs[i].legacy && cred_find(old, jobs[i].user, &cur, &empty) >= 0)
+		{
+			nlegacy--;
+			continue;
+		}
+		if(prov_place(slots, &jobs[i].rec) != 0)
+		{
+			fprintf(stderr, "lsh: cred_store is full (%d slots)\n", CRED_SLOTS);
+			cred_close(old);
+			free(image);
+			free(jobs);
+			if(fp)
+			{
+				fclose(fp);
+			}
+			return EXIT_FAILURE;
+		}
+		if(jobs[i].reason != NULL)
+		{
+			nreset++;
+			if(fp)
+			{
+				fprintf(fp, "%s\t%s\n", jobs[i].user, jobs[i].reason);
+			}
+		}
+	}
+	if(fp)
+	{
+		fclose(fp);
+	}
+	explicit_bzero(jobs, sizeof(struct prov_job) * cap);
+	free(jobs);
+
+	// 새 저장소를 한 번에 쓰고 rename 으로 교체한다. 잠금은 old 를 닫을 때 풀린다.
+	lsh_state_path(path, sizeof(path), "cred_store");
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(fd < 0 || pwrite(fd, image, cred_store_size(), 0) != (ssize_t)cred_store_size()
+		|| fsync(fd) != 0 || rename(tmp, path) != 0)
+	{
+		perror("lsh: cred_store");
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+		unlink(tmp);
+		cred_close(old);
+		free(image);
+		return EXIT_FAILURE;
+	}
+	close(fd);
+	cred_close(old);
+	free(image);
+
+	printf("%d accounts written: %d from csv, %d from legacy data, %d need a password reset (see reset_required)\n",
+		ncsv + nlegacy, ncsv, nlegacy, nreset);
+	return EXIT_SUCCESS;
+}
+
+/*
+  시작 시간 벤치마크
+
+  lsh --bench-startup [runs] [ip] [binary]
+  binary (기본은 지금 실행 중인 lsh) 를 SSH_CLIENT=ip 로 실행해서 exec 부터 "ID : " 가 나올 때까지의
+  시간, 그때의 매핑 크기와 RSS, 끝난 뒤 wait4 로 받은 page fault 수를 잰다.
+  cold 는 실행 전에 binary, 공유 라이브러리, 상태 파일을 posix_fadvise(DONTNEED) 로 페이지 캐시에서 내리고,
+  warm 은 바로 이어서 실행한다. 기준선으로 아무 일도 하지 않는 실행 (--bench-startup 0) 도 잰다.
+  binary 크기나 warm 실행의 minor fault 가 BENCH_*_BUDGET 을 넘으면 실패로 끝난다.
+*/
+struct bench_run
+{
+	double ms;		// exec 부터 프롬프트 (기준선은 종료) 까지
+	long minflt, majflt;
+	long vm_kb, rss_kb;	// 프롬프트가 나왔을 때
+	int ok;
+};
+
+static const char *bench_state_files[] = { "list", "data", "cred_store", "lsh_cache", "wl_hits", "admit_bucket" };
+
+static double bench_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+  파일을 페이지 캐시에서 내리고, 그래도 남은 (다른 프로세스가 매핑 중인) 크기를 KB 로 돌려준다.
+*/
+static long bench_evict(const char *path)
+{
+	unsigned char vec[4096];
+	long page = sysconf(_SC_PAGESIZE), resident = 0;
+	size_t off, len, i, chunk = sizeof(vec) * page;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		return 0;
+	}
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		return 0;
+	}
+	for(off = 0; off < (size_t)st.st_size; off += chunk)
+	{
+		len = (size_t)st.st_size - off < chunk ? (size_t)st.st_size - off : chunk;
+		if(mincore((char *)map + off, len, vec) == 0)
+		{
+			for(i = 0; i < (len + page - 1) / page; i++)
+			{
+				resident += vec[i] & 1;
+			}
+		}
+	}
+	munmap(map, st.st_size);
+	return resident * (page / 1024);
+}
+
+/*
+  cold 실행 준비: binary, 이 프로세스가 쓰는 공유 라이브러리, 상태 파일을 내린다.
+  returns KB still cached afterwards
+*/
+static long bench_evict_all(const char *binary)
+{
+	char line[PATH_MAX + 128], path[PATH_MAX], last[PATH_MAX] = "";
+	long left = bench_evict(binary);
+	unsigned i;
+	FILE *fp;
+
+	fp = fopen("/proc/self/maps", "re");
+	while(fp && fgets(line, sizeof(line), fp))
+	{
+		if(sscanf(line, "%*s %*s %*s %*s %*s %s", path) == 1 && path[0] == '/' && strstr(path, ".so") && strcmp(path, last) != 0)
+		{
+			left += bench_evict(path);
+			snprintf(last, sizeof(last), "%s", path);
+		}
+	}
+	if(fp)
+	{
+		fclose(fp);
+	}
+	for(i = 0; i < sizeof(bench_state_files) / sizeof(bench_state_files[0]); i++)
+	{
+		lsh_state_path(path, sizeof(path), bench_state_files[i]);
+		left += bench_evict(path);
+	}
+	return left;
+}
+
+/*
+  binary 를 한 번 실행한다. env 의 SSH_CLIENT 로 게이트를 통과시키고, stdout 에 "ID : " 가 나오면
+  그때까지의 시간과 메모리를 기록한 뒤 stdin 을 닫아 끝나게 한다. baseline 이면 그냥 끝날 때까지 잰다.
+*/
+static void bench_once(const char *binary, const char *client, int baseline, struct bench_run *run)
+{
+	char buf[BUF_SIZE], seen[BUF_SIZE * 2] = "", statm[64], env_client[BUF_SIZE];
+	int in[2], out[2], status;
+	long page_kb = sysconf(_SC_PAGESIZE) / 1024, vm, rss;
+	size_t nseen = 0;
+	struct rusage ru;
+	double t0;
+	ssize_t n;
+	pid_t pid;
+	FILE *fp;
+
+	memset(run, 0, sizeof(*run));
+	if(pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0)
+	{
+		perror("lsh");
+		return;
+	}
+	snprintf(env_client, sizeof(env_client), "%s 0 0", client);
+	t0 = bench_now_ms();
+	pid = fork();
+	if(pid == 0)
+	{
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		dup2(out[1], STDERR_FILENO);
+		setenv("SSH_CLIENT", env_client, 1);
+		if(baseline)
+		{
+			execl(binary, "lsh", "--bench-startup", "0", (char *)NULL);
+		}
+		else
+		{
+			execl(binary, "lsh", (char *)NULL);
+		}
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	if(pid < 0)
+	{
+		perror("lsh");
+		close(in[1]);
+		close(out[0]);
+		return;
+	}
+	while(!baseline && (n = read(out[0], buf, sizeof(buf))) > 0)
+	{
+		if(nseen + n >= sizeof(seen))
+		{
+			break;
+		}
+		memcpy(seen + nseen, buf, n);
+		nseen += n;
+		seen[nseen] = '\0';
+		if(strstr(seen, "ID : ") != NULL)
+		{
+			run->ms = bench_now_ms() - t0;
+			run->ok = 1;
+			break;
+		}
+	}
+	if(run->ok)
+	{
+		// 프롬프트에서 입력을 기다리는 동안의 매핑 크기
+		snprintf(statm, sizeof(statm), "/proc/%d/statm", (int)pid);
+		if((fp = fopen(statm, "re")) != NULL)
+		{
+			if(fscanf(fp, "%ld %ld", &vm, &rss) == 2)
+			{
+				run->vm_kb = vm * page_kb;
+				run->rss_kb = rss * page_kb;
+			}
+			fclose(fp);
+		}
+	}
+	close(in[1]);
+	while((n = read(out[0], buf, sizeof(buf))) > 0)
+	{
+		if(!run->ok && nseen + n < sizeof(seen))
+		{
+			memcpy(seen + nseen, buf, n);
+			nseen += n;
+			seen[nseen] = '\0';
+		}
+	}
+	close(out[0]);
+	if(wait4(pid, &status, 0, &ru) == pid)
+	{
+		run->minflt = ru.ru_minflt;
+		run->majflt = ru.ru_majflt;
+		if(baseline)
+		{
+			run->ms = bench_now_ms() - t0;
+			run->ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		}
+	}
+	if(!run->ok)
+	{
+		fprintf(stderr, "lsh: %s did not reach the prompt, output:\n%s\n", binary, seen);
+	}
+}
+
+static int bench_cmp_ms(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+  runs 번의 결과를 한 줄로 요약한다 (시간은 중앙값, fault 와 메모리는 평균).
+  returns the mean minor faults
+*/
+static long bench_report(const char *label, struct bench_run *r, int runs)
+{
+	double ms[runs > 0 ? runs : 1];
+	long minflt = 0, majflt = 0, vm = 0, rss = 0;
+	int i, ok = 0;
 
-	dp = opendir("/proc");
-	if(!dp)
+	for(i = 0; i < runs; i++)
 	{
-		return -1;
+		if(r[i].ok)
+		{
+			ms[ok++] = r[i].ms;
+			minflt += r[i].minflt;
+			majflt += r[i].majflt;
+			vm += r[i].vm_kb;
+			rss += r[i].rss_kb;
+		}
 	}
-	
-	
-	while((dir = readdir(dp)) != NULL)
+	if(ok == 0)
 	{
-		pid = get_pid(dir->d_name);
+		printf("%-9s no successful run\n", label);
+		return 0;
+	}
+	qsort(ms, ok, sizeof(double), bench_cmp_ms);
+	printf("%-9s %8.2f ms (min %.2f, max %.2f)  minflt %5ld  majflt %4ld", label,
+		ms[ok / 2], ms[0], ms[ok - 1], minflt / ok, majflt / ok);
+	if(vm)
+	{
+		printf("  mapped %6ld KB  rss %5ld KB", vm / ok, rss / ok);
+	}
+	printf("\n");
+	lsh_event("\"event\":\"bench_startup\",\"phase\":\"%s\",\"runs\":%d,\"median_ms\":%.3f,\"minflt\":%ld,\"majflt\":%ld,\"mapped_kb\":%ld",
+		label, ok, ms[ok / 2], minflt / ok, majflt / ok, vm / ok);
+	return minflt / ok;
+}
 
-		if(pid == -1)
+int admin_bench_startup(int argc, char **argv)
+{
+	const char *client = argc > 3 ? argv[3] : "127.0.0.1";
+	char binary[PATH_MAX];
+	struct bench_run *base, *cold, *warm;
+	long left = 0, warm_minflt;
+	int runs = argc > 2 ? atoi(argv[2]) : 5, i, over = 0;
+	ssize_t len;
+	struct stat st;
+
+	if(runs <= 0)
+	{
+		return EXIT_SUCCESS;	// 기준선 측정용: exec 와 동적 링크만 하고 끝난다
+	}
+	if(argc > 4)
+	{
+		snprintf(binary, sizeof(binary), "%s", argv[4]);
+	}
+	else if((len = readlink("/proc/self/exe", binary, sizeof(binary) - 1)) > 0)
+	{
+		binary[len] = '\0';
+	}
+	else
+	{
+		perror("lsh");
+		return EXIT_FAILURE;
+	}
+	if(stat(binary, &st) != 0)
+	{
+		perror(binary);
+		return EXIT_FAILURE;
+	}
+	// 벤치마크 자신이 check_logon 의 세션 수에 들어가지 않게 이름을 바꾼다
+	prctl(PR_SET_NAME, "lsh-bench");
+
+	base = calloc(runs * 3, sizeof(struct bench_run));
+	if(!base)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	cold = base + runs;
+	warm = cold + runs;
+	for(i = 0; i < runs; i++)
+	{
+		bench_once(binary, client, 1, &base[i]);
+	}
+	for(i = 0; i < runs; i++)
+	{
+		left += bench_evict_all(binary);
+		bench_once(binary, client, 0, &cold[i]);
+	}
+	for(i = 0; i < runs; i++)
+	{
+		bench_once(binary, client, 0, &warm[i]);
+	}
+
+	printf("%s: %lld bytes, client %s, %d runs each\n", binary, (long long)st.st_size, client, runs);
+	bench_report("baseline", base, runs);
+	bench_report("cold", cold, runs);
+	warm_minflt = bench_report("warm", warm, runs);
+	if(left > 0)
+	{
+		printf("(cold runs: %ld KB stayed cached on average, pages mapped by running processes cannot be dropped)\n", left / runs);
+	}
+	if(st.st_size > BENCH_SIZE_BUDGET)
+	{
+		printf("OVER BUDGET: binary is %lld bytes, budget %d\n", (long long)st.st_size, BENCH_SIZE_BUDGET);
+		over = 1;
+	}
+	if(warm_minflt > BENCH_MINFLT_BUDGET)
+	{
+		printf("OVER BUDGET: warm start takes %ld minor faults, budget %d\n", warm_minflt, BENCH_MINFLT_BUDGET);
+		over = 1;
+	}
+	free(base);
+	return over ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+  느린 저장소에서의 로그인 벤치마크
+
+  lsh --bench-login [--shim slowio.so] [--delays 0,20,100,500] [--jitter MS] [--fail P] [--match 이름,...]
+                    [--runs N] [--ip IP] user
+  비밀번호는 ps 나 /proc/<pid>/cmdline 에 보이지 않도록 인자가 아니라 stdin 에서 (에코 없이) 읽는다.
+  지연 단계마다 binary 를 LD_PRELOAD=shim, SLOWIO_DELAY_MS=단계 로 N 번 실행해서 user/password 로 로그인하고
+  셸 프롬프트가 나올 때까지 걸린 시간과 성공률을 출력한다. 느린 파일 (list, data, 로그 파일 ...) 이
+  로그인 경로를 얼마나 늦추는지, 실패하면 로그인까지 실패하는지 확인하는 용도.
+*/
+struct bench_login
+{
+	double gate_ms;		// exec 부터 "ID : " 까지
+	double login_ms;	// 계정을 보낸 뒤 셸 프롬프트까지
+	int ok;
+};
+
+/*
+  "ID : " 나 셸 프롬프트처럼 기다리는 문자열이 나올 때까지 읽는다. returns 1 if seen
+*/
+static int bench_expect(int fd, char *seen, size_t size, size_t *nseen, const char *want, int timeout_ms)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	double end = bench_now_ms() + timeout_ms;
+	ssize_t n;
+
+	while(strstr(seen, want) == NULL)
+	{
+		if(*nseen + 1 >= size)
+		{
+			// 앞부분은 버리고 뒤쪽만 남긴다
+			memmove(seen, seen + size / 2, *nseen - size / 2 + 1);
+			*nseen -= size / 2;
+		}
+		if(poll(&pfd, 1, (int)(end - bench_now_ms())) <= 0)
+		{
+			return 0;
+		}
+		n = read(fd, seen + *nseen, size - *nseen - 1);
+		if(n <= 0)
+		{
+			return 0;
+		}
+		*nseen += n;
+		seen[*nseen] = '\0';
+	}
+	return 1;
+}
+
+static void bench_login_once(const char *binary, char **env, const char *user, const char *pw, struct bench_login *run)
+{
+	char seen[BUF_SIZE * 4] = "", creds[BUF_SIZE * 2];
+	int in[2], out[2], i;
+	size_t nseen = 0;
+	double t0, t1;
+	pid_t pid;
+
+	memset(run, 0, sizeof(*run));
+	if(pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0)
+	{
+		perror("lsh");
+		return;
+	}
+	t0 = bench_now_ms();
+	pid = fork();
+	if(pid == 0)
+	{
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		dup2(out[1], STDERR_FILENO);
+		for(i = 0; env[i] != NULL; i++)
+		{
+			putenv(env[i]);
+		}
+		execl(binary, "lsh", (char *)NULL);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	if(pid > 0 && bench_expect(out[0], seen, sizeof(seen), &nseen, "ID : ", BENCH_LOGIN_TIMEOUT_MS))
+	{
+		t1 = bench_now_ms();
+		run->gate_ms = t1 - t0;
+		snprintf(creds, sizeof(creds), "%s\n%s\n", user, pw);
+		if(write(in[1], creds, strlen(creds)) == (ssize_t)strlen(creds)
+			&& bench_expect(out[0], seen, sizeof(seen), &nseen, "로그인완료", BENCH_LOGIN_TIMEOUT_MS)
+			&& bench_expect(out[0], seen, sizeof(seen), &nseen, "\n> ", BENCH_LOGIN_TIMEOUT_MS))
+		{
+			run->login_ms = bench_now_ms() - t1;
+			run->ok = 1;
+		}
+		explicit_bzero(creds, sizeof(creds));
+	}
+	close(in[1]);
+	close(out[0]);
+	if(pid > 0)
+	{
+		if(!run->ok)
+		{
+			kill(pid, SIGKILL);	// 멈춰 있을 수도 있다
+		}
+		waitpid(pid, NULL, 0);
+	}
+}
+
+int admin_bench_login(int argc, char **argv)
+{
+	const char *shim = NULL, *delays = "0,20,100,500", *fail = "0", *jitter = "0", *match = NULL;
+	const char *ip = "127.0.0.1", *user = NULL, *p;
+	char binary[PATH_MAX], shim_path[PATH_MAX], pw[BUF_SIZE], *env[8];
+	char e_preload[PATH_MAX + 16], e_client[BUF_SIZE], e_delay[64], e_jitter[64], e_fail[64], e_match[BUF_SIZE];
+	struct bench_login *runs;
+	double gate[BENCH_LOGIN_MAX_RUNS], login[BENCH_LOGIN_MAX_RUNS];
+	int nruns = 5, i, ok, nenv;
+	long delay;
+	ssize_t len;
+
+	for(i = 2; i < argc; i++)
+	{
+		if(i + 1 < argc && strcmp(argv[i], "--shim") == 0)
+		{
+			shim = argv[++i];
+		}
+		else if(i + 1 < argc && strcmp(argv[i], "--delays") == 0)
+		{
+			delays = argv[++i];
+		}
+		else if(i + 1 < argc && strcmp(argv[i], "--jitter") == 0)
+		{
+			jitter = argv[++i];
+		}
+		else if(i + 1 < argc && strcmp(argv[i], "--fail") == 0)
+		{
+			fail = argv[++i];
+		}
+		else if(i + 1 < argc && strcmp(argv[i], "--match") == 0)
+		{
+			match = argv[++i];
+		}
+		else if(i + 1 < argc && strcmp(argv[i], "--runs") == 0)
+		{
+			nruns = atoi(argv[++i]);
+		}
+		else if(i + 1 < argc && strcmp(argv[i], "--ip") == 0)
+		{
+			ip = argv[++i];
+		}
+		else if(user == NULL)
+		{
+			user = argv[i];
+		}
+		else
+		{
+			user = NULL;
+			break;
+		}
+	}
+	if(user == NULL || nruns <= 0 || nruns > BENCH_LOGIN_MAX_RUNS)
+	{
+		fprintf(stderr, "usage: lsh --bench-login [--shim slowio.so] [--delays 0,20,100,500] [--jitter MS] [--fail P]\n"
+			"                         [--match name,...] [--runs N (max %d)] [--ip IP] user  (password on stdin)\n",
+			BENCH_LOGIN_MAX_RUNS);
+		return EXIT_FAILURE;
+	}
+	if((len = readlink("/proc/self/exe", binary, sizeof(binary) - 1)) <= 0)
+	{
+		perror("lsh");
+		return EXIT_FAILURE;
+	}
+	binary[len] = '\0';
+	if(shim != NULL && realpath(shim, shim_path) == NULL)
+	{
+		perror(shim);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "PW : ");
+	read_password(pw, sizeof(pw));
+	fprintf(stderr, "\n");
+	prctl(PR_SET_NAME, "lsh-bench");
+	runs = calloc(nruns, sizeof(struct bench_login));
+	if(!runs)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%s, client %s, %d logins per step, shim %s, fail %s, jitter %s ms\n",
+		binary, ip, nruns, shim ? shim_path : "(none: no delay injected)", fail, jitter);
+	printf("%9s %9s %14s %14s %14s\n", "delay ms", "success", "gate median", "login median", "login max");
+	for(p = delays; *p; p += strcspn(p, ","), p += *p == ',')
+	{
+		delay = atol(p);
+		nenv = 0;
+		snprintf(e_client, sizeof(e_client), "SSH_CLIENT=%s 0 0", ip);
+		env[nenv++] = e_client;
+		if(shim != NULL)
+		{
+			snprintf(e_preload, sizeof(e_preload), "LD_PRELOAD=%s", shim_path);
+			snprintf(e_delay, sizeof(e_delay), "SLOWIO_DELAY_MS=%ld", delay);
+			snprintf(e_jitter, sizeof(e_jitter), "SLOWIO_JITTER_MS=%s", jitter);
+			snprintf(e_fail, sizeof(e_fail), "SLOWIO_FAIL=%s", fail);
+			env[nenv++] = e_preload;
+			env[nenv++] = e_delay;
+			env[nenv++] = e_jitter;
+			env[nenv++] = e_fail;
+			if(match != NULL)
+			{
+				snprintf(e_match, sizeof(e_match), "SLOWIO_MATCH=%s", match);
+				env[nenv++] = e_match;
+			}
+		}
+		env[nenv] = NULL;
+
+		for(i = 0, ok = 0; i < nruns; i++)
+		{
+			bench_login_once(binary, env, user, pw, &runs[i]);
+			if(runs[i].ok)
+			{
+				gate[ok] = runs[i].gate_ms;
+				login[ok] = runs[i].login_ms;
+				ok++;
+			}
+		}
+		if(ok == 0)
 		{
+			printf("%9ld %6d/%-2d %14s %14s %14s\n", delay, 0, nruns, "-", "-", "-");
 			continue;
 		}
+		qsort(gate, ok, sizeof(double), bench_cmp_ms);
+		qsort(login, ok, sizeof(double), bench_cmp_ms);
+		printf("%9ld %6d/%-2d %11.1f ms %11.1f ms %11.1f ms\n", delay, ok, nruns, gate[ok / 2], login[ok / 2], login[ok - 1]);
+		lsh_event("\"event\":\"bench_login\",\"delay_ms\":%ld,\"runs\":%d,\"ok\":%d,\"gate_ms\":%.3f,\"login_ms\":%.3f",
+			delay, nruns, ok, gate[ok / 2], login[ok / 2]);
+	}
+	explicit_bzero(pw, sizeof(pw));
+	free(runs);
+	return EXIT_SUCCESS;
+}
 
-		snprintf(buf, 100, "/proc/%d/status", pid);
-		fp = fopen(buf, "r");
-		if(fp == NULL)
+/*
+  zygote: 미리 준비된 lsh 에 접속 넘기기
+
+  lsh --zygote [pool] 은 공유 캐시를 매핑해 둔 채로 pool 개의 lsh-warm 프로세스를 fork 해 두고
+  zygote.sock (SOCK_SEQPACKET) 을 듣는다. sshd 가 실행한 lsh 는 소켓이 있으면 자신의 stdin/stdout/stderr,
+  현재 디렉터리, 환경변수 (SSH_CLIENT 등) 를 SCM_RIGHTS 로 warm 프로세스에 넘기고 (lsh-entry 로 이름을 바꿔서)
+  세션이 끝날 때까지 기다리기만 한다. warm 프로세스는 넘겨받은 뒤 이름을 lsh 로 바꾸고 평소처럼 게이트와 로그인을
+  거치므로 check_logon 은 세션마다 lsh 하나만 센다. 데몬은 lsh-zygote, 대기 중인 프로세스는 lsh-warm.
+  넘기는 쪽이 터미널 세션의 리더면 제어 터미널을 내려놓고, 넘겨받은 쪽이 새 세션을 만들어 그 터미널을
+  제어 터미널로 삼는다. 그래야 /dev/tty 를 여는 ssh, sudo, less 가 세션 안에서 동작한다.
+*/
+static pid_t zygote_session;	// lsh-entry: 넘겨받은 세션의 pid (프로세스 그룹)
+
+static void zygote_forward(int sig)
+{
+	if(zygote_session > 0)
+	{
+		kill(-zygote_session, sig);
+	}
+}
+
+/*
+  zygote 데몬이 떠 있으면 세션을 넘기고, 세션이 끝나면 이 프로세스도 끝낸다.
+  데몬이 없거나 넘기지 못했으면 돌아오고, 평소처럼 이 프로세스에서 시작한다.
+*/
+void zygote_handoff(void)
+{
+	static char env[ZYGOTE_ENV_MAX];
+	static const int sigs[] = { SIGINT, SIGQUIT, SIGTERM, SIGHUP, SIGWINCH };
+	char name[16] = "", buf[64];
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct sigaction sa, hup;
+	union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof(int) * 4)]; } ctl;
+	int fd, fds[4], i, tty = 0;
+	size_t len = 0, n;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(lsh_state_path(addr.sun_path, sizeof(addr.sun_path), "zygote.sock") >= (int)sizeof(addr.sun_path)
+		|| access(addr.sun_path, F_OK) != 0)
+	{
+		return;
+	}
+	// 세션은 넘겨받은 쪽이 lsh 로 센다
+	prctl(PR_GET_NAME, name);
+	prctl(PR_SET_NAME, "lsh-entry");
+	fds[3] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(fd < 0 || fds[3] < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		goto fail;
+	}
+	for(i = 0; environ[i] != NULL; i++)
+	{
+		n = strlen(environ[i]) + 1;
+		if(len + n <= sizeof(env))
+		{
+			memcpy(env + len, environ[i], n);
+			len += n;
+		}
+	}
+	fds[0] = STDIN_FILENO;
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+	iov.iov_base = env;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	memset(&ctl, 0, sizeof(ctl));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	CMSG_FIRSTHDR(&msg)->cmsg_level = SOL_SOCKET;
+	CMSG_FIRSTHDR(&msg)->cmsg_type = SCM_RIGHTS;
+	CMSG_FIRSTHDR(&msg)->cmsg_len = CMSG_LEN(sizeof(int) * 4);
+	memcpy(CMSG_DATA(CMSG_FIRSTHDR(&msg)), fds, sizeof(int) * 4);
+	// 제어 터미널을 내려놓는다. 세션 리더가 내려놓으면 포그라운드 그룹 (여기) 에 SIGHUP 이 온다.
+	if(isatty(STDIN_FILENO) && getsid(0) == getpid() && tcgetsid(STDIN_FILENO) == getpid())
+	{
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_IGN;
+		sigaction(SIGHUP, &sa, &hup);
+		tty = ioctl(STDIN_FILENO, TIOCNOTTY) == 0;
+		sigaction(SIGHUP, &hup, NULL);
+	}
+	if(sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)len)
+	{
+		goto fail;
+	}
+	// warm 프로세스가 받아들이면 자기 pid 를 보내온다
+	while((n = read(fd, &zygote_session, sizeof(zygote_session))) != sizeof(zygote_session))
+	{
+		if(n != (size_t)-1 || errno != EINTR)
+		{
+			goto fail;
+		}
+	}
+	close(fds[3]);
+
+	// 터미널의 시그널은 이 프로세스로 오므로 세션 쪽으로 넘긴다
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = zygote_forward;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	for(i = 0; i < (int)(sizeof(sigs) / sizeof(sigs[0])); i++)
+	{
+		sigaction(sigs[i], &sa, NULL);
+	}
+	// 세션이 끝나면 연결이 닫힌다
+	while((n = read(fd, buf, sizeof(buf))) != 0 && (n != (size_t)-1 || errno == EINTR))
+	{
+	}
+	exit(EXIT_SUCCESS);
+
+fail:
+	if(tty && ioctl(STDIN_FILENO, TIOCSCTTY, 0) == 0)
+	{
+		tcsetpgrp(STDIN_FILENO, getpgrp());
+	}
+	if(fd >= 0)
+	{
+		close(fd);
+	}
+	if(fds[3] >= 0)
+	{
+		close(fds[3]);
+	}
+	zygote_session = 0;
+	prctl(PR_SET_NAME, name);
+}
+
+/*
+  받아들인 연결에서 fd 와 환경변수를 받아 이 프로세스를 그 세션으로 만든다.
+  returns 0 on success, -1 if the peer is not trusted or the message is malformed
+*/
+static int zygote_adopt(int conn)
+{
+	static char env[ZYGOTE_ENV_MAX + 1];
+	union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof(int) * 4)]; } ctl;
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int fds[4], i;
+	ssize_t len;
+	pid_t pid;
+	char *p;
+
+	// 같은 사용자만 이 계정의 셸을 받을 수 있다
+	if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 || cred.uid != getuid())
+	{
+		return -1;
+	}
+	iov.iov_base = env;
+	iov.iov_len = ZYGOTE_ENV_MAX;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if(len < 0 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 4))
+	{
+		if(len >= 0 && cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			// 개수가 틀린 fd 들도 닫는다
+			for(i = 0; i < (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int)); i++)
+			{
+				close(((int *)CMSG_DATA(cmsg))[i]);
+			}
+		}
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	env[len] = '\0';
+
+	for(i = 0; i < 3; i++)
+	{
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+	if(fchdir(fds[3]) != 0)
+	{
+		perror("lsh");
+	}
+	close(fds[3]);
+	clearenv();
+	for(p = env; p < env + len; p += strlen(p) + 1)
+	{
+		if(strchr(p, '=') != NULL)
+		{
+			putenv(p);
+		}
+	}
+
+	// 새 세션의 리더가 되어 넘겨받은 터미널을 제어 터미널로 삼는다 (넘겨준 쪽이 내려놓았을 때만 된다).
+	// 터미널 시그널은 커널이 직접, 넘겨준 쪽에 온 시그널은 넘겨준 쪽이 이 프로세스 그룹으로 보낸다.
+	setsid();
+	if(isatty(STDIN_FILENO))
+	{
+		ioctl(STDIN_FILENO, TIOCSCTTY, 0);
+	}
+	pid = getpid();
+	if(write(conn, &pid, sizeof(pid)) != sizeof(pid))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  대기 중인 프로세스: 연결을 하나 받으면 그 세션이 된다. 돌아오지 않는다.
+*/
+static void zygote_warm(int lfd, int note)
+{
+	pid_t pid;
+	int conn;
+
+	prctl(PR_SET_NAME, "lsh-warm");
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	for(;;)
+	{
+		conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if(conn < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			_exit(EXIT_FAILURE);
+		}
+		if(zygote_adopt(conn) == 0)
+		{
+			break;
+		}
+		close(conn);
+	}
+	close(lfd);
+	pid = getpid();
+	if(write(note, &pid, sizeof(pid)) != sizeof(pid))
+	{
+		// 데몬이 모르면 대기 중인 프로세스가 하나 모자랄 뿐이다
+	}
+	close(note);
+
+	// conn 은 세션이 끝날 때 닫혀서 lsh-entry 를 끝낸다 (exec 하는 명령에는 넘어가지 않음)
+	prctl(PR_SET_NAME, "lsh");
+	prof_init();
+	lsh_cache_refresh();
+	exit(lsh_session());
+}
+
+static volatile sig_atomic_t zygote_stop;
+
+static void zygote_on_term(int sig)
+{
+	zygote_stop = 1;
+}
+
+static void zygote_on_chld(int sig)
+{
+	// poll 을 깨워서 끝난 세션을 바로 거둔다 (좀비도 check_logon 에 lsh 로 보인다)
+}
+
+int admin_zygote(int argc, char **argv)
+{
+	int pool = argc > 2 ? atoi(argv[2]) : ZYGOTE_POOL;
+	struct sockaddr_un addr;
+	struct pollfd pfd;
+	struct sigaction sa;
+	pid_t *warm, pid;
+	int lfd, note[2], nwarm = 0, i, died;
+
+	if(pool <= 0)
+	{
+		fprintf(stderr, "usage: lsh --zygote [pool]\n");
+		return EXIT_FAILURE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(lsh_state_path(addr.sun_path, sizeof(addr.sun_path), "zygote.sock") >= (int)sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "lsh: zygote: state directory path is too long for a unix socket (max %d bytes)\n",
+			(int)sizeof(addr.sun_path) - 1);
+		return EXIT_FAILURE;
+	}
+	unlink(addr.sun_path);
+	lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+		|| chmod(addr.sun_path, 0600) != 0 || listen(lfd, 64) != 0 || pipe2(note, O_CLOEXEC) != 0)
+	{
+		perror("lsh: zygote");
+		return EXIT_FAILURE;
+	}
+	warm = calloc(pool, sizeof(pid_t));
+	if(!warm)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	prctl(PR_SET_NAME, "lsh-zygote");
+	setsid();		// 세션들이 이 터미널을 제어 터미널로 물려받지 않게 한다
+
+	// 여기서 준비한 것은 fork 한 프로세스가 그대로 물려받는다
+	lsh_cache_open();
+	lsh_cache_command_table_matches();
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = zygote_on_term;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = zygote_on_chld;
+	sigaction(SIGCHLD, &sa, NULL);
+	fprintf(stderr, "lsh: zygote %d listening on %s with %d warm sessions\n", (int)getpid(), addr.sun_path, pool);
+
+	while(!zygote_stop)
+	{
+		while(nwarm < pool && !zygote_stop)
+		{
+			pid = fork();
+			if(pid == 0)
+			{
+				signal(SIGCHLD, SIG_DFL);
+				zygote_warm(lfd, note[1]);
+			}
+			if(pid < 0)
+			{
+				perror("lsh: zygote");
+				break;
+			}
+			warm[nwarm++] = pid;
+		}
+		pfd.fd = note[0];
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, 1000) > 0 && read(note[0], &pid, sizeof(pid)) == sizeof(pid))
 		{
-			continue;
+			// 세션이 된 프로세스는 더 이상 대기 중이 아니다
+			for(i = 0; i < nwarm && warm[i] != pid; i++)
+			{
+			}
+			if(i < nwarm)
+			{
+				warm[i] = warm[--nwarm];
+			}
 		}
-
-		fgets(line, BUF_SIZE, fp);
-		fclose(fp);
-		sscanf(line, "%s %s", tag, name);
-		
-		if(strcmp(name, program_name) == 0)
+		// 끝난 세션을 거두고, 받아들이기 전에 죽은 warm 프로세스는 다시 만든다
+		died = 0;
+		while((pid = waitpid(-1, NULL, WNOHANG)) > 0)
 		{
-			logon_count += 1;
-			if(logon_count == MAX_LOGIN + 1)
+			for(i = 0; i < nwarm && warm[i] != pid; i++)
 			{
-				printf("이미실행중입니다.\n");
-				time(&now);
-				cur_time = ctime(&now);
-				cur_time[strlen(cur_time)-1]='\0';
-				sprintf(log, "%s FULL LOGIN %s\n", cur_time, ip_addr);
-				store_failed_log(log);
-				return 1;
 			}
+			if(i < nwarm)
+			{
+				warm[i] = warm[--nwarm];
+				died = 1;
+			}
+		}
+		if(died)
+		{
+			usleep(100000);	// 계속 죽는 경우 fork 를 반복하지 않게
 		}
 	}
-	closedir(dp);
-	return 0;
+
+	unlink(addr.sun_path);
+	for(i = 0; i < nwarm; i++)
+	{
+		kill(warm[i], SIGTERM);
+	}
+	free(warm);
+	return EXIT_SUCCESS;
 }
 
-int white_list(char* ip_addr)
+/*
+  세션 목록 (sessions 파일을 모든 세션이 공유)
+  로그인한 세션마다 pid, 시작 시각 (/proc/<pid>/stat 의 starttime, pid 재사용 구분), 계정, 접속 IP 를 한 슬롯에 적는다.
+  세션이 끝나면 비우고, 죽어서 남은 슬롯은 다음 등록 때 치운다. generation 은 슬롯이 바뀔 때마다 올라간다.
+*/
+#define SESSION_MAGIC 0x6c736873	// "lshs"
+
+struct session_slot
 {
-	FILE *fp;
-	char list_ip[BUF_SIZE][BUF_SIZE];
-	char log[BUF_SIZE];
-	char *cur_time;
-	time_t now;
-	int i, lines;
+	int32_t pid;		// 0 = empty
+	uint32_t reserved;
+	uint64_t start;
+	int64_t login;
+	char user[CRED_USER_LEN];
+	char ip[48];
+};
 
-	fp = fopen("list", "r");
-	
-	if(fp == NULL)
-	{
-		printf("error! block all IP\n");
-		exit(0);
-	}
+struct session_registry
+{
+	uint32_t magic;
+	uint32_t generation;
+	struct session_slot slot[SESSION_SLOTS];
+};
 
-	i = 0;
+static struct session_registry *session_reg;
+static int session_mine = -1;
+static pid_t session_owner;
+
+/*
+  /proc/<pid>/stat 에서 부모 pid 와 starttime 을 읽는다. 프로세스가 없으면 -1
+*/
+static int session_stat(pid_t pid, pid_t *ppid, uint64_t *start)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long st;
+	int fd, ppid_i;
+	ssize_t n;
 
-	while(fgets(list_ip[i], BUF_SIZE, fp))
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
 	{
-		list_ip[i][strlen(list_ip[i]) - 1] = '\0';
-		i++;
+		return -1;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0)
+	{
+		return -1;
+	}
+	buf[n] = '\0';
+	// comm 에 공백이나 ')' 가 있을 수 있으니 마지막 ')' 뒤부터 센다
+	p = strrchr(buf, ')');
+	if(p == NULL || sscanf(p + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+		&ppid_i, &st) != 2)
+	{
+		return -1;
 	}
+	*ppid = ppid_i;
+	*start = st;
+	return 0;
+}
 
+struct session_registry *session_open(void)
+{
+	struct session_registry *reg;
+	uint32_t zero = 0;
 
-	for (int lines=0;lines<i;lines++)
+	reg = lsh_map_shared("sessions", sizeof(struct session_registry));
+	if(reg == NULL)
 	{
-		if(strcmp(list_ip[lines], ip_addr) == 0)
-		{
-			return 0;
-		}
+		return NULL;
 	}
-  printf("NOT ALLOWED IP\n");
-	
-	time(&now);
-	cur_time = ctime(&now);
-	cur_time[strlen(cur_time)-1]='\0';
-	sprintf(log, "%s NOT ALLOWED IP %s\n", cur_time, ip_addr);
-	store_failed_log(log);
-	return 1;
+	if(!__atomic_compare_exchange_n(&reg->magic, &zero, SESSION_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+		&& reg->magic != SESSION_MAGIC)
+	{
+		munmap(reg, sizeof(struct session_registry));
+		return NULL;
+	}
+	return reg;
 }
 
+static void session_unregister(void)
+{
+	int32_t pid = session_owner;
 
+	// fork 한 자식이 exit 해도 atexit 가 불리므로 주인만 지운다
+	if(session_reg == NULL || session_mine < 0 || getpid() != session_owner)
+	{
+		return;
+	}
+	if(__atomic_compare_exchange_n(&session_reg->slot[session_mine].pid, &pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	{
+		__atomic_fetch_add(&session_reg->generation, 1, __ATOMIC_RELEASE);
+	}
+	session_mine = -1;
+}
 
-void store_login_log(char* log)
+/*
+  로그인한 세션을 목록에 올린다. 목록을 못 쓰면 그냥 넘어간다 (감사 기록에서 빠질 뿐)
+*/
+void session_register(const char *ip_addr)
 {
-	FILE *fp;
-	fp = fopen("login_log", "a");
-	
-	if(fp == NULL)
+	struct session_slot *s;
+	uint64_t start;
+	int32_t cur, me = getpid();
+	pid_t ppid;
+	int i, changed = 0;
+
+	session_reg = session_open();
+	if(session_reg == NULL || session_stat(me, &ppid, &start) != 0)
 	{
-		printf("error! failed to write log\n");
-		exit(0);
+		return;
 	}
+	// 자리를 잡은 뒤에도 끝까지 돌며 죽은 슬롯을 모두 치운다
+	for(i = 0; i < SESSION_SLOTS; i++)
+	{
+		s = &session_reg->slot[i];
+		cur = __atomic_load_n(&s->pid, __ATOMIC_ACQUIRE);
+		if(cur < 0)
+		{
+			continue;	// 다른 세션이 채우는 중
+		}
+		if(cur != 0)
+		{
+			uint64_t st;
 
-	fwrite(log, strlen(log), 1,fp);
+			// 죽은 세션이 남긴 슬롯이면 치운다
+			if(session_stat(cur, &ppid, &st) == 0 && st == s->start)
+			{
+				continue;
+			}
+			if(!__atomic_compare_exchange_n(&s->pid, &cur, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			{
+				continue;
+			}
+			cur = 0;
+			changed = 1;
+		}
+		if(session_mine < 0 && __atomic_compare_exchange_n(&s->pid, &cur, -me, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			// 채우는 동안은 -pid 로 잡아 두었다가 다 쓰고 나서 보이게 한다
+			s->start = start;
+			s->login = time(NULL);
+			snprintf(s->user, sizeof(s->user), "%s", lsh_user);
+			snprintf(s->ip, sizeof(s->ip), "%s", ip_addr);
+			__atomic_store_n(&s->pid, me, __ATOMIC_RELEASE);
+			session_mine = i;
+		}
+	}
+	if(session_mine >= 0 || changed)
+	{
+		__atomic_fetch_add(&session_reg->generation, 1, __ATOMIC_RELEASE);
+	}
+	if(session_mine >= 0)
+	{
+		session_owner = me;
+		atexit(session_unregister);
+	}
 }
 
-void store_failed_log(char* log)
+/*
+  pid 가 starttime 에 시작한 세션이면 슬롯 번호, 아니면 -1
+  죽은 세션의 슬롯에 남은 pid 가 재사용되었으면 starttime 이 달라서 걸러진다.
+*/
+static int session_find(const struct session_registry *reg, pid_t pid, uint64_t start)
 {
-	FILE *fp;
-	fp = fopen("failed_log", "a");
+	int i;
 
-	if(fp == NULL)
+	for(i = 0; i < SESSION_SLOTS; i++)
 	{
-		printf("error! failed to write log\n");
-		exit(0);
+		if(__atomic_load_n(&reg->slot[i].pid, __ATOMIC_ACQUIRE) == pid && reg->slot[i].start == start)
+		{
+			return i;
+		}
 	}
-
-	fwrite(log, strlen(log), 1, fp);
+	return -1;
 }
 
+/*
+  파일 접근 감사 (opt-in)
 
-void login(char* ip_addr)
+  lsh --audit [mount...] 은 주어진 마운트 (없으면 audit_mounts 파일에 한 줄에 하나) 에 fanotify mount mark 를 걸고
+  열기 (FAN_OPEN) 와 쓰고 닫기 (FAN_CLOSE_WRITE) 를 받는다. 이벤트를 낸 프로세스에서 부모를 따라 올라가 sessions 목록의
+  세션을 찾으면 그 세션의 계정/IP 와 함께 event_log 에 "event":"audit" 로 남기고, 세션 밖으로 확인된 접근은 버린다.
+  프로세스가 벌써 끝나서 세션을 알 수 없는 접근은 "session":null 로 남긴다 (빠뜨리기보다 남기는 쪽).
+  커널이 같은 파일의 이벤트를 큐에서 합치고 read 한 번에 AUDIT_BATCH 만큼 받으므로 비용은 이벤트 수에 비례한다.
+  한 번에 받은 묶음 안에서 같은 (세션, 동작, 경로) 는 한 줄만 쓴다. CAP_SYS_ADMIN 이 필요하다.
+*/
+struct audit_pid
 {
-	FILE *fp;
-	char data_account[BUF_SIZE], data_id[BUF_SIZE * 2], data_pw[BUF_SIZE * 2];
-	char input_id[BUF_SIZE], input_pw[BUF_SIZE*2], enc_str_pw[BUF_SIZE*2], log[BUF_SIZE], single_pw;
-	int i, n;
-	char *cur_time;
-	time_t now;
+	int32_t pid;
+	int32_t slot;		// -1 = 세션 밖
+	uint32_t generation;
+	uint64_t start;		// pid 가 재사용되면 starttime 이 달라서 캐시가 맞지 않는다
+};
 
-	fp = fopen("data", "r");	
-	fgets(data_account, BUF_SIZE, fp);
-	fclose(fp);
-	sscanf(data_account, "%s : %s", data_id, data_pw);
-	
-	printf("ID : ");
-	fgets(input_id, sizeof(input_id), stdin);
-	input_id[strlen(input_id)-1]='\0'; //개행문자제거
-	printf("PW : ");
-	
-	for(i=0; i<11; i++)
+static volatile sig_atomic_t audit_stop;
+
+static void audit_on_term(int sig)
+{
+	audit_stop = 1;
+}
+
+/*
+  pid 를 띄운 세션의 슬롯. 세션 밖이면 -1, 프로세스가 벌써 끝났거나 너무 깊어서 알 수 없으면 -2.
+  올라가며 지나친 pid 들도 같은 답으로 캐시에 넣는다. 캐시는 (pid, starttime, generation) 이 모두
+  같을 때만 쓰므로 재사용된 pid 가 예전 프로세스의 답을 물려받지 않는다.
+*/
+static int audit_session(const struct session_registry *reg, struct audit_pid *cache, pid_t pid)
+{
+	pid_t chain[AUDIT_MAX_DEPTH], ppid;
+	uint64_t starts[AUDIT_MAX_DEPTH], start;
+	uint32_t gen = __atomic_load_n(&reg->generation, __ATOMIC_ACQUIRE);
+	struct audit_pid *c;
+	int n, slot = -2, i;
+
+	for(n = 0; n < AUDIT_MAX_DEPTH; n++)
 	{
-		single_pw = getch();
-		if((int)single_pw == 10)
+		if(pid <= 1)
+		{
+			slot = -1;
+			break;
+		}
+		if(session_stat(pid, &ppid, &start) != 0)
+		{
+			// 벌써 끝난 프로세스는 캐시하지 않는다 (pid 가 곧 재사용될 수 있다)
+			return -2;
+		}
+		c = &cache[pid % AUDIT_PID_CACHE];
+		if(c->pid == pid && c->start == start && c->generation == gen)
 		{
+			slot = c->slot;
 			break;
 		}
-		input_pw[i] = single_pw;
+		chain[n] = pid;
+		starts[n] = start;
+		if((slot = session_find(reg, pid, start)) >= 0)
+		{
+			n++;
+			break;
+		}
+		slot = -2;
+		pid = ppid;
+	}
+	if(slot == -2)
+	{
+		return -2;
+	}
+	for(i = 0; i < n; i++)
+	{
+		c = &cache[chain[i] % AUDIT_PID_CACHE];
+		c->pid = chain[i];
+		c->start = starts[i];
+		c->slot = slot;
+		c->generation = gen;
 	}
+	return slot;
+}
 
-	int enc_pw[strlen(input_pw)*2];
+/*
+  event_log (O_APPEND) 에 한 줄을 통째로 붙인다. 감사 기록은 비동기 큐 (가득 차면 버림, EV_LEN 에서 자름) 를
+  거치지 않고 여기서 끝까지 쓴다. 디스크가 밀리면 fanotify 를 덜 읽게 되고 쌓인 것은 커널 큐가 맡는다.
+*/
+static void audit_write(int fd, char *line, size_t size, const char *fmt, ...)
+{
+	struct timespec ts;
+	va_list ap;
+	size_t len, off;
+	ssize_t n;
 
-	for(i=0;i<strlen(input_pw);i++)
+	clock_gettime(CLOCK_REALTIME, &ts);
+	len = snprintf(line, size, "{\"time\":%lld.%03ld,\"pid\":%d,", (long long)ts.tv_sec, ts.tv_nsec / 1000000, (int)getpid());
+	va_start(ap, fmt);
+	len += vsnprintf(line + len, size - len, fmt, ap);
+	va_end(ap);
+	if(len > size - 3)
+	{
+		return;		// 버퍼는 PATH_MAX 경로가 들어가게 잡았으니 오지 않는다
+	}
+	strcpy(line + len, "}\n");
+	len += 2;
+	for(off = 0; off < len; off += n)
 	{
-		enc_pw[2*i] = (input_pw[i]-1);
-		enc_pw[2*i+1] = 46-1;
+		n = write(fd, line + off, len - off);
+		if(n < 0 && errno == EINTR)
+		{
+			n = 0;
+			continue;
+		}
+		if(n <= 0)
+		{
+			return;
+		}
 	}
+}
+
+int admin_audit(int argc, char **argv)
+{
+	// 경로의 제어 문자는 \u00XX (6바이트) 로 늘어난다
+	char path[PATH_MAX], link[64], line[PATH_MAX], path_json[PATH_MAX * 6], user_json[CRED_USER_LEN * 6], ip_json[48 * 6];
+	char record[sizeof(path_json) + sizeof(user_json) + sizeof(ip_json) + 256];
+	struct fanotify_event_metadata *ev;
+	struct session_registry *reg;
+	struct audit_pid *cache;
+	struct session_slot *s;
+	uint64_t *seen, key;
+	unsigned long long total = 0, logged = 0, overflow = 0;
+	struct sigaction sa;
+	struct pollfd pfd;
+	char *buf;
+	ssize_t len, plen;
+	int fan, out, i, marked = 0, slot;
+	FILE *fp;
 
-	for(i = 0;i<sizeof(enc_pw)/sizeof(int);i++)
+	reg = session_open();
+	fan = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE | O_CLOEXEC | O_NOATIME);
+	if(reg == NULL || fan < 0)
 	{
-		sprintf(enc_str_pw, "%s%d", enc_str_pw, enc_pw[i]);
+		perror("lsh: audit");
+		return EXIT_FAILURE;
 	}
-	
-	if((strcmp(data_id, input_id)) == 0 && (strcmp(data_pw, enc_str_pw)) == 0)
+
+	if(argc > 2)
 	{
-		printf("\n로그인완료\n");
-		time(&now);
-		cur_time = ctime(&now);
-		cur_time[strlen(cur_time)-1]='\0';
-		sprintf(log, "%s Login at %s\n", cur_time, ip_addr);
-		printf("%s", log);
-		store_login_log(log);
+		for(i = 2; i < argc; i++)
+		{
+			if(fanotify_mark(fan, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN | FAN_CLOSE_WRITE, AT_FDCWD, argv[i]) == 0)
+			{
+				marked++;
+			}
+			else
+			{
+				fprintf(stderr, "lsh: audit: %s: %s\n", argv[i], strerror(errno));
+			}
+		}
 	}
 	else
 	{
-		printf("\n로그인실패\n");
-		time(&now);
-		cur_time = ctime(&now);
-		cur_time[strlen(cur_time)-1]='\0';
-		sprintf(log, "%s Login failed at %s\n", cur_time, ip_addr);
-		store_failed_log(log);
-		exit(0);
+		lsh_state_path(path, sizeof(path), "audit_mounts");
+		fp = fopen(path, "r");
+		while(fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+		{
+			line[strcspn(line, "\r\n")] = '\0';
+			if(line[0] == '\0' || line[0] == '#')
+			{
+				continue;
+			}
+			if(fanotify_mark(fan, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_OPEN | FAN_CLOSE_WRITE, AT_FDCWD, line) == 0)
+			{
+				marked++;
+			}
+			else
+			{
+				fprintf(stderr, "lsh: audit: %s: %s\n", line, strerror(errno));
+			}
+		}
+		if(fp != NULL)
+		{
+			fclose(fp);
+		}
+	}
+	if(marked == 0)
+	{
+		fprintf(stderr, "usage: lsh --audit [mount...] (or one mount per line in audit_mounts)\n");
+		close(fan);
+		return EXIT_FAILURE;
+	}
+
+	lsh_state_path(path, sizeof(path), "event_log");
+	out = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+	if(out < 0)
+	{
+		fprintf(stderr, "lsh: audit: %s: %s\n", path, strerror(errno));
+		close(fan);
+		return EXIT_FAILURE;
+	}
+
+	buf = aligned_alloc(__alignof__(struct fanotify_event_metadata), AUDIT_BATCH);
+	cache = calloc(AUDIT_PID_CACHE, sizeof(struct audit_pid));
+	seen = malloc(AUDIT_SEEN * sizeof(uint64_t));
+	if(!buf || !cache || !seen)
+	{
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	prctl(PR_SET_NAME, "lsh-audit");
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = audit_on_term;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	fprintf(stderr, "lsh: audit %d watching %d mount(s)\n", (int)getpid(), marked);
+
+	pfd.fd = fan;
+	pfd.events = POLLIN;
+	while(!audit_stop)
+	{
+		if(poll(&pfd, 1, -1) < 0)
+		{
+			continue;
+		}
+		len = read(fan, buf, AUDIT_BATCH);
+		if(len <= 0)
+		{
+			continue;
+		}
+		memset(seen, 0, AUDIT_SEEN * sizeof(uint64_t));
+		for(ev = (struct fanotify_event_metadata *)buf; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len))
+		{
+			total++;
+			if(ev->mask & FAN_Q_OVERFLOW)
+			{
+				overflow++;
+				continue;
+			}
+			if(ev->fd < 0)
+			{
+				continue;
+			}
+			// 세션 밖으로 확인된 접근만 버린다. 누구 것인지 알 수 없으면 "session":null 로 남긴다.
+			slot = ev->pid == getpid() ? -1 : audit_session(reg, cache, ev->pid);
+			if(slot != -1)
+			{
+				snprintf(link, sizeof(link), "/proc/self/fd/%d", ev->fd);
+				plen = readlink(link, path, sizeof(path) - 1);
+				path[plen > 0 ? plen : 0] = '\0';
+
+				// 이 묶음 안에서 이미 쓴 (세션, 동작, 경로) 는 건너뛴다
+				key = wl_hash(path) * 31 + slot * 2 + !!(ev->mask & FAN_CLOSE_WRITE);
+				key = key ? key : 1;
+				for(i = key % AUDIT_SEEN; seen[i] != 0 && seen[i] != key; i = (i + 1) % AUDIT_SEEN)
+				{
+				}
+				if(seen[i] != key && slot < 0)
+				{
+					seen[i] = key;
+					lsh_json_str(path_json, sizeof(path_json), path);
+					audit_write(out, record, sizeof(record),
+						"\"event\":\"audit\",\"session\":null,\"user\":null,\"ip\":null,\"proc\":%d,\"op\":\"%s\",\"path\":\"%s\"",
+						(int)ev->pid, ev->mask & FAN_CLOSE_WRITE ? "write" : "open", path_json);
+					logged++;
+				}
+				else if(seen[i] != key)
+				{
+					seen[i] = key;
+					s = &reg->slot[slot];
+					lsh_json_str(path_json, sizeof(path_json), path);
+					lsh_json_str(user_json, sizeof(user_json), s->user);
+					lsh_json_str(ip_json, sizeof(ip_json), s->ip);
+					audit_write(out, record, sizeof(record),
+						"\"event\":\"audit\",\"session\":%d,\"user\":\"%s\",\"ip\":\"%s\",\"proc\":%d,\"op\":\"%s\",\"path\":\"%s\"",
+						(int)s->pid, user_json, ip_json, (int)ev->pid,
+						ev->mask & FAN_CLOSE_WRITE ? "write" : "open", path_json);
+					logged++;
+				}
+			}
+			close(ev->fd);
+		}
 	}
+
+	audit_write(out, record, sizeof(record), "\"event\":\"audit_stop\",\"events\":%llu,\"logged\":%llu,\"overflow\":%llu",
+		total, logged, overflow);
+	close(out);
+	close(fan);
+	free(buf);
+	free(cache);
+	free(seen);
+	return EXIT_SUCCESS;
 }
 
-/**
-   @brief Main entry point.
-   @param argc Argument count.
-   @param argv Argument vector.
-   @return status code
- */
-int main(int argc, char **argv)
+/*
+  sshd 가 실행한 세션: 게이트를 거쳐 로그인한 뒤 명령 루프를 돈다
+*/
+int lsh_session(void)
 {
-
 	int check_result, IP_result;
 	char* s = getenv("SSH_CLIENT");
 	char CLIENT_IP[BUF_SIZE], CLIENT_PORT[BUF_SIZE], SERVER_PORT[BUF_SIZE];
-	
+
 	sscanf(s, "%s %s %s", CLIENT_IP, CLIENT_PORT, SERVER_PORT);
 
 	IP_result = white_list(CLIENT_IP);
@@ -529,6 +10973,11 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
+	if(admit_rate(CLIENT_IP) == 1)
+	{
+		exit(0);
+	}
+
 	check_result = check_logon(CLIENT_IP);
 	if(check_result == 1)
 	{
@@ -536,11 +10985,14 @@ int main(int argc, char **argv)
 	}
 
 	login(CLIENT_IP);
+	session_register(CLIENT_IP);
 
 
   // Load config files, if any.
 
   // Run command loop.
+  lsh_state_init();
+  lsh_mem_init();
   lsh_loop();
 
   // Perform any shutdown/cleanup.
@@ -548,3 +11000,27 @@ int main(int argc, char **argv)
   return EXIT_SUCCESS;
 }
 
+/**
+   @brief Main entry point.
+   @param argc Argument count.
+   @param argv Argument vector.
+   @return status code
+ */
+int main(int argc, char **argv)
+{
+	if(getcwd(lsh_state_dir, sizeof(lsh_state_dir)) == NULL)
+	{
+		strcpy(lsh_state_dir, ".");
+	}
+
+	if(argc > 1)
+	{
+		prof_init();
+		return lsh_admin(argc, argv);
+	}
+
+	// zygote 데몬이 있으면 미리 준비된 lsh 에 넘기고 여기서는 기다리기만 한다
+	zygote_handoff();
+	prof_init();
+	return lsh_session();
+}
@@ -0,0 +1,360 @@
+/*
+  느린 저장소 흉내 (LD_PRELOAD 용)
+
+  빌드 : gcc -O2 -shared -fPIC -o slowio.so slowio.c -ldl
+  사용 : LD_PRELOAD=./slowio.so SLOWIO_DELAY_MS=200 ./lsh
+         (lsh --bench-login 이 이 라이브러리로 지연을 바꿔가며 로그인을 재 본다)
+
+  이름이 SLOWIO_MATCH 에 걸리는 파일을 열고, 읽고, 쓰고, 닫을 때마다 지연을 넣고
+  SLOWIO_FAIL 확률로 EIO 를 돌려준다. 네트워크 저장소가 멈칫하는 상황을 흉내낸다.
+
+  SLOWIO_MATCH     쉼표로 나눈 파일 이름 조각 (기본 list,data,cred_store,login_log,failed_log,lsh_cache)
+                   "*" 이면 모든 파일
+  SLOWIO_DELAY_MS  한 번 호출할 때마다 넣는 지연 (기본 0)
+  SLOWIO_JITTER_MS 지연에 더하는 0 ~ 이 값 사이의 무작위 지연 (기본 0)
+  SLOWIO_FAIL      열기/쓰기가 EIO 로 실패할 확률 0.0 ~ 1.0 (기본 0)
+
+  stdio 는 libc 안에서 바로 시스템 호출을 하므로 fopen/fgets/fread/fflush/fclose 도 따로 가로챈다.
+  mmap 으로 읽는 부분 (lsh_cache, cred_store 의 레코드) 은 open 에서만 느려진다.
+*/
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLOWIO_FDS 4096
+#define SLOWIO_MATCH_DEFAULT "list,data,cred_store,login_log,failed_log,lsh_cache"
+
+static struct
+{
+	char match[1024];
+	long delay_ms;
+	long jitter_ms;
+	double fail;
+	unsigned char fd[SLOWIO_FDS];	// 1 이면 느린 파일
+	unsigned seed;
+} slowio;
+
+static pthread_once_t slowio_once = PTHREAD_ONCE_INIT;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static FILE *(*real_fopen)(const char *, const char *);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_pread)(int, void *, size_t, off_t);
+static ssize_t (*real_pwrite)(int, const void *, size_t, off_t);
+static int (*real_fsync)(int);
+static int (*real_close)(int);
+static char *(*real_fgets)(char *, int, FILE *);
+static size_t (*real_fread)(void *, size_t, size_t, FILE *);
+static int (*real_fflush)(FILE *);
+static int (*real_fclose)(FILE *);
+
+static void slowio_init(void)
+{
+	const char *v;
+
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_openat = dlsym(RTLD_NEXT, "openat");
+	real_fopen = dlsym(RTLD_NEXT, "fopen");
+	real_read = dlsym(RTLD_NEXT, "read");
+	real_write = dlsym(RTLD_NEXT, "write");
+	real_pread = dlsym(RTLD_NEXT, "pread");
+	real_pwrite = dlsym(RTLD_NEXT, "pwrite");
+	real_fsync = dlsym(RTLD_NEXT, "fsync");
+	real_close = dlsym(RTLD_NEXT, "close");
+	real_fgets = dlsym(RTLD_NEXT, "fgets");
+	real_fread = dlsym(RTLD_NEXT, "fread");
+	real_fflush = dlsym(RTLD_NEXT, "fflush");
+	real_fclose = dlsym(RTLD_NEXT, "fclose");
+
+	v = getenv("SLOWIO_MATCH");
+	snprintf(slowio.match, sizeof(slowio.match), "%s", v ? v : SLOWIO_MATCH_DEFAULT);
+	slowio.delay_ms = (v = getenv("SLOWIO_DELAY_MS")) ? atol(v) : 0;
+	slowio.jitter_ms = (v = getenv("SLOWIO_JITTER_MS")) ? atol(v) : 0;
+	slowio.fail = (v = getenv("SLOWIO_FAIL")) ? atof(v) : 0;
+	slowio.seed = (unsigned)getpid() ^ (unsigned)time(NULL);
+}
+
+#define SLOWIO_INIT() pthread_once(&slowio_once, slowio_init)
+
+/*
+  path 의 마지막 이름이 SLOWIO_MATCH 의 조각 중 하나를 포함하면 1
+*/
+static int slowio_match(const char *path)
+{
+	const char *base, *p, *comma;
+	char part[256];
+	size_t len;
+
+	if(path == NULL)
+	{
+		return 0;
+	}
+	if(strcmp(slowio.match, "*") == 0)
+	{
+		return 1;
+	}
+	base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	for(p = slowio.match; *p; p = *comma ? comma + 1 : comma)
+	{
+		comma = strchr(p, ',');
+		if(comma == NULL)
+		{
+			comma = p + strlen(p);
+		}
+		len = comma - p < (long)sizeof(part) ? (size_t)(comma - p) : sizeof(part) - 1;
+		memcpy(part, p, len);
+		part[len] = '\0';
+		if(len > 0 && strstr(base, part) != NULL)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int slowio_is_slow(int fd)
+{
+	return fd >= 0 && fd < SLOWIO_FDS && slowio.fd[fd];
+}
+
+static void slowio_mark(int fd, int slow)
+{
+	if(fd >= 0 && fd < SLOWIO_FDS)
+	{
+		slowio.fd[fd] = slow;
+	}
+}
+
+static void slowio_stall(void)
+{
+	struct timespec ts;
+	long ms = slowio.delay_ms;
+
+	if(slowio.jitter_ms > 0)
+	{
+		ms += rand_r(&slowio.seed) % (slowio.jitter_ms + 1);
+	}
+	if(ms <= 0)
+	{
+		return;
+	}
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	while(nanosleep(&ts, &ts) != 0 && errno == EINTR)
+	{
+	}
+}
+
+/*
+  지연을 넣고, SLOWIO_FAIL 확률로 1 (실패시킬 것) 을 돌려준다
+*/
+static int slowio_hit(void)
+{
+	int saved = errno;
+
+	slowio_stall();
+	errno = saved;
+	return slowio.fail > 0 && rand_r(&slowio.seed) < slowio.fail * ((double)RAND_MAX + 1);
+}
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+	int fd, slow;
+
+	SLOWIO_INIT();
+	if(flags & (O_CREAT | O_TMPFILE))
+	{
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	slow = slowio_match(path);
+	if(slow && slowio_hit())
+	{
+		errno = EIO;
+		return -1;
+	}
+	fd = real_open(path, flags, mode);
+	slowio_mark(fd, slow);
+	return fd;
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+	int fd, slow;
+
+	SLOWIO_INIT();
+	if(flags & (O_CREAT | O_TMPFILE))
+	{
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	slow = slowio_match(path);
+	if(slow && slowio_hit())
+	{
+		errno = EIO;
+		return -1;
+	}
+	fd = real_openat(dirfd, path, flags, mode);
+	slowio_mark(fd, slow);
+	return fd;
+}
+
+int openat64(int dirfd, const char *path, int flags, ...) __attribute__((alias("openat")));
+
+FILE *fopen(const char *path, const char *mode)
+{
+	FILE *fp;
+	int slow;
+
+	SLOWIO_INIT();
+	slow = slowio_match(path);
+	if(slow && slowio_hit())
+	{
+		errno = EIO;
+		return NULL;
+	}
+	fp = real_fopen(path, mode);
+	if(fp != NULL)
+	{
+		slowio_mark(fileno(fp), slow);
+	}
+	return fp;
+}
+
+FILE *fopen64(const char *path, const char *mode) __attribute__((alias("fopen")));
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	SLOWIO_INIT();
+	if(slowio_is_slow(fd))
+	{
+		slowio_stall();
+	}
+	return real_read(fd, buf, count);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+	SLOWIO_INIT();
+	if(slowio_is_slow(fd))
+	{
+		slowio_stall();
+	}
+	return real_pread(fd, buf, count, offset);
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off_t offset) __attribute__((alias("pread")));
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	SLOWIO_INIT();
+	if(slowio_is_slow(fd) && slowio_hit())
+	{
+		errno = EIO;
+		return -1;
+	}
+	return real_write(fd, buf, count);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	SLOWIO_INIT();
+	if(slowio_is_slow(fd) && slowio_hit())
+	{
+		errno = EIO;
+		return -1;
+	}
+	return real_pwrite(fd, buf, count, offset);
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off_t offset) __attribute__((alias("pwrite")));
+
+int fsync(int fd)
+{
+	SLOWIO_INIT();
+	if(slowio_is_slow(fd))
+	{
+		slowio_stall();
+	}
+	return real_fsync(fd);
+}
+
+int close(int fd)
+{
+	SLOWIO_INIT();
+	slowio_mark(fd, 0);
+	return real_close(fd);
+}
+
+char *fgets(char *buf, int size, FILE *fp)
+{
+	SLOWIO_INIT();
+	if(slowio_is_slow(fileno(fp)))
+	{
+		slowio_stall();
+	}
+	return real_fgets(buf, size, fp);
+}
+
+size_t fread(void *buf, size_t size, size_t n, FILE *fp)
+{
+	SLOWIO_INIT();
+	if(slowio_is_slow(fileno(fp)))
+	{
+		slowio_stall();
+	}
+	return real_fread(buf, size, n, fp);
+}
+
+/*
+  stdio 버퍼는 fflush/fclose 때 한꺼번에 써지므로 여기서 쓰기 지연과 실패를 넣는다
+*/
+int fflush(FILE *fp)
+{
+	SLOWIO_INIT();
+	if(fp != NULL && slowio_is_slow(fileno(fp)) && slowio_hit())
+	{
+		errno = EIO;
+		return EOF;
+	}
+	return real_fflush(fp);
+}
+
+int fclose(FILE *fp)
+{
+	int fd;
+
+	SLOWIO_INIT();
+	fd = fileno(fp);
+	if(slowio_is_slow(fd) && slowio_hit())
+	{
+		// 써야 할 내용을 잃은 것처럼 버리고 닫는다
+		__fpurge(fp);
+		slowio_mark(fd, 0);
+		real_fclose(fp);
+		errno = EIO;
+		return EOF;
+	}
+	slowio_mark(fd, 0);
+	return real_fclose(fp);
+}